@@ -0,0 +1,1118 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <cerrno>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "include/converter.h"
+#include "include/segments.h"
+
+extern "C" {
+  #include <libavutil/opt.h>
+  #include <libswscale/swscale.h>
+}
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 360
+#define BENCH_FPS 30
+#define BENCH_FRAMES 120
+// decoded frames held for the color conversion stages, recorded clips are cut
+#define BENCH_COLOR_FRAMES 120
+// pixels of those frames mapped by the palette lookup stages
+#define BENCH_LOOKUP_PIXELS (1 << 20)
+
+// every synthetic clip is a pure function of (frameIndex, x, y) so the corpus is
+// byte-identical between runs and machines as long as the encoder is the same build
+typedef void (*FillFrameFunc)(AVFrame* frame, int frameIndex);
+
+struct SyntheticClip {
+  const char* name;
+  FillFrameFunc fill;
+};
+
+struct BenchClip {
+  std::string name;
+  std::string source;
+  std::string path;
+};
+
+struct ConvertVariant {
+  const char* name;
+  LzwOptions lzw;
+  SceneOptions scene;
+  bool twoPass;
+  int colorHysteresis;
+  // parts the range is split into, see ConvertToGifSegments
+  int segments;
+};
+
+// every operator new in the process, which is how our own code allocates;
+// the frame arena is only drawn from before the first frame
+static std::atomic<uint64_t> allocationCount(0);
+// every malloc, calloc, realloc and aligned allocation in the process,
+// libav's and giflib's included. Defining them here interposes them for
+// the shared libraries too, they hand on to glibc's own
+static std::atomic<uint64_t> mallocCount(0);
+
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t count, size_t size);
+  void* __libc_realloc(void* pointer, size_t size);
+  void* __libc_memalign(size_t alignment, size_t size);
+  void __libc_free(void* pointer);
+
+  void* malloc(size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+  }
+
+  void* calloc(size_t count, size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+  }
+
+  void* realloc(void* pointer, size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+  }
+
+  void free(void* pointer) {
+    __libc_free(pointer);
+  }
+
+  // av_malloc goes through here
+  int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    *pointer = __libc_memalign(alignment, size);
+    return *pointer ? 0 : ENOMEM;
+  }
+
+  void* aligned_alloc(size_t alignment, size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+  }
+
+  void* memalign(size_t alignment, size_t size) {
+    mallocCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+  }
+}
+
+void* operator new(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void* pointer = malloc(size ? size : 1);
+  if(!pointer) throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+  free(pointer);
+}
+
+struct StageResult {
+  const char* stage;
+  double seconds;
+  int frames;
+  double megabytes;
+  long peakRssKb;
+  long outputBytes;
+  bool hasPipeline;
+  ConvertStats pipeline;
+  // operator new calls between the first and the last emitted frame,
+  // should be 0
+  long steadyAllocations;
+  // every heap allocation in the same window, libav's included; the
+  // decode stage has it too, over its first to last frame
+  bool hasMallocs;
+  long steadyMallocs;
+  // pixels handled, for the stages that measure per pixel work
+  double pixels;
+  // file bytes read and decode time until every 8th row of the image is
+  // known, for the first paint stages
+  long firstPaintBytes;
+  double firstPaintSeconds;
+};
+
+struct AllocationWindow {
+  uint64_t first;
+  uint64_t last;
+  uint64_t firstMalloc;
+  uint64_t lastMalloc;
+  bool started;
+};
+
+static void CountFrameAllocations(void* user, int, int) {
+  AllocationWindow* window = (AllocationWindow*)user;
+  uint64_t now = allocationCount.load(std::memory_order_relaxed);
+  uint64_t nowMalloc = mallocCount.load(std::memory_order_relaxed);
+  if(!window->started) {
+    window->first = now;
+    window->firstMalloc = nowMalloc;
+    window->started = true;
+  }
+  window->last = now;
+  window->lastMalloc = nowMalloc;
+}
+
+static uint32_t Hash32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+static void FillChroma(AVFrame* frame, uint8_t u, uint8_t v) {
+  for(int y = 0; y < frame->height / 2; ++y) {
+    memset(frame->data[1] + y * frame->linesize[1], u, frame->width / 2);
+    memset(frame->data[2] + y * frame->linesize[2], v, frame->width / 2);
+  }
+}
+
+// a desktop with a few windows and a blinking cursor
+static void FillStaticScreen(AVFrame* frame, int frameIndex) {
+  for(int y = 0; y < frame->height; ++y) {
+    uint8_t* row = frame->data[0] + y * frame->linesize[0];
+    for(int x = 0; x < frame->width; ++x) {
+      uint8_t value = 200;
+      if(x > 40 && x < 360 && y > 30 && y < 300) value = (y < 50) ? 90 : 245;
+      if(x > 380 && x < 620 && y > 60 && y < 220) value = (y < 80) ? 60 : 235;
+      if(y > frame->height - 24) value = 40;
+      row[x] = value;
+    }
+  }
+
+  if((frameIndex / 15) % 2 == 0) {
+    for(int y = 70; y < 86; ++y) {
+      memset(frame->data[0] + y * frame->linesize[0] + 60, 0, 2);
+    }
+  }
+  FillChroma(frame, 128, 128);
+}
+
+// lines of pseudo glyphs scrolling up two pixels per frame
+static void FillScrollingText(AVFrame* frame, int frameIndex) {
+  const int glyphWidth = 8;
+  const int lineHeight = 14;
+  int scroll = frameIndex * 2;
+
+  for(int y = 0; y < frame->height; ++y) {
+    uint8_t* row = frame->data[0] + y * frame->linesize[0];
+    int docY = y + scroll;
+    int line = docY / lineHeight;
+    int glyphY = docY % lineHeight;
+    int lineLength = 20 + Hash32(line) % 50;
+
+    for(int x = 0; x < frame->width; ++x) {
+      int column = (x - 16) / glyphWidth;
+      int glyphX = (x - 16) % glyphWidth;
+      bool ink = false;
+      if(x >= 16 && column < lineLength && glyphY >= 2 && glyphY < 11 && glyphX < 6) {
+        uint32_t glyph = Hash32(line * 131 + column);
+        ink = (glyph >> (((glyphY - 2) / 3) * 3 + glyphX / 2)) & 1;
+      }
+      row[x] = ink ? 30 : 250;
+    }
+  }
+  FillChroma(frame, 128, 128);
+}
+
+// every pixel changes every frame, the worst case for both the diff and lzw
+static void FillNoise(AVFrame* frame, int frameIndex) {
+  for(int plane = 0; plane < 3; ++plane) {
+    int planeWidth = plane == 0 ? frame->width : frame->width / 2;
+    int planeHeight = plane == 0 ? frame->height : frame->height / 2;
+    for(int y = 0; y < planeHeight; ++y) {
+      uint8_t* row = frame->data[plane] + y * frame->linesize[plane];
+      for(int x = 0; x < planeWidth; ++x) {
+        row[x] = Hash32((frameIndex * 3 + plane) * 1000003u + y * planeWidth + x) & 0xff;
+      }
+    }
+  }
+}
+
+// a moving ball over a gradient, with a hard cut to a different scene every second
+static void FillSceneCuts(AVFrame* frame, int frameIndex) {
+  int scene = frameIndex / BENCH_FPS;
+  int t = frameIndex % BENCH_FPS;
+  uint32_t sceneSeed = Hash32(scene + 1);
+  int ballX = (sceneSeed % frame->width) + t * 6;
+  int ballY = ((sceneSeed >> 12) % frame->height);
+
+  for(int y = 0; y < frame->height; ++y) {
+    uint8_t* row = frame->data[0] + y * frame->linesize[0];
+    for(int x = 0; x < frame->width; ++x) {
+      int gradient = (scene % 2 == 0) ? x * 255 / frame->width : y * 255 / frame->height;
+      int dx = x - ballX % frame->width;
+      int dy = y - ballY;
+      row[x] = (dx * dx + dy * dy < 40 * 40) ? 255 - gradient : gradient;
+    }
+  }
+  FillChroma(frame, 64 + (sceneSeed & 0x7f), 64 + ((sceneSeed >> 8) & 0x7f));
+}
+
+static int EncodeAndMux(AVCodecContext* encoder, AVFrame* frame, AVFormatContext* muxer, AVStream* stream) {
+  if(avcodec_send_frame(encoder, frame) < 0) {
+    return 1;
+  }
+
+  AVPacket* packet = av_packet_alloc();
+  while(avcodec_receive_packet(encoder, packet) == 0) {
+    av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+    packet->stream_index = stream->index;
+    if(av_interleaved_write_frame(muxer, packet) < 0) {
+      av_packet_free(&packet);
+      return 1;
+    }
+  }
+  av_packet_free(&packet);
+  return 0;
+}
+
+int GenerateSyntheticClip(const SyntheticClip& clip, const char* path) {
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if(!codec) {
+    fprintf(stderr, "no H264 encoder in this libavcodec build, cannot generate the synthetic corpus\n");
+    return 1;
+  }
+
+  AVFormatContext* muxer = nullptr;
+  if(avformat_alloc_output_context2(&muxer, nullptr, nullptr, path) < 0) {
+    fprintf(stderr, "cannot create a muxer for %s\n", path);
+    return 1;
+  }
+
+  AVStream* stream = avformat_new_stream(muxer, nullptr);
+  AVCodecContext* encoder = avcodec_alloc_context3(codec);
+  encoder->width = BENCH_WIDTH;
+  encoder->height = BENCH_HEIGHT;
+  encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+  encoder->time_base = AVRational{1, BENCH_FPS};
+  encoder->framerate = AVRational{BENCH_FPS, 1};
+  encoder->gop_size = BENCH_FPS * 2;
+  encoder->max_b_frames = 2;
+  // one thread so the bitstream does not depend on the core count
+  encoder->thread_count = 1;
+  av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+  if(muxer->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  int ret = 1;
+  AVFrame* frame = av_frame_alloc();
+  frame->format = encoder->pix_fmt;
+  frame->width = encoder->width;
+  frame->height = encoder->height;
+
+  if(avcodec_open2(encoder, codec, nullptr) < 0 || av_frame_get_buffer(frame, 0) < 0) {
+    fprintf(stderr, "cannot open the H264 encoder\n");
+    goto cleanup;
+  }
+
+  avcodec_parameters_from_context(stream->codecpar, encoder);
+  stream->time_base = encoder->time_base;
+
+  if(avio_open(&muxer->pb, path, AVIO_FLAG_WRITE) < 0 || avformat_write_header(muxer, nullptr) < 0) {
+    fprintf(stderr, "cannot write %s\n", path);
+    goto cleanup;
+  }
+
+  for(int i = 0; i < BENCH_FRAMES; ++i) {
+    av_frame_make_writable(frame);
+    clip.fill(frame, i);
+    frame->pts = i;
+    if(EncodeAndMux(encoder, frame, muxer, stream) != 0) {
+      fprintf(stderr, "encoding frame %d of %s failed\n", i, clip.name);
+      goto cleanup;
+    }
+  }
+
+  if(EncodeAndMux(encoder, nullptr, muxer, stream) == 0 && av_write_trailer(muxer) == 0) {
+    ret = 0;
+  }
+
+cleanup:
+  av_frame_free(&frame);
+  avcodec_free_context(&encoder);
+  if(muxer->pb) avio_closep(&muxer->pb);
+  avformat_free_context(muxer);
+  return ret;
+}
+
+static long FileSize(const char* path) {
+  struct stat st;
+  if(stat(path, &st) != 0) return 0;
+  return st.st_size;
+}
+
+static long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// demux + decode only, no gif work, so the convert stage can be read relative to it
+int BenchDecode(const char* path, StageResult* stage) {
+  VideoInput input;
+  if(OpenVideoInput(path, &input, false) != 0) {
+    return 1;
+  }
+
+  AVPacket* packet = av_packet_alloc();
+  AVFrame* frame = av_frame_alloc();
+  int frames = 0;
+  AllocationWindow window = {};
+
+  auto start = std::chrono::steady_clock::now();
+  while(av_read_frame(input.formatContext, packet) == 0) {
+    if(packet->stream_index == input.videoStreamIndex && avcodec_send_packet(input.codecContext, packet) == 0) {
+      while(avcodec_receive_frame(input.codecContext, frame) == 0) {
+        ++frames;
+        CountFrameAllocations(&window, frames, 0);
+      }
+    }
+    av_packet_unref(packet);
+  }
+  stage->seconds = SecondsSince(start);
+  stage->hasMallocs = true;
+  stage->steadyMallocs = (long)(window.lastMalloc - window.firstMalloc);
+
+  stage->stage = "decode";
+  stage->frames = frames;
+  stage->megabytes = (double)input.width * input.height * frames / (1024.0 * 1024.0);
+  stage->peakRssKb = PeakRssKb();
+  stage->outputBytes = 0;
+  stage->hasPipeline = false;
+
+  av_frame_free(&frame);
+  av_packet_free(&packet);
+  CloseVideoInput(&input);
+  return 0;
+}
+
+int BenchConvert(const char* path, const char* outputFile, const char* stageName, const LzwOptions& lzwOptions, const SceneOptions& sceneOptions, bool twoPass, int colorHysteresis, int segments, StageResult* stage) {
+  VideoInput input;
+  if(OpenVideoInput(path, &input, false, sceneOptions.motionVectors) != 0) {
+    return 1;
+  }
+
+  // the whole clip as a time range, frame counts from the container are
+  // estimates for some inputs
+  ConvertOptions options;
+  options.outputFile = outputFile;
+  options.timeRange = true;
+  options.verbose = false;
+  options.lzw = lzwOptions;
+  options.scene = sceneOptions;
+  options.twoPass = twoPass;
+  options.colorHysteresis = colorHysteresis;
+  ConvertResult result;
+  stage->pipeline = {};
+  stage->hasPipeline = true;
+  options.stats = &stage->pipeline;
+  AllocationWindow window = {};
+  options.onFrame = CountFrameAllocations;
+  options.onFrameUser = &window;
+  // a split range's parts set up while others already emit frames, so no
+  // window is taken there
+  if(segments > 1) {
+    options.segments = segments;
+    options.onFrame = nullptr;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int ret = ConvertToGifSegments(path, &input, options, &result);
+  stage->seconds = SecondsSince(start);
+
+  stage->stage = stageName;
+  stage->frames = result.framesDecoded;
+  stage->megabytes = (double)input.width * input.height * result.framesDecoded / (1024.0 * 1024.0);
+  stage->peakRssKb = PeakRssKb();
+  stage->outputBytes = FileSize(outputFile);
+  stage->steadyAllocations = (long)(window.last - window.first);
+  stage->hasMallocs = segments <= 1;
+  stage->steadyMallocs = (long)(window.lastMalloc - window.firstMalloc);
+
+  CloseVideoInput(&input);
+  return ret;
+}
+
+// a 4:2:0 picture as NV12, the layout hardware decoders hand out
+static AVFrame* CloneAsNv12(const AVFrame* frame) {
+  AVFrame* nv12 = av_frame_alloc();
+  nv12->format = AV_PIX_FMT_NV12;
+  nv12->width = frame->width;
+  nv12->height = frame->height;
+  nv12->colorspace = frame->colorspace;
+  nv12->color_range = frame->format == AV_PIX_FMT_YUVJ420P ? AVCOL_RANGE_JPEG : frame->color_range;
+  if(av_frame_get_buffer(nv12, 0) < 0) {
+    av_frame_free(&nv12);
+    return nullptr;
+  }
+  for(int y = 0; y < frame->height / 2; ++y) {
+    const uint8_t* u = frame->data[1] + (size_t)y * frame->linesize[1];
+    const uint8_t* v = frame->data[2] + (size_t)y * frame->linesize[2];
+    uint8_t* uv = nv12->data[1] + (size_t)y * nv12->linesize[1];
+    for(int x = 0; x < frame->width / 2; ++x) {
+      uv[2 * x] = u[x];
+      uv[2 * x + 1] = v[x];
+    }
+  }
+  for(int y = 0; y < frame->height; ++y) {
+    memcpy(nv12->data[0] + (size_t)y * nv12->linesize[0], frame->data[0] + (size_t)y * frame->linesize[0], frame->width);
+  }
+  return nv12;
+}
+
+// every frame to RGB24 with the in-tree row kernels
+static void ConvertFramesToRgb(const YuvKernels& kernels, const std::vector<AVFrame*>& frames, uint8_t* rgb) {
+  for(const AVFrame* frame : frames) {
+    YuvToRgb m = YuvToRgbFor(frame);
+    for(int y = 0; y < frame->height; ++y) {
+      ConvertFrameRow(kernels, m, frame, y, 0, frame->width, rgb + (size_t)y * frame->width * 3);
+    }
+  }
+}
+
+// the same through libswscale, told the frame's matrix and range
+static void ConvertFramesWithSwscale(SwsContext* context, const std::vector<AVFrame*>& frames, uint8_t* rgb) {
+  for(const AVFrame* frame : frames) {
+    bool fullRange = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+    int colorspace = frame->colorspace == AVCOL_SPC_BT709 ? SWS_CS_ITU709 : SWS_CS_DEFAULT;
+    sws_setColorspaceDetails(context, sws_getCoefficients(colorspace), fullRange, sws_getCoefficients(SWS_CS_DEFAULT), 1, 0, 1 << 16, 1 << 16);
+    uint8_t* dst[1] = {rgb};
+    int dstStride[1] = {frame->width * 3};
+    sws_scale(context, frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+  }
+}
+
+// the first BENCH_COLOR_FRAMES decoded 8 bit 4:2:0 pictures of a clip
+static int DecodeColorFrames(const char* path, std::vector<AVFrame*>* planar) {
+  VideoInput input;
+  if(OpenVideoInput(path, &input, false) != 0) {
+    return 1;
+  }
+
+  AVPacket* packet = av_packet_alloc();
+  AVFrame* frame = av_frame_alloc();
+  while((int)planar->size() < BENCH_COLOR_FRAMES && av_read_frame(input.formatContext, packet) == 0) {
+    if(packet->stream_index == input.videoStreamIndex && avcodec_send_packet(input.codecContext, packet) == 0) {
+      while((int)planar->size() < BENCH_COLOR_FRAMES && avcodec_receive_frame(input.codecContext, frame) == 0) {
+        if(frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) {
+          planar->push_back(av_frame_clone(frame));
+        }
+        av_frame_unref(frame);
+      }
+    }
+    av_packet_unref(packet);
+  }
+  av_frame_free(&frame);
+  av_packet_free(&packet);
+  CloseVideoInput(&input);
+  if(planar->empty()) {
+    fprintf(stderr, "%s has no 8 bit 4:2:0 frames to convert\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+// YUV 4:2:0 and NV12 to RGB24 over the clip's first decoded frames: plain C,
+// the SIMD kernels GetYuvKernels picks and libswscale, best of runs each, so
+// the color path's converter can be chosen per layout. Fails when the SIMD
+// kernels do not give the scalar code's bytes.
+int BenchColorConversion(const char* path, int runs, std::vector<StageResult>* stages) {
+  std::vector<AVFrame*> planar;
+  if(DecodeColorFrames(path, &planar) != 0) {
+    return 1;
+  }
+
+  std::vector<AVFrame*> nv12;
+  for(AVFrame* picture : planar) {
+    AVFrame* copy = CloneAsNv12(picture);
+    if(copy) nv12.push_back(copy);
+  }
+
+  int width = planar[0]->width;
+  int height = planar[0]->height;
+  std::vector<uint8_t> rgb((size_t)width * height * 3);
+  std::vector<uint8_t> expected(rgb.size());
+  const YuvKernels& simd = GetYuvKernels();
+  bool mismatch = false;
+
+  struct Layout {
+    const char* name;
+    const std::vector<AVFrame*>* frames;
+    AVPixelFormat format;
+  };
+  const Layout layouts[] = {
+    {"yuv420", &planar, (AVPixelFormat)planar[0]->format},
+    {"nv12", &nv12, AV_PIX_FMT_NV12},
+  };
+  static const char* stageNames[2][3] = {
+    {"yuv420-rgb-scalar", "yuv420-rgb-simd", "yuv420-rgb-swscale"},
+    {"nv12-rgb-scalar", "nv12-rgb-simd", "nv12-rgb-swscale"},
+  };
+  for(int l = 0; l < 2; ++l) {
+    const std::vector<AVFrame*>& frames = *layouts[l].frames;
+    if(frames.empty()) continue;
+
+    // the last frame of each converter stays in the buffer to compare
+    ConvertFramesToRgb(YUV_SCALAR_KERNELS, frames, expected.data());
+    ConvertFramesToRgb(simd, frames, rgb.data());
+    if(rgb != expected) {
+      fprintf(stderr, "%s: simd %s to rgb differs from the scalar code\n", path, layouts[l].name);
+      mismatch = true;
+    }
+
+    SwsContext* context = sws_getContext(width, height, layouts[l].format, width, height, AV_PIX_FMT_RGB24, SWS_POINT, nullptr, nullptr, nullptr);
+    for(int k = 0; k < 3; ++k) {
+      if(k == 2 && !context) continue;
+      StageResult stage = {};
+      stage.stage = stageNames[l][k];
+      stage.frames = (int)frames.size();
+      stage.megabytes = (double)width * height * frames.size() / (1024.0 * 1024.0);
+      for(int r = 0; r < runs; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        if(k == 0) ConvertFramesToRgb(YUV_SCALAR_KERNELS, frames, rgb.data());
+        else if(k == 1) ConvertFramesToRgb(simd, frames, rgb.data());
+        else ConvertFramesWithSwscale(context, frames, rgb.data());
+        double seconds = SecondsSince(start);
+        if(r == 0 || seconds < stage.seconds) stage.seconds = seconds;
+      }
+      stage.peakRssKb = PeakRssKb();
+      stages->push_back(stage);
+    }
+    sws_freeContext(context);
+  }
+
+  for(AVFrame* picture : planar) av_frame_free(&picture);
+  for(AVFrame* picture : nv12) av_frame_free(&picture);
+  return mismatch ? 1 : 0;
+}
+
+enum LookupKind {
+  LOOKUP_LINEAR_SCALAR,
+  LOOKUP_LINEAR_SIMD,
+  LOOKUP_TREE,
+  LOOKUP_TABLE_32,
+  LOOKUP_TABLE_64,
+  LOOKUP_KINDS
+};
+
+static void LookupSamples(LookupKind kind, const PaletteSearch* search, PaletteLookup* lookup, const std::vector<uint8_t>& samples, std::vector<uint8_t>* entries) {
+  size_t count = entries->size();
+  const uint8_t* rgb = samples.data();
+  uint8_t* out = entries->data();
+  switch(kind) {
+    case LOOKUP_LINEAR_SCALAR:
+      for(size_t i = 0; i < count; ++i) out[i] = NearestPaletteEntryLinear(search, NearestSlotsScalar, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+      break;
+    case LOOKUP_LINEAR_SIMD: {
+      NearestSlotsFunc kernel = GetNearestSlotsKernel();
+      for(size_t i = 0; i < count; ++i) out[i] = NearestPaletteEntryLinear(search, kernel, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+      break;
+    }
+    case LOOKUP_TREE:
+      for(size_t i = 0; i < count; ++i) out[i] = NearestPaletteEntry(search, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+      break;
+    default:
+      for(size_t i = 0; i < count; ++i) out[i] = LookupPaletteColor(lookup, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+      break;
+  }
+}
+
+// nearest palette entry lookups for BENCH_LOOKUP_PIXELS pixels spread over
+// the clip's first decoded frames, against the palette two pass mode builds
+// for them: every entry compared in plain C and with the SIMD kernel, the
+// k-d tree, and the 32 and 64 per channel tables. The tables start empty
+// every run, so filling them is part of the time. Fails when the tree or
+// the SIMD scan finds an entry farther away than the plain C scan.
+int BenchPaletteLookup(const char* path, int runs, std::vector<StageResult>* stages) {
+  std::vector<AVFrame*> frames;
+  if(DecodeColorFrames(path, &frames) != 0) {
+    return 1;
+  }
+  int width = frames[0]->width;
+  int height = frames[0]->height;
+
+  FrameArena* arena = CreateFrameArena();
+  ColorHistogram* histogram = CreateColorHistogram(width, arena);
+  for(const AVFrame* frame : frames) AccumulateColorHistogram(histogram, frame);
+  ColorMapObject* colorMap = GifMakeMapObject(256, nullptr);
+  BuildGlobalPalette(histogram, colorMap, arena);
+  FreeColorHistogram(histogram);
+  PaletteSearch* search = CreatePaletteSearch(colorMap, arena);
+
+  // every step-th pixel of every frame, as rgb triples
+  const YuvKernels& kernels = GetYuvKernels();
+  size_t framePixels = (size_t)width * height;
+  size_t step = std::max<size_t>(1, framePixels * frames.size() / BENCH_LOOKUP_PIXELS);
+  std::vector<uint8_t> row((size_t)3 * (width + 1));
+  std::vector<uint8_t> samples;
+  samples.reserve((size_t)3 * BENCH_LOOKUP_PIXELS);
+  for(const AVFrame* frame : frames) {
+    YuvToRgb m = YuvToRgbFor(frame);
+    for(int y = 0; y < height; ++y) {
+      ConvertFrameRow(kernels, m, frame, y, 0, width, row.data());
+      for(int x = 0; x < width; ++x) {
+        if(((size_t)y * width + x) % step == 0 && samples.size() < (size_t)3 * BENCH_LOOKUP_PIXELS) {
+          samples.insert(samples.end(), row.data() + 3 * x, row.data() + 3 * x + 3);
+        }
+      }
+    }
+  }
+  for(AVFrame* frame : frames) av_frame_free(&frame);
+
+  size_t count = samples.size() / 3;
+  std::vector<uint8_t> expected(count);
+  std::vector<uint8_t> entries(count);
+  auto distance = [&](size_t i, uint8_t entry) {
+    const GifColorType& color = colorMap->Colors[entry];
+    int dr = samples[3 * i] - color.Red, dg = samples[3 * i + 1] - color.Green, db = samples[3 * i + 2] - color.Blue;
+    return dr * dr + dg * dg + db * db;
+  };
+  static const char* stageNames[LOOKUP_KINDS] = {
+    "palette-lookup-linear-scalar", "palette-lookup-linear-simd", "palette-lookup-tree", "palette-lookup-table32", "palette-lookup-table64",
+  };
+  bool mismatch = false;
+  for(int k = 0; k < LOOKUP_KINDS; ++k) {
+    LookupKind kind = (LookupKind)k;
+    StageResult stage = {};
+    stage.stage = stageNames[k];
+    stage.frames = (int)frames.size();
+    stage.pixels = (double)count;
+    for(int r = 0; r < runs; ++r) {
+      FrameArena* tableArena = CreateFrameArena();
+      PaletteLookup* lookup = kind == LOOKUP_TABLE_32 || kind == LOOKUP_TABLE_64 ?
+        CreatePaletteLookup(colorMap, kind == LOOKUP_TABLE_32 ? 5 : 6, width, tableArena) : nullptr;
+      auto start = std::chrono::steady_clock::now();
+      LookupSamples(kind, search, lookup, samples, &entries);
+      double seconds = SecondsSince(start);
+      if(r == 0 || seconds < stage.seconds) stage.seconds = seconds;
+      if(lookup) FreePaletteLookup(lookup);
+      FreeFrameArena(tableArena);
+    }
+    stage.peakRssKb = PeakRssKb();
+    stages->push_back(stage);
+
+    if(kind == LOOKUP_LINEAR_SCALAR) {
+      expected = entries;
+    }
+    else if(kind == LOOKUP_LINEAR_SIMD || kind == LOOKUP_TREE) {
+      for(size_t i = 0; i < count && !mismatch; ++i) {
+        mismatch = distance(i, entries[i]) != distance(i, expected[i]);
+      }
+      if(mismatch) fprintf(stderr, "%s: %s found a farther palette entry than the plain scan\n", path, stageNames[k]);
+    }
+  }
+
+  GifFreeMapObject(colorMap);
+  FreeFrameArena(arena);
+  return mismatch ? 1 : 0;
+}
+
+struct MemoryGif {
+  std::vector<uint8_t> bytes;
+  size_t readPos;
+};
+
+static int MemoryGifWrite(GifFileType* gifFile, const GifByteType* data, int length) {
+  MemoryGif* memory = (MemoryGif*)gifFile->UserData;
+  memory->bytes.insert(memory->bytes.end(), data, data + length);
+  return length;
+}
+
+static int MemoryGifRead(GifFileType* gifFile, GifByteType* data, int length) {
+  MemoryGif* memory = (MemoryGif*)gifFile->UserData;
+  size_t n = memory->bytes.size() - memory->readPos;
+  if(n > (size_t)length) n = length;
+  memcpy(data, memory->bytes.data() + memory->readPos, n);
+  memory->readPos += n;
+  return n;
+}
+
+// round trips random images through LzwEncode and giflib's decoder: every
+// color map size, widths that do not match the stride, flat, striped, sparse
+// and uniformly random content (the last one forces many dictionary clears),
+// with and without adaptive clears and interlacing (giflib's decoder puts
+// interlaced rows back in place). Lossy runs are checked against their
+// error bound instead of exact equality.
+int FuzzLzw(int iterations, uint32_t seed) {
+  std::mt19937 rng(seed);
+  int failures = 0;
+
+  for(int it = 0; it < iterations; ++it) {
+    int width = 1 + rng() % 400;
+    int height = 1 + rng() % 200;
+    int stride = width + rng() % 16;
+    int bits = 1 + rng() % 8;
+    int colors = 1 << bits;
+    int pattern = rng() % 4;
+    LzwOptions lzwOptions;
+    lzwOptions.adaptiveClear = rng() % 2;
+    lzwOptions.clearCheckCodes = 16 + rng() % 512;
+    lzwOptions.lossy = (rng() % 3 == 0) ? 1 + rng() % 64 : 0;
+    lzwOptions.interlace = rng() % 2;
+
+    std::vector<uint8_t> pixels((size_t)stride * height);
+    for(int y = 0; y < height; ++y) {
+      for(int x = 0; x < width; ++x) {
+        uint8_t value;
+        switch(pattern) {
+          case 0: value = 0; break;
+          case 1: value = (x / 5 + y / 3) % colors; break;
+          case 2: value = (rng() % 64 == 0) ? rng() % colors : 1 % colors; break;
+          default: value = rng() % colors; break;
+        }
+        pixels[(size_t)y * stride + x] = value;
+      }
+    }
+
+    MemoryGif memory = {};
+    int errCode = 0;
+    LzwEncoder* encoder = CreateLzwEncoder(lzwOptions);
+    GifFileType* gifFile = EGifOpen(&memory, MemoryGifWrite, &errCode);
+    ColorMapObject* colorMap = GifMakeMapObject(colors, nullptr);
+    if(colorMap) {
+      for(int i = 0; i < colors; ++i) {
+        colorMap->Colors[i].Red = rng();
+        colorMap->Colors[i].Green = rng();
+        colorMap->Colors[i].Blue = rng();
+      }
+      LzwSetPalette(encoder, colorMap);
+    }
+
+    bool ok = gifFile && colorMap
+      && EGifPutScreenDesc(gifFile, width, height, bits, 0, colorMap) != GIF_ERROR
+      && EGifPutImageDesc(gifFile, 0, 0, width, height, lzwOptions.interlace, nullptr) != GIF_ERROR
+      && WriteImageData(gifFile, encoder, pixels.data(), width, height, stride, GifMinCodeSize(colorMap)) != GIF_ERROR;
+    if(gifFile) EGifCloseFile(gifFile, &errCode);
+
+    if(ok) {
+      GifFileType* decoded = DGifOpen(&memory, MemoryGifRead, &errCode);
+      ok = decoded && DGifSlurp(decoded) != GIF_ERROR && decoded->ImageCount == 1;
+      int maxDistance = lzwOptions.lossy * lzwOptions.lossy;
+      for(int y = 0; ok && y < height; ++y) {
+        const uint8_t* expected = pixels.data() + (size_t)y * stride;
+        const uint8_t* actual = decoded->SavedImages[0].RasterBits + (size_t)y * width;
+        for(int x = 0; ok && x < width; ++x) {
+          const GifColorType& a = colorMap->Colors[expected[x]];
+          const GifColorType& b = colorMap->Colors[actual[x] % colors];
+          int dr = a.Red - b.Red, dg = a.Green - b.Green, db = a.Blue - b.Blue;
+          ok = (lzwOptions.lossy == 0) ? expected[x] == actual[x] : dr * dr + dg * dg + db * db <= maxDistance;
+        }
+      }
+      if(decoded) DGifCloseFile(decoded, &errCode);
+    }
+
+    if(colorMap) GifFreeMapObject(colorMap);
+    FreeLzwEncoder(encoder);
+
+    if(!ok) {
+      fprintf(stderr, "lzw round trip failed: iteration %d, %dx%d stride %d, %d bits, pattern %d, adaptive clear %d, lossy %d, interlace %d\n",
+              it, width, height, stride, bits, pattern, lzwOptions.adaptiveClear, lzwOptions.lossy, lzwOptions.interlace);
+      ++failures;
+    }
+  }
+
+  fprintf(stderr, "lzw fuzz: %d of %d images round tripped\n", iterations - failures, iterations);
+  return failures == 0 ? 0 : 1;
+}
+
+// how soon a viewer reading the gif could paint the whole frame coarsely:
+// the clip's first decoded frame, quantized to its own palette, written as
+// a progressive and as an interlaced image and read back line by line with
+// giflib's decoder. The stages record the file bytes read and the decode
+// time until every 8th row is known, which an interlaced image has after
+// its first pass and a progressive one only near its bottom. Fails when the
+// two do not decode to the same pixels.
+int BenchFirstPaint(const char* path, int runs, std::vector<StageResult>* stages) {
+  std::vector<AVFrame*> frames;
+  if(DecodeColorFrames(path, &frames) != 0) {
+    return 1;
+  }
+  const AVFrame* frame = frames[0];
+  int width = frame->width;
+  int height = frame->height;
+
+  FrameArena* arena = CreateFrameArena();
+  ColorHistogram* histogram = CreateColorHistogram(width, arena);
+  AccumulateColorHistogram(histogram, frame);
+  ColorMapObject* colorMap = GifMakeMapObject(256, nullptr);
+  BuildGlobalPalette(histogram, colorMap, arena);
+  FreeColorHistogram(histogram);
+  PaletteLookup* lookup = CreatePaletteLookup(colorMap, PALETTE_LOOKUP_BITS, width, arena);
+  const YuvKernels& kernels = GetYuvKernels();
+  YuvToRgb m = YuvToRgbFor(frame);
+  std::vector<uint8_t> rgb((size_t)3 * (width + 1));
+  std::vector<uint8_t> pixels((size_t)width * height);
+  for(int y = 0; y < height; ++y) {
+    ConvertFrameRow(kernels, m, frame, y, 0, width, rgb.data());
+    for(int x = 0; x < width; ++x) {
+      pixels[(size_t)y * width + x] = LookupPaletteColor(lookup, rgb[3 * x], rgb[3 * x + 1], rgb[3 * x + 2]);
+    }
+  }
+  FreePaletteLookup(lookup);
+  for(AVFrame* picture : frames) av_frame_free(&picture);
+
+  // lines the decoder hands out before the last of every 8th row is among them
+  const int coarseLines[2] = {8 * ((height + 7) / 8 - 1) + 1, (height + 7) / 8};
+  static const char* stageNames[2] = {"first-paint-progressive", "first-paint-interlaced"};
+  std::vector<uint8_t> decoded((size_t)width * height);
+  bool failed = false;
+  for(int k = 0; k < 2 && !failed; ++k) {
+    LzwOptions lzwOptions;
+    lzwOptions.interlace = k == 1;
+    LzwEncoder* encoder = CreateLzwEncoder(lzwOptions);
+    LzwSetPalette(encoder, colorMap);
+    MemoryGif memory = {};
+    int errCode = 0;
+    GifFileType* gifFile = EGifOpen(&memory, MemoryGifWrite, &errCode);
+    failed = !gifFile
+      || EGifPutScreenDesc(gifFile, width, height, 8, 0, colorMap) == GIF_ERROR
+      || EGifPutImageDesc(gifFile, 0, 0, width, height, lzwOptions.interlace, nullptr) == GIF_ERROR
+      || WriteImageData(gifFile, encoder, pixels.data(), width, height, width, GifMinCodeSize(colorMap)) == GIF_ERROR;
+    if(gifFile) EGifCloseFile(gifFile, &errCode);
+    FreeLzwEncoder(encoder);
+
+    StageResult stage = {};
+    stage.stage = stageNames[k];
+    stage.frames = 1;
+    stage.megabytes = (double)width * height / (1024.0 * 1024.0);
+    stage.outputBytes = (long)memory.bytes.size();
+    for(int r = 0; r < runs && !failed; ++r) {
+      memory.readPos = 0;
+      auto start = std::chrono::steady_clock::now();
+      GifFileType* reader = DGifOpen(&memory, MemoryGifRead, &errCode);
+      // the file holds nothing but the one image
+      GifRecordType record = UNDEFINED_RECORD_TYPE;
+      failed = !reader || DGifGetRecordType(reader, &record) == GIF_ERROR
+        || record != IMAGE_DESC_RECORD_TYPE || DGifGetImageDesc(reader) == GIF_ERROR;
+      long paintBytes = 0;
+      double paintSeconds = 0;
+      for(int i = 0; i < height && !failed; ++i) {
+        int y = lzwOptions.interlace ? GifInterlacedRow(i, height) : i;
+        failed = DGifGetLine(reader, decoded.data() + (size_t)y * width, width) == GIF_ERROR;
+        if(i + 1 == coarseLines[k]) {
+          paintBytes = (long)memory.readPos;
+          paintSeconds = SecondsSince(start);
+        }
+      }
+      double seconds = SecondsSince(start);
+      if(reader) DGifCloseFile(reader, &errCode);
+      if(!failed && (r == 0 || seconds < stage.seconds)) {
+        stage.seconds = seconds;
+        stage.firstPaintSeconds = paintSeconds;
+      }
+      stage.firstPaintBytes = paintBytes;
+    }
+    if(!failed && decoded != pixels) {
+      fprintf(stderr, "%s: the %s gif decodes to different pixels\n", path, lzwOptions.interlace ? "interlaced" : "progressive");
+      failed = true;
+    }
+    stage.peakRssKb = PeakRssKb();
+    stages->push_back(stage);
+  }
+
+  GifFreeMapObject(colorMap);
+  FreeFrameArena(arena);
+  return failed ? 1 : 0;
+}
+
+static void PrintStage(const StageResult& stage, bool last) {
+  printf("        {\"stage\": \"%s\", \"seconds\": %.6f, \"frames\": %d, \"frames_per_s\": %.2f, "
+         "\"mb_per_s\": %.2f, \"peak_rss_kb\": %ld, \"output_bytes\": %ld",
+         stage.stage, stage.seconds, stage.frames,
+         stage.seconds > 0 ? stage.frames / stage.seconds : 0.0,
+         stage.seconds > 0 ? stage.megabytes / stage.seconds : 0.0,
+         stage.peakRssKb, stage.outputBytes);
+  if(stage.pixels > 0) {
+    printf(", \"pixels_per_s\": %.0f", stage.seconds > 0 ? stage.pixels / stage.seconds : 0.0);
+  }
+  if(stage.firstPaintBytes > 0) {
+    printf(", \"first_paint_bytes\": %ld, \"first_paint_s\": %.6f", stage.firstPaintBytes, stage.firstPaintSeconds);
+  }
+  if(stage.hasMallocs) {
+    printf(", \"steady_mallocs\": %ld", stage.steadyMallocs);
+  }
+  if(stage.hasPipeline) {
+    printf(", \"steady_allocations\": %ld, \"pipeline\": ", stage.steadyAllocations);
+    PrintStatsJson(stdout, stage.pipeline);
+  }
+  printf("}%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+  const char* corpusDir = "bench-corpus";
+  const char* outputDir = "output";
+  int runs = 3;
+  int fuzzIterations = 0;
+  bool regenerate = false;
+  // only make sure the synthetic corpus exists, for pgo training
+  bool generateOnly = false;
+  std::vector<BenchClip> clips;
+
+  for(int i = 1; i < argc; ++i) {
+    if(strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+      corpusDir = argv[++i];
+    }
+    else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      outputDir = argv[++i];
+    }
+    else if(strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--fuzz-lzw") == 0 && i + 1 < argc) {
+      fuzzIterations = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--regenerate") == 0) {
+      regenerate = true;
+    }
+    else if(strcmp(argv[i], "--generate-only") == 0) {
+      generateOnly = true;
+    }
+    else if(argv[i][0] == '-') {
+      fprintf(stderr, "Usage: %s [--corpus dir] [--output dir] [--runs n] [--regenerate] [--generate-only] [--fuzz-lzw n] [recorded.mp4 ...]\n", argv[0]);
+      return 1;
+    }
+    else {
+      const char* slash = strrchr(argv[i], '/');
+      clips.push_back({slash ? slash + 1 : argv[i], "recorded", argv[i]});
+    }
+  }
+  if(runs < 1) runs = 1;
+
+  if(fuzzIterations > 0) {
+    return FuzzLzw(fuzzIterations, 1);
+  }
+
+  av_log_set_level(AV_LOG_ERROR);
+  mkdir(corpusDir, 0755);
+  if(!generateOnly) mkdir(outputDir, 0755);
+
+  const SyntheticClip syntheticClips[] = {
+    {"static-screen", FillStaticScreen},
+    {"scrolling-text", FillScrollingText},
+    {"full-motion-noise", FillNoise},
+    {"scene-cuts", FillSceneCuts},
+  };
+
+  std::vector<BenchClip> corpus;
+  for(const SyntheticClip& clip : syntheticClips) {
+    std::string path = std::string(corpusDir) + "/" + clip.name + ".mp4";
+    if(regenerate || FileSize(path.c_str()) == 0) {
+      fprintf(stderr, "generating %s\n", path.c_str());
+      if(GenerateSyntheticClip(clip, path.c_str()) != 0) {
+        return 1;
+      }
+    }
+    corpus.push_back({clip.name, "synthetic", path});
+  }
+  if(generateOnly) {
+    return 0;
+  }
+  corpus.insert(corpus.end(), clips.begin(), clips.end());
+
+  // every conversion setting that is benchmarked, each becomes a stage in the json
+  std::vector<ConvertVariant> variants;
+  variants.push_back({"convert", LzwOptions(), SceneOptions(), false, 0, 1});
+  LzwOptions adaptiveClear;
+  adaptiveClear.adaptiveClear = true;
+  variants.push_back({"convert-adaptive-clear", adaptiveClear, SceneOptions(), false, 0, 1});
+  LzwOptions lossy = adaptiveClear;
+  lossy.lossy = 24;
+  variants.push_back({"convert-lossy-24", lossy, SceneOptions(), false, 0, 1});
+  LzwOptions interlace;
+  interlace.interlace = true;
+  variants.push_back({"convert-interlace", interlace, SceneOptions(), false, 0, 1});
+  // same output settings as "convert", compare its diff stage and output size
+  SceneOptions motionVectors;
+  motionVectors.motionVectors = true;
+  variants.push_back({"convert-motion-vectors", LzwOptions(), motionVectors, false, 0, 1});
+  // color output, the clips fit the frame cache so the second pass replays it
+  variants.push_back({"convert-two-pass", LzwOptions(), SceneOptions(), true, 0, 1});
+  // same as convert-two-pass, compare output size and the quantize stage
+  variants.push_back({"convert-two-pass-hysteresis", LzwOptions(), SceneOptions(), true, 8, 1});
+  // the whole clip split at keyframes, one part per core
+  variants.push_back({"convert-segments", LzwOptions(), SceneOptions(), false, 0, (int)std::max(2u, std::thread::hardware_concurrency())});
+
+  long steadyAllocations = 0;
+  printf("{\n  \"runs\": %d,\n  \"clips\": [\n", runs);
+  for(size_t c = 0; c < corpus.size(); ++c) {
+    const BenchClip& clip = corpus[c];
+    fprintf(stderr, "benchmarking %s\n", clip.path.c_str());
+
+    // best of n, the minimum is the least noisy estimate on a shared host
+    std::vector<StageResult> stages(variants.size() + 1);
+    bool failed = false;
+    for(int r = 0; r < runs && !failed; ++r) {
+      StageResult run = {};
+      failed = BenchDecode(clip.path.c_str(), &run) != 0;
+      if(!failed && (r == 0 || run.seconds < stages[0].seconds)) stages[0] = run;
+
+      for(size_t v = 0; v < variants.size() && !failed; ++v) {
+        std::string outputFile = std::string(outputDir) + "/bench-" + clip.name + "-" + variants[v].name + ".gif";
+        failed = BenchConvert(clip.path.c_str(), outputFile.c_str(), variants[v].name, variants[v].lzw, variants[v].scene, variants[v].twoPass, variants[v].colorHysteresis, variants[v].segments, &run) != 0;
+        if(!failed && (r == 0 || run.seconds < stages[v + 1].seconds)) stages[v + 1] = run;
+      }
+    }
+    failed = failed || BenchColorConversion(clip.path.c_str(), runs, &stages) != 0;
+    failed = failed || BenchPaletteLookup(clip.path.c_str(), runs, &stages) != 0;
+    failed = failed || BenchFirstPaint(clip.path.c_str(), runs, &stages) != 0;
+
+    printf("    {\n      \"name\": \"%s\",\n      \"source\": \"%s\",\n      \"input_bytes\": %ld,\n",
+           clip.name.c_str(), clip.source.c_str(), FileSize(clip.path.c_str()));
+    if(failed) {
+      printf("      \"error\": \"conversion failed\"\n");
+    }
+    else {
+      printf("      \"stages\": [\n");
+      for(size_t i = 0; i < stages.size(); ++i) {
+        PrintStage(stages[i], i + 1 == stages.size());
+        if(stages[i].hasPipeline) steadyAllocations += stages[i].steadyAllocations;
+      }
+      printf("      ]\n");
+    }
+    printf("    }%s\n", c + 1 < corpus.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+
+  // our side of the frame loop is meant to run out of preallocated scratch
+  // only; libav's allocations are in steady_mallocs, which is not held to 0
+  if(steadyAllocations > 0) {
+    fprintf(stderr, "%ld operator new calls inside frame loops, expected none\n", steadyAllocations);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// sends one job to a daemon started with --daemon and prints what comes back;
+// exits 0 when the job finished, 1 otherwise
+int main(int argc, char** argv) {
+  if(argc < 4) {
+    fprintf(stderr, "Usage: %s <socket> <input.mp4> <output.gif> [key=value ...]\n", argv[0]);
+    fprintf(stderr, "keys: ss, t, start, frames, lossy, adaptive-clear, interlace, tile, motion-vectors, compact-palette,\n"
+                    "      two-pass, color-lookup, color-hysteresis, keyframes, segments, format, poster, contact-sheet, grid\n"
+                    "      (see Daemon mode in the README)\n");
+    return 1;
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if(strlen(argv[1]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", argv[1]);
+    return 1;
+  }
+  strcpy(address.sun_path, argv[1]);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+    fprintf(stderr, "cannot connect to %s\n", argv[1]);
+    return 1;
+  }
+
+  std::string request = std::string("input=") + argv[2] + "\noutput=" + argv[3] + "\n";
+  for(int i = 4; i < argc; ++i) {
+    request += argv[i];
+    request += "\n";
+  }
+  request += "\n";
+
+  const char* data = request.c_str();
+  size_t length = request.size();
+  while(length > 0) {
+    ssize_t n = send(fd, data, length, 0);
+    if(n <= 0) {
+      fprintf(stderr, "cannot send the job\n");
+      close(fd);
+      return 1;
+    }
+    data += n;
+    length -= n;
+  }
+
+  // echo replies as they stream in and remember the last line
+  std::string pending;
+  std::string lastLine;
+  char buffer[4096];
+  ssize_t n;
+  while((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    fwrite(buffer, 1, n, stdout);
+    fflush(stdout);
+    pending.append(buffer, n);
+    size_t newline;
+    while((newline = pending.find('\n')) != std::string::npos) {
+      lastLine = pending.substr(0, newline);
+      pending.erase(0, newline + 1);
+    }
+  }
+  close(fd);
+
+  return lastLine.compare(0, 5, "done ") == 0 ? 0 : 1;
+}
@@ -0,0 +1,274 @@
+#ifndef APNGWRITER_H
+#define APNGWRITER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "output.h"
+#include "arena.h"
+#include "stats.h"
+
+// the deflate of the vendored stb_image_write, built in stb_image.cpp; the
+// buffer it returns is released with free
+extern "C" unsigned char* stbi_zlib_compress(unsigned char* data, int dataLength, int* outLength, int quality);
+extern "C" int stbi_write_png_compression_level;
+
+// the delay of the last frame when nothing after it says how long it stays
+#define APNG_LAST_FRAME_SECONDS 0.1
+
+// An indexed (color type 3) APNG with the global palette as PLTE. Every
+// video frame becomes one APNG frame drawn over the previous ones (dispose
+// none, blend source), the bounding box of its changed rectangles taken
+// from a screen they are copied onto. A frame is held back until the next
+// one says how long it is shown; like gif, a browser would hold a zero
+// delay frame per rectangle for 1/10s.
+struct ApngWriter {
+  FILE* file;
+  int width;
+  int height;
+  uint32_t sequence;
+  uint32_t frameCount;
+  long actlOffset;
+  uint8_t* scanlines;
+  uint8_t* screen;
+  double frameTime;
+  int64_t frameNumber;
+  bool pending;
+  int pendingLeft;
+  int pendingTop;
+  int pendingRight;
+  int pendingBottom;
+  double pendingTime;
+  double lastDelay;
+  bool failed;
+  ConvertStats* stats;
+  TraceRecorder* trace;
+};
+
+struct ApngCrcTable {
+  uint32_t entries[256];
+  ApngCrcTable() {
+    for(uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      entries[i] = c;
+    }
+  }
+};
+
+// the crc32 png chunks end with; the table is built once, safely across
+// daemon workers
+static uint32_t ApngCrc(uint32_t crc, const uint8_t* data, size_t length) {
+  static const ApngCrcTable table;
+  crc = ~crc;
+  for(size_t i = 0; i < length; ++i) {
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void ApngPut32(uint8_t* out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static void ApngPut16(uint8_t* out, uint16_t value) {
+  out[0] = value >> 8;
+  out[1] = value;
+}
+
+// length, type, data and the crc of type and data; prefix goes in front of
+// data inside the same chunk (the sequence number of an fdAT)
+static void ApngWriteChunk(ApngWriter* writer, const char* type, const uint8_t* prefix, size_t prefixLength, const uint8_t* data, size_t length) {
+  uint8_t header[8];
+  ApngPut32(header, prefixLength + length);
+  memcpy(header + 4, type, 4);
+  uint32_t crc = ApngCrc(0, header + 4, 4);
+  crc = ApngCrc(crc, prefix, prefixLength);
+  crc = ApngCrc(crc, data, length);
+  uint8_t trailer[4];
+  ApngPut32(trailer, crc);
+  bool ok = fwrite(header, 1, 8, writer->file) == 8;
+  ok = ok && fwrite(prefix, 1, prefixLength, writer->file) == prefixLength;
+  ok = ok && fwrite(data, 1, length, writer->file) == length;
+  ok = ok && fwrite(trailer, 1, 4, writer->file) == 4;
+  writer->failed = writer->failed || !ok;
+}
+
+static int ApngWriterBegin(void* state, const ColorMapObject* globalMap) {
+  ApngWriter* writer = (ApngWriter*)state;
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  writer->failed = fwrite(signature, 1, 8, writer->file) != 8;
+
+  uint8_t ihdr[13];
+  ApngPut32(ihdr, writer->width);
+  ApngPut32(ihdr + 4, writer->height);
+  ihdr[8] = 8;
+  ihdr[9] = 3;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  ApngWriteChunk(writer, "IHDR", nullptr, 0, ihdr, sizeof(ihdr));
+
+  // the frame count is patched in by close, 0 plays forever
+  uint8_t actl[8] = {};
+  writer->actlOffset = ftell(writer->file);
+  ApngWriteChunk(writer, "acTL", nullptr, 0, actl, sizeof(actl));
+
+  uint8_t plte[256 * 3];
+  int colors = globalMap->ColorCount < 256 ? globalMap->ColorCount : 256;
+  for(int i = 0; i < colors; ++i) {
+    plte[3 * i] = globalMap->Colors[i].Red;
+    plte[3 * i + 1] = globalMap->Colors[i].Green;
+    plte[3 * i + 2] = globalMap->Colors[i].Blue;
+  }
+  ApngWriteChunk(writer, "PLTE", nullptr, 0, plte, 3 * colors);
+  return writer->failed ? 1 : 0;
+}
+
+// writes the frame gathered on the screen, shown for delay seconds
+static void ApngFlushPending(ApngWriter* writer, double delay) {
+  if(!writer->pending) {
+    return;
+  }
+  writer->pending = false;
+  ScopedStageTimer timer(writer->stats, STAGE_GIF_WRITE, writer->trace, writer->frameNumber);
+  int left = writer->pendingLeft;
+  int top = writer->pendingTop;
+  int width = writer->pendingRight - left;
+  int height = writer->pendingBottom - top;
+
+  // filter type 0 on every row, the usual choice for indexed images
+  uint8_t* out = writer->scanlines;
+  for(int y = top; y < top + height; ++y) {
+    *out++ = 0;
+    memcpy(out, writer->screen + (size_t)y * writer->width + left, width);
+    out += width;
+  }
+  int length = 0;
+  unsigned char* data = stbi_zlib_compress(writer->scanlines, (int)(out - writer->scanlines), &length, stbi_write_png_compression_level);
+  if(!data) {
+    writer->failed = true;
+    return;
+  }
+
+  int delayMs = delay > 0 ? (int)(delay * 1000 + 0.5) : 0;
+  if(delayMs > 65535) delayMs = 65535;
+  uint8_t fctl[26];
+  ApngPut32(fctl, writer->sequence++);
+  ApngPut32(fctl + 4, width);
+  ApngPut32(fctl + 8, height);
+  ApngPut32(fctl + 12, left);
+  ApngPut32(fctl + 16, top);
+  ApngPut16(fctl + 20, delayMs);
+  ApngPut16(fctl + 22, 1000);
+  fctl[24] = 0;
+  fctl[25] = 0;
+  ApngWriteChunk(writer, "fcTL", nullptr, 0, fctl, sizeof(fctl));
+
+  // the first frame is always a full cut, so it doubles as the default image
+  if(writer->frameCount == 0) {
+    ApngWriteChunk(writer, "IDAT", nullptr, 0, data, length);
+  }
+  else {
+    uint8_t sequence[4];
+    ApngPut32(sequence, writer->sequence++);
+    ApngWriteChunk(writer, "fdAT", sequence, 4, data, length);
+  }
+  ++writer->frameCount;
+  free(data);
+}
+
+static int ApngWriterBeginFrame(void* state, double time, bool, int64_t frameNumber) {
+  ApngWriter* writer = (ApngWriter*)state;
+  double delay = time - writer->pendingTime;
+  if(writer->pending && delay > 0) {
+    writer->lastDelay = delay;
+  }
+  ApngFlushPending(writer, delay);
+  writer->frameTime = time;
+  writer->frameNumber = frameNumber;
+  return writer->failed ? 1 : 0;
+}
+
+static int ApngWriterRegion(void* state, const OutputRegion& region) {
+  ApngWriter* writer = (ApngWriter*)state;
+  for(int y = 0; y < region.height; ++y) {
+    memcpy(writer->screen + (size_t)(region.top + y) * writer->width + region.left,
+           region.pixels + (size_t)y * region.stride, region.width);
+  }
+  if(!writer->pending) {
+    writer->pending = true;
+    writer->pendingLeft = region.left;
+    writer->pendingTop = region.top;
+    writer->pendingRight = region.left + region.width;
+    writer->pendingBottom = region.top + region.height;
+    writer->pendingTime = writer->frameTime;
+    return 0;
+  }
+  writer->pendingLeft = std::min(writer->pendingLeft, region.left);
+  writer->pendingTop = std::min(writer->pendingTop, region.top);
+  writer->pendingRight = std::max(writer->pendingRight, region.left + region.width);
+  writer->pendingBottom = std::max(writer->pendingBottom, region.top + region.height);
+  return 0;
+}
+
+static int ApngWriterClose(void* state) {
+  ApngWriter* writer = (ApngWriter*)state;
+  // the last frame stays up as long as the one before it did
+  ApngFlushPending(writer, writer->lastDelay);
+  ApngWriteChunk(writer, "IEND", nullptr, 0, nullptr, 0);
+
+  uint8_t actl[8];
+  ApngPut32(actl, writer->frameCount);
+  ApngPut32(actl + 4, 0);
+  if(writer->actlOffset > 0 && fseek(writer->file, writer->actlOffset, SEEK_SET) == 0) {
+    ApngWriteChunk(writer, "acTL", nullptr, 0, actl, sizeof(actl));
+  }
+  else {
+    writer->failed = true;
+  }
+  // without a frame there is no IDAT, and that is no png
+  bool failed = fclose(writer->file) != 0 || writer->failed || writer->frameCount == 0;
+  delete writer;
+  return failed ? 1 : 0;
+}
+
+bool OpenApngWriter(OutputBackend* backend, const char* path, int width, int height, FrameArena* arena, ConvertStats* stats, TraceRecorder* trace) {
+  FILE* file = fopen(path, "wb");
+  if(!file) {
+    fprintf(stderr, "Cannot open png file: %s\n", path);
+    return false;
+  }
+
+  ApngWriter* writer = new ApngWriter();
+  writer->file = file;
+  writer->width = width;
+  writer->height = height;
+  writer->sequence = 0;
+  writer->frameCount = 0;
+  writer->actlOffset = 0;
+  // a filter byte in front of every row
+  writer->scanlines = ArenaArray<uint8_t>(arena, (size_t)(width + 1) * height);
+  writer->screen = ArenaArray<uint8_t>(arena, (size_t)width * height);
+  writer->frameTime = 0;
+  writer->frameNumber = 0;
+  writer->pending = false;
+  writer->pendingTime = 0;
+  writer->lastDelay = APNG_LAST_FRAME_SECONDS;
+  writer->failed = false;
+  writer->stats = stats;
+  writer->trace = trace;
+
+  backend->state = writer;
+  backend->begin = ApngWriterBegin;
+  backend->beginFrame = ApngWriterBeginFrame;
+  backend->writeRegion = ApngWriterRegion;
+  backend->close = ApngWriterClose;
+  return true;
+}
+
+#endif
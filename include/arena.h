@@ -0,0 +1,81 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// every block handed out starts on a cache line, so SIMD loads never split
+// one and two buffers never share a line
+#define ARENA_ALIGNMENT 64
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct ArenaChunk {
+  ArenaChunk* next;
+  size_t capacity;
+  size_t used;
+};
+
+// a bump allocator for the scratch buffers of one conversion. Everything is
+// carved out while the job is set up and released at once when it ends, so
+// the frame loop itself never allocates; chunks counts how many times the
+// arena had to go to malloc.
+struct FrameArena {
+  ArenaChunk* chunks;
+  size_t chunkCount;
+  size_t bytes;
+};
+
+FrameArena* CreateFrameArena() {
+  FrameArena* arena = new FrameArena();
+  arena->chunks = nullptr;
+  arena->chunkCount = 0;
+  arena->bytes = 0;
+  return arena;
+}
+
+void FreeFrameArena(FrameArena* arena) {
+  ArenaChunk* chunk = arena->chunks;
+  while(chunk) {
+    ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  delete arena;
+}
+
+// the header is padded to a full line so the first block is aligned too
+static size_t ArenaHeaderSize() {
+  return (sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+// size bytes, zeroed and ARENA_ALIGNMENT aligned, valid until the arena is freed
+void* ArenaAlloc(FrameArena* arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  ArenaChunk* chunk = arena->chunks;
+  if(!chunk || chunk->capacity - chunk->used < size) {
+    size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    chunk = (ArenaChunk*)aligned_alloc(ARENA_ALIGNMENT, ArenaHeaderSize() + capacity);
+    if(!chunk) {
+      return nullptr;
+    }
+    chunk->next = arena->chunks;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    ++arena->chunkCount;
+  }
+
+  uint8_t* block = (uint8_t*)chunk + ArenaHeaderSize() + chunk->used;
+  chunk->used += size;
+  arena->bytes += size;
+  memset(block, 0, size);
+  return block;
+}
+
+template<typename T>
+T* ArenaArray(FrameArena* arena, size_t count) {
+  return (T*)ArenaAlloc(arena, sizeof(T) * count);
+}
+
+#endif
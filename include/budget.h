@@ -0,0 +1,134 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "arena.h"
+#include "lzw.h"
+#include "scene.h"
+#include "quantize.h"
+#include "output.h"
+
+extern "C" {
+  #include <libavutil/motion_vector.h>
+}
+
+// H264 never keeps more than 16 reference frames, whatever the level allows
+#define BUDGET_MAX_DPB_FRAMES 16
+// the frame being decoded and the one handed to us on top of the DPB
+#define BUDGET_EXTRA_FRAMES 2
+// per macroblock side tables the decoder keeps per frame (motion vectors,
+// reference indices, macroblock types), rounded up
+#define BUDGET_MB_TABLE_BYTES 256
+
+// MaxDpbMbs from table A-1 of the H264 spec, by level_idc
+static int H264MaxDpbMbs(int level) {
+  switch(level) {
+    case 9: case 10: return 396;
+    case 11: return 900;
+    case 12: case 13: case 20: return 2376;
+    case 21: return 4752;
+    case 22: case 30: return 8100;
+    case 31: return 18000;
+    case 32: return 20480;
+    case 40: case 41: return 32768;
+    case 42: return 34816;
+    case 50: return 110400;
+    case 51: case 52: return 184320;
+    case 60: case 61: case 62: return 696320;
+    default: return 0;
+  }
+}
+
+static size_t MacroblockCount(int width, int height) {
+  return (size_t)((width + 15) / 16) * ((height + 15) / 16);
+}
+
+// how many decoded pictures the stream's level lets the decoder hold on to;
+// the bigger the frame, the fewer fit, and an unknown level gets the maximum
+int H264DpbFrames(int level, int width, int height) {
+  int maxDpbMbs = H264MaxDpbMbs(level);
+  size_t mbs = MacroblockCount(width, height);
+  if(maxDpbMbs == 0 || mbs == 0) {
+    return BUDGET_MAX_DPB_FRAMES;
+  }
+  size_t frames = maxDpbMbs / mbs;
+  if(frames < 1) frames = 1;
+  if(frames > BUDGET_MAX_DPB_FRAMES) frames = BUDGET_MAX_DPB_FRAMES;
+  return (int)frames;
+}
+
+// one yuv420p picture out of libavcodec's pool, which aligns rows to 64
+// bytes and the height to 32 lines
+uint64_t DecodedFrameBytes(int width, int height) {
+  uint64_t alignedWidth = ((uint64_t)width + 63) & ~63ull;
+  uint64_t alignedHeight = ((uint64_t)height + 31) & ~31ull;
+  return alignedWidth * alignedHeight * 3 / 2 + MacroblockCount(width, height) * BUDGET_MB_TABLE_BYTES;
+}
+
+// what ConvertToGif takes for itself: the arena scratch, rounded up to whole
+// chunks, plus what the output format's encoder holds (for gif the LZW
+// dictionary and output buffers). The two pass mode's frame cache is
+// not part of it, see FrameCacheLimit.
+uint64_t ConvertScratchBytes(int width, int height, OutputFormat format, bool compactPalette, bool twoPass, const SceneOptions& scene) {
+  uint64_t pixels = (uint64_t)width * height;
+  uint64_t quarter = (uint64_t)((width + 3) / 4) * ((height + 3) / 4);
+  uint64_t tilesX = (width + scene.tileSize - 1) / scene.tileSize;
+  uint64_t tilesY = (height + scene.tileSize - 1) / scene.tileSize;
+  // the pyramid levels and cell map, the two tile bitmaps, alignment slack
+  uint64_t arena = quarter * 4 + tilesX * tilesY / 4 + 64 * ARENA_ALIGNMENT;
+  if(format == OUTPUT_GIF) {
+    // the screen a frame's regions are gathered on
+    arena += pixels;
+  }
+  if(format == OUTPUT_GIF && compactPalette) {
+    arena += pixels;
+  }
+  if(twoPass) {
+    // the color index plane, the indices on screen for hysteresis, the
+    // histogram, the median cut's color list, the lookup table at its
+    // largest grid, the palette's search tree and the rows frames are
+    // converted through
+    arena += pixels + pixels + QUANTIZE_CELLS * (sizeof(uint32_t) + sizeof(HistogramColor)) +
+             ((uint64_t)sizeof(uint16_t) << (3 * PALETTE_LOOKUP_MAX_BITS)) + sizeof(PaletteSearch) + (uint64_t)width * 6 + 3;
+  }
+  if(format == OUTPUT_APNG) {
+    // the screen and the filtered scanlines
+    arena += pixels + pixels + height;
+  }
+  if(format == OUTPUT_WEBP) {
+    // the RGBA canvas
+    arena += pixels * 4;
+  }
+  arena = (arena + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE * ARENA_CHUNK_SIZE;
+
+  if(format == OUTPUT_APNG) {
+    // deflate's output of one frame and its hash chains
+    return arena + pixels + (1 << 16) * sizeof(void*);
+  }
+  if(format == OUTPUT_WEBP) {
+    // the picture handed over plus the canvases and candidates the
+    // animation encoder keeps, all ARGB
+    return arena + pixels * 4 * 6;
+  }
+  uint64_t packed = LzwPackedBound(pixels);
+  uint64_t lzw = sizeof(LzwEncoder) + ((uint64_t)1 << LZW_MAX_BITS << LZW_MAX_ALPHABET_BITS) * sizeof(uint16_t);
+  lzw += packed + packed + packed / GIF_SUB_BLOCK_SIZE + 1;
+  return arena + lzw;
+}
+
+// an upper estimate of one conversion's peak memory without the two pass
+// mode's frame cache. It depends on the frame size and the stream's level
+// only, not on the clip length: frames are streamed through one at a time.
+uint64_t EstimateConvertBytes(int width, int height, int level, OutputFormat format, bool compactPalette, bool twoPass, const SceneOptions& scene) {
+  uint64_t frames = H264DpbFrames(level, width, height) + BUDGET_EXTRA_FRAMES;
+  uint64_t bytes = frames * DecodedFrameBytes(width, height);
+  if(scene.motionVectors) {
+    // worst case side data of the frame in hand: one vector per 4x4 block
+    bytes += MacroblockCount(width, height) * 16 * sizeof(AVMotionVector);
+  }
+  return bytes + ConvertScratchBytes(width, height, format, compactPalette, twoPass, scene);
+}
+
+#endif
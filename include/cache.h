@@ -0,0 +1,269 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "converter.h"
+
+// bump whenever the same options can produce different bytes, so entries
+// written by an older encoder stop matching
+#define CACHE_FORMAT_VERSION 3
+#define CACHE_READ_CHUNK (1 << 20)
+#define CACHE_KEY_LENGTH 32
+
+// finished conversions live in dir as <key>.gif (or .png, .webp for the
+// other formats, which are part of the key too). A hit refreshes the file's mtime,
+// which is what eviction sorts on, so the oldest mtime is the least recently used.
+struct ResultCache {
+  std::string dir;
+  uint64_t maxBytes = 1024ull << 20;
+};
+
+static const uint64_t CACHE_PRIME1 = 0x9e3779b185ebca87ull;
+static const uint64_t CACHE_PRIME2 = 0xc2b2ae3d27d4eb4full;
+
+static uint64_t CacheRotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t CacheFinalize(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// four independent multiply-rotate lanes over 32 byte stripes, so the
+// hash keeps up with a page cache read; not cryptographic, only has to
+// tell inputs apart
+struct CacheHasher {
+  uint64_t lanes[4] = {CACHE_PRIME1 + CACHE_PRIME2, CACHE_PRIME2, 0, 0 - CACHE_PRIME1};
+  uint64_t length = 0;
+  uint8_t tail[32];
+  size_t tailSize = 0;
+};
+
+static void CacheHashStripe(CacheHasher* hasher, const uint8_t* stripe) {
+  for(int i = 0; i < 4; ++i) {
+    uint64_t word;
+    memcpy(&word, stripe + i * 8, 8);
+    hasher->lanes[i] = CacheRotl(hasher->lanes[i] + word * CACHE_PRIME2, 31) * CACHE_PRIME1;
+  }
+}
+
+void CacheHashUpdate(CacheHasher* hasher, const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  hasher->length += size;
+  if(hasher->tailSize > 0) {
+    size_t n = std::min(size, 32 - hasher->tailSize);
+    memcpy(hasher->tail + hasher->tailSize, bytes, n);
+    hasher->tailSize += n;
+    bytes += n;
+    size -= n;
+    if(hasher->tailSize < 32) return;
+    CacheHashStripe(hasher, hasher->tail);
+    hasher->tailSize = 0;
+  }
+  for(; size >= 32; size -= 32, bytes += 32) {
+    CacheHashStripe(hasher, bytes);
+  }
+  memcpy(hasher->tail, bytes, size);
+  hasher->tailSize = size;
+}
+
+// 128 bits as 32 hex characters plus the terminator
+void CacheHashDigest(CacheHasher* hasher, char out[CACHE_KEY_LENGTH + 1]) {
+  uint8_t tail[32] = {};
+  memcpy(tail, hasher->tail, hasher->tailSize);
+  CacheHashStripe(hasher, tail);
+  uint64_t a = hasher->length, b = ~hasher->length;
+  for(int i = 0; i < 4; ++i) {
+    a = CacheFinalize(a ^ hasher->lanes[i]);
+    b = CacheFinalize(b + CacheRotl(hasher->lanes[i], 17 + i));
+  }
+  snprintf(out, CACHE_KEY_LENGTH + 1, "%016" PRIx64 "%016" PRIx64, a, b);
+}
+
+// everything in the options that changes the output bytes, verbosity,
+// stats and callbacks do not. A split range's part count is cut down to
+// what fits maxMemory (see ConvertToGifSegments), and every part starts
+// over with a full frame, so the limit is part of the key when it splits
+static std::string CacheOptionsString(const ConvertOptions& options) {
+  char buffer[512];
+  const LzwOptions& lzw = options.lzw;
+  const SceneOptions& scene = options.scene;
+  uint64_t segmentMemory = options.segments > 1 ? options.maxMemory : 0;
+  snprintf(buffer, sizeof(buffer),
+           "v%d|format=%d|range=%d,%d,%d,%.6f,%.6f|lzw=%d,%d,%.4f,%d,%d|compact=%d|twopass=%d,%d,%d|keyframes=%d|segments=%d,%" PRIu64 "|scene=%.4f,%.4f,%d,%d,%d,%d,%d",
+           CACHE_FORMAT_VERSION, options.format, options.timeRange, options.startFrameIndex, options.noFramesToExtract,
+           options.startSeconds, options.durationSeconds, lzw.adaptiveClear, lzw.clearCheckCodes,
+           lzw.clearRatioDrop, lzw.lossy, lzw.interlace, options.compactPalette, options.twoPass, options.colorLookupBits, options.colorHysteresis, options.keyframesOnly, options.segments, segmentMemory, scene.cutHistogramDistance, scene.cutMeanDiff,
+           scene.cellThreshold, scene.tileSize, scene.maxRegions, scene.motionVectors, scene.motionRefresh);
+  return buffer;
+}
+
+// hashes the input file's bytes followed by the options, 1 if the input cannot be read
+int CacheKeyFor(const char* inputPath, const ConvertOptions& options, char key[CACHE_KEY_LENGTH + 1]) {
+  FILE* file = fopen(inputPath, "rb");
+  if(!file) {
+    return 1;
+  }
+
+  CacheHasher hasher;
+  std::vector<uint8_t> chunk(CACHE_READ_CHUNK);
+  size_t n;
+  while((n = fread(chunk.data(), 1, chunk.size(), file)) > 0) {
+    CacheHashUpdate(&hasher, chunk.data(), n);
+  }
+  bool failed = ferror(file);
+  fclose(file);
+  if(failed) {
+    return 1;
+  }
+
+  std::string optionsString = CacheOptionsString(options);
+  CacheHashUpdate(&hasher, optionsString.data(), optionsString.size());
+  CacheHashDigest(&hasher, key);
+  return 0;
+}
+
+static std::string CacheEntryPath(const ResultCache& cache, const char* key, OutputFormat format) {
+  return cache.dir + "/" + key + "." + OUTPUT_FORMAT_EXTENSIONS[format];
+}
+
+// whether name is <key>.<extension> for one of the output formats
+static bool IsCacheEntryName(const char* name) {
+  size_t length = strlen(name);
+  if(length <= CACHE_KEY_LENGTH + 1 || name[CACHE_KEY_LENGTH] != '.') {
+    return false;
+  }
+  for(const char* extension : OUTPUT_FORMAT_EXTENSIONS) {
+    if(strcmp(name + CACHE_KEY_LENGTH + 1, extension) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int CacheCopyFile(const char* from, const char* to) {
+  FILE* in = fopen(from, "rb");
+  if(!in) return 1;
+  FILE* out = fopen(to, "wb");
+  if(!out) {
+    fclose(in);
+    return 1;
+  }
+  std::vector<uint8_t> chunk(CACHE_READ_CHUNK);
+  size_t n;
+  bool failed = false;
+  while((n = fread(chunk.data(), 1, chunk.size(), in)) > 0 && !failed) {
+    failed = fwrite(chunk.data(), 1, n, out) != n;
+  }
+  failed = failed || ferror(in);
+  fclose(in);
+  failed = fclose(out) != 0 || failed;
+  return failed ? 1 : 0;
+}
+
+// copies the cached file for key to outputFile, false on a miss. Not a hard
+// link: a later run without the cache truncates outputFile in place, and
+// that would overwrite the entry too.
+bool CacheFetch(const ResultCache& cache, const char* key, OutputFormat format, const char* outputFile) {
+  std::string entry = CacheEntryPath(cache, key, format);
+  if(access(entry.c_str(), R_OK) != 0) {
+    return false;
+  }
+
+  if(CacheCopyFile(entry.c_str(), outputFile) != 0) {
+    return false;
+  }
+  utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+  return true;
+}
+
+// a unique path inside the cache directory to convert into, so the
+// rename in CachePublish never crosses filesystems
+std::string CacheTempPath(const ResultCache& cache, OutputFormat format) {
+  static std::atomic<uint64_t> counter(0);
+  char name[96];
+  snprintf(name, sizeof(name), "/tmp.%d.%" PRIu64 ".%s", (int)getpid(), counter.fetch_add(1), OUTPUT_FORMAT_EXTENSIONS[format]);
+  return cache.dir + name;
+}
+
+// removes the least recently used entries until the directory fits maxBytes
+void CacheEvict(const ResultCache& cache) {
+  DIR* dir = opendir(cache.dir.c_str());
+  if(!dir) return;
+
+  struct Entry {
+    std::string path;
+    uint64_t bytes;
+    struct timespec used;
+  };
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  while(struct dirent* item = readdir(dir)) {
+    if(!IsCacheEntryName(item->d_name)) continue;
+    std::string path = cache.dir + "/" + item->d_name;
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) continue;
+    entries.push_back({path, (uint64_t)st.st_size, st.st_mtim});
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  if(total <= cache.maxBytes) return;
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+  });
+  for(size_t i = 0; i < entries.size() && total > cache.maxBytes; ++i) {
+    if(unlink(entries[i].path.c_str()) == 0) {
+      total -= entries[i].bytes;
+    }
+  }
+}
+
+// puts a finished conversion at outputFile and moves it into the cache
+// under key. The rename is atomic, so readers see either no entry or a
+// complete one; two jobs that race on the same key publish the same bytes.
+int CachePublish(const ResultCache& cache, const char* key, OutputFormat format, const char* tempPath, const char* outputFile) {
+  if(CacheCopyFile(tempPath, outputFile) != 0) {
+    fprintf(stderr, "cannot write %s\n", outputFile);
+    unlink(tempPath);
+    return 1;
+  }
+
+  std::string entry = CacheEntryPath(cache, key, format);
+  if(rename(tempPath, entry.c_str()) != 0) {
+    unlink(tempPath);
+  }
+  CacheEvict(cache);
+  return 0;
+}
+
+// creates the cache directory if it is missing
+int CacheOpen(const ResultCache& cache) {
+  if(mkdir(cache.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "cannot create cache directory %s\n", cache.dir.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+#endif
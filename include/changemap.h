@@ -0,0 +1,440 @@
+#ifndef CHANGEMAP_H
+#define CHANGEMAP_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "arena.h"
+
+// x86-64 only: SSE2 is part of its baseline, and the sums are read out
+// with _mm_cvtsi128_si64, which 32-bit x86 does not have
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHANGEMAP_X86 1
+#endif
+
+#define MAX_CHANGE_REGIONS 4
+
+struct ChangeRegion {
+  int left;
+  int top;
+  int width;
+  int height;
+};
+
+// a luma pyramid at 1/4 and 1/8 resolution (each value the mean of a 4x4 /
+// 8x8 block) and a bitmap of the tileSize x tileSize tiles whose 1/4 cells
+// moved by more than the threshold since the reference. The reference is the
+// 1/4 level of what was last emitted, only updated inside emitted regions.
+// motionHint, laid out like dirty, holds the tiles the decoder reported as
+// possibly changed since the last analysis (see motion.h).
+struct ChangeMap {
+  int width;
+  int height;
+  int tileSize;
+  int quarterWidth;
+  int quarterHeight;
+  int eighthWidth;
+  int eighthHeight;
+  int tilesX;
+  int tilesY;
+  int wordsPerRow;
+  size_t quarterCount;
+  size_t eighthCount;
+  size_t dirtyWords;
+  uint8_t* quarter;
+  uint8_t* reference;
+  uint8_t* eighth;
+  uint8_t* diffRow;
+  uint8_t* tileMax;
+  uint64_t* dirty;
+  uint64_t* motionHint;
+  uint8_t* staticCells;
+  int dirtyTiles;
+  uint64_t sad;
+  bool hasReference;
+  bool hasMotionHint;
+};
+
+// tileSize must be a multiple of 4, 8 and 16 are the useful ones; the
+// buffers live in arena and go away with it
+ChangeMap* CreateChangeMap(int width, int height, int tileSize, FrameArena* arena) {
+  ChangeMap* map = new ChangeMap();
+  map->width = width;
+  map->height = height;
+  map->tileSize = tileSize;
+  map->quarterWidth = (width + 3) / 4;
+  map->quarterHeight = (height + 3) / 4;
+  map->eighthWidth = (map->quarterWidth + 1) / 2;
+  map->eighthHeight = (map->quarterHeight + 1) / 2;
+  map->tilesX = (width + tileSize - 1) / tileSize;
+  map->tilesY = (height + tileSize - 1) / tileSize;
+  map->wordsPerRow = (map->tilesX + 63) / 64;
+  map->quarterCount = (size_t)map->quarterWidth * map->quarterHeight;
+  map->eighthCount = (size_t)map->eighthWidth * map->eighthHeight;
+  map->dirtyWords = (size_t)map->wordsPerRow * map->tilesY;
+  // padded so SIMD rows can read one vector past the end
+  map->quarter = ArenaArray<uint8_t>(arena, map->quarterCount + 32);
+  map->reference = ArenaArray<uint8_t>(arena, map->quarterCount + 32);
+  map->eighth = ArenaArray<uint8_t>(arena, map->eighthCount);
+  map->diffRow = ArenaArray<uint8_t>(arena, map->quarterWidth + 32);
+  map->tileMax = ArenaArray<uint8_t>(arena, map->tilesX);
+  map->dirty = ArenaArray<uint64_t>(arena, map->dirtyWords);
+  map->motionHint = ArenaArray<uint64_t>(arena, map->dirtyWords);
+  map->staticCells = ArenaArray<uint8_t>(arena, map->quarterCount);
+  map->dirtyTiles = 0;
+  map->sad = 0;
+  map->hasReference = false;
+  map->hasMotionHint = false;
+  return map;
+}
+
+void FreeChangeMap(ChangeMap* map) {
+  delete map;
+}
+
+// mean of the block at (x0, y0), clipped to the frame, for the partial cells on the right and bottom edges
+static uint8_t BoxMeanScalar(const uint8_t* luma, int stride, int x0, int y0, int w, int h) {
+  uint32_t sum = 0;
+  for(int y = y0; y < y0 + h; ++y) {
+    for(int x = x0; x < x0 + w; ++x) {
+      sum += luma[(size_t)y * stride + x];
+    }
+  }
+  return (sum + w * h / 2) / (w * h);
+}
+
+// 4x4 means of four full rows; returns how many of the cells it produced
+typedef int (*Box4Func)(const uint8_t* const rows[4], int cells, uint8_t* out);
+
+static int Box4Scalar(const uint8_t* const rows[4], int cells, uint8_t* out) {
+  for(int c = 0; c < cells; ++c) {
+    uint32_t sum = 0;
+    for(int r = 0; r < 4; ++r) {
+      const uint8_t* p = rows[r] + c * 4;
+      sum += p[0] + p[1] + p[2] + p[3];
+    }
+    out[c] = (sum + 8) >> 4;
+  }
+  return cells;
+}
+
+#ifdef CHANGEMAP_X86
+// vertical sums in 16 bits, then madd with ones twice to fold columns into
+// pairs and the pairs into quads: 16 pixels per row in, 4 means out
+static int Box4Sse2(const uint8_t* const rows[4], int cells, uint8_t* out) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i round = _mm_set1_epi32(8);
+  int c = 0;
+  for(; c + 4 <= cells; c += 4) {
+    int x = c * 4;
+    __m128i r0 = _mm_loadu_si128((const __m128i*)(rows[0] + x));
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(rows[1] + x));
+    __m128i r2 = _mm_loadu_si128((const __m128i*)(rows[2] + x));
+    __m128i r3 = _mm_loadu_si128((const __m128i*)(rows[3] + x));
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero)),
+                               _mm_add_epi16(_mm_unpacklo_epi8(r2, zero), _mm_unpacklo_epi8(r3, zero)));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero)),
+                               _mm_add_epi16(_mm_unpackhi_epi8(r2, zero), _mm_unpackhi_epi8(r3, zero)));
+    __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+    __m128i quads = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(pairs, ones), round), 4);
+    __m128i packed = _mm_packs_epi32(quads, quads);
+    packed = _mm_packus_epi16(packed, packed);
+    int value = _mm_cvtsi128_si32(packed);
+    memcpy(out + c, &value, 4);
+  }
+  return c;
+}
+
+// same as the SSE2 version on 32 pixels; the packs work per 128 bit lane so
+// cells 0-3 end up in the low lane and 4-7 in the high one
+__attribute__((target("avx2")))
+static int Box4Avx2(const uint8_t* const rows[4], int cells, uint8_t* out) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i round = _mm256_set1_epi32(8);
+  int c = 0;
+  for(; c + 8 <= cells; c += 8) {
+    int x = c * 4;
+    __m256i r0 = _mm256_loadu_si256((const __m256i*)(rows[0] + x));
+    __m256i r1 = _mm256_loadu_si256((const __m256i*)(rows[1] + x));
+    __m256i r2 = _mm256_loadu_si256((const __m256i*)(rows[2] + x));
+    __m256i r3 = _mm256_loadu_si256((const __m256i*)(rows[3] + x));
+    __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(r0, zero), _mm256_unpacklo_epi8(r1, zero)),
+                                  _mm256_add_epi16(_mm256_unpacklo_epi8(r2, zero), _mm256_unpacklo_epi8(r3, zero)));
+    __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(r0, zero), _mm256_unpackhi_epi8(r1, zero)),
+                                  _mm256_add_epi16(_mm256_unpackhi_epi8(r2, zero), _mm256_unpackhi_epi8(r3, zero)));
+    __m256i pairs = _mm256_packs_epi32(_mm256_madd_epi16(lo, ones), _mm256_madd_epi16(hi, ones));
+    __m256i quads = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(pairs, ones), round), 4);
+    __m256i packed = _mm256_packs_epi32(quads, quads);
+    packed = _mm256_packus_epi16(packed, packed);
+    int low = _mm256_cvtsi256_si32(packed);
+    int high = _mm256_extract_epi32(packed, 4);
+    memcpy(out + c, &low, 4);
+    memcpy(out + c + 4, &high, 4);
+  }
+  const uint8_t* rest[4] = {rows[0] + c * 4, rows[1] + c * 4, rows[2] + c * 4, rows[3] + c * 4};
+  return c + Box4Sse2(rest, cells - c, out + c);
+}
+#endif
+
+// |a - b| per byte into diff, returns the sum
+typedef uint64_t (*AbsDiffFunc)(const uint8_t* a, const uint8_t* b, int n, uint8_t* diff);
+
+static uint64_t AbsDiffScalar(const uint8_t* a, const uint8_t* b, int n, uint8_t* diff) {
+  uint64_t sum = 0;
+  for(int i = 0; i < n; ++i) {
+    diff[i] = abs((int)a[i] - (int)b[i]);
+    sum += diff[i];
+  }
+  return sum;
+}
+
+#ifdef CHANGEMAP_X86
+static uint64_t AbsDiffSse2(const uint8_t* a, const uint8_t* b, int n, uint8_t* diff) {
+  __m128i sum = _mm_setzero_si128();
+  int i = 0;
+  for(; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(diff + i), _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va)));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+  }
+  uint64_t total = (uint64_t)_mm_cvtsi128_si64(sum) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum));
+  return total + AbsDiffScalar(a + i, b + i, n - i, diff + i);
+}
+#endif
+
+struct ChangeMapKernels {
+  Box4Func box4;
+  AbsDiffFunc absDiff;
+};
+
+// picked once per process: AVX2 when the cpu has it, SSE2 on any other
+// x86-64, plain C elsewhere
+static const ChangeMapKernels& GetChangeMapKernels() {
+  static const ChangeMapKernels kernels = [] {
+    ChangeMapKernels k = {Box4Scalar, AbsDiffScalar};
+#ifdef CHANGEMAP_X86
+    k.box4 = Box4Sse2;
+    k.absDiff = AbsDiffSse2;
+    if(__builtin_cpu_supports("avx2")) {
+      k.box4 = Box4Avx2;
+    }
+#endif
+    return k;
+  }();
+  return kernels;
+}
+
+// 4x4 means of the cells [c0, c1) of quarter row qy
+static void BoxFilterCells(ChangeMap* map, const uint8_t* luma, int stride, int qy, int c0, int c1) {
+  const ChangeMapKernels& kernels = GetChangeMapKernels();
+  uint8_t* out = map->quarter + (size_t)qy * map->quarterWidth;
+  int y0 = qy * 4;
+  int rows = map->height - y0 < 4 ? map->height - y0 : 4;
+  int fullEnd = c1 < map->width / 4 ? c1 : map->width / 4;
+
+  if(rows == 4) {
+    if(c0 < fullEnd) {
+      const uint8_t* base = luma + (size_t)y0 * stride + c0 * 4;
+      const uint8_t* rowPointers[4] = {base, base + stride, base + 2 * (size_t)stride, base + 3 * (size_t)stride};
+      int done = kernels.box4(rowPointers, fullEnd - c0, out + c0);
+      if(c0 + done < fullEnd) {
+        const uint8_t* rest[4] = {rowPointers[0] + done * 4, rowPointers[1] + done * 4, rowPointers[2] + done * 4, rowPointers[3] + done * 4};
+        Box4Scalar(rest, fullEnd - c0 - done, out + c0 + done);
+      }
+    }
+  }
+  else {
+    for(int qx = c0; qx < fullEnd; ++qx) {
+      out[qx] = BoxMeanScalar(luma, stride, qx * 4, y0, 4, rows);
+    }
+  }
+  if(c1 > fullEnd) {
+    out[fullEnd] = BoxMeanScalar(luma, stride, fullEnd * 4, y0, map->width - fullEnd * 4, rows);
+  }
+}
+
+static void BuildEighthLevel(ChangeMap* map) {
+  for(int ey = 0; ey < map->eighthHeight; ++ey) {
+    const uint8_t* q0 = map->quarter + (size_t)(ey * 2) * map->quarterWidth;
+    const uint8_t* q1 = (ey * 2 + 1 < map->quarterHeight) ? q0 + map->quarterWidth : q0;
+    uint8_t* out = map->eighth + (size_t)ey * map->eighthWidth;
+    for(int ex = 0; ex < map->eighthWidth; ++ex) {
+      int x0 = ex * 2;
+      int x1 = (x0 + 1 < map->quarterWidth) ? x0 + 1 : x0;
+      out[ex] = (q0[x0] + q0[x1] + q1[x0] + q1[x1] + 2) >> 2;
+    }
+  }
+}
+
+// builds the pyramid for a frame and marks every tile with a 1/4 cell that
+// moved by more than threshold; without a reference everything is dirty.
+// With useMotionHint only the tiles set in motionHint are filtered and
+// compared, the others are taken to still match the reference.
+void BuildChangeMap(ChangeMap* map, const uint8_t* luma, int stride, int threshold, bool useMotionHint) {
+  const ChangeMapKernels& kernels = GetChangeMapKernels();
+  bool hinted = useMotionHint && map->hasMotionHint && map->hasReference;
+  int cellsPerTile = map->tileSize / 4;
+  uint8_t* diff = map->diffRow;
+  uint8_t* tileMax = map->tileMax;
+  uint64_t sad = 0;
+  int dirtyTiles = 0;
+
+  for(int ty = 0; ty < map->tilesY; ++ty) {
+    int qy0 = ty * cellsPerTile;
+    int qy1 = qy0 + cellsPerTile < map->quarterHeight ? qy0 + cellsPerTile : map->quarterHeight;
+    const uint64_t* hintRow = hinted ? map->motionHint + (size_t)ty * map->wordsPerRow : nullptr;
+    if(hinted) {
+      size_t offset = (size_t)qy0 * map->quarterWidth;
+      memcpy(map->quarter + offset, map->reference + offset, (size_t)(qy1 - qy0) * map->quarterWidth);
+    }
+    memset(tileMax, 0, map->tilesX);
+
+    // runs of hinted tiles, or the whole row without a hint
+    int tx = 0;
+    while(tx < map->tilesX) {
+      if(hintRow && !((hintRow[tx >> 6] >> (tx & 63)) & 1)) {
+        ++tx;
+        continue;
+      }
+      int tx1 = tx + 1;
+      while(tx1 < map->tilesX && (!hintRow || ((hintRow[tx1 >> 6] >> (tx1 & 63)) & 1))) {
+        ++tx1;
+      }
+
+      int c0 = tx * cellsPerTile;
+      int c1 = tx1 * cellsPerTile < map->quarterWidth ? tx1 * cellsPerTile : map->quarterWidth;
+      for(int qy = qy0; qy < qy1; ++qy) {
+        BoxFilterCells(map, luma, stride, qy, c0, c1);
+        if(!map->hasReference) continue;
+        size_t offset = (size_t)qy * map->quarterWidth;
+        sad += kernels.absDiff(map->quarter + offset + c0, map->reference + offset + c0, c1 - c0, diff + c0);
+        for(int qx = c0; qx < c1; ++qx) {
+          uint8_t& m = tileMax[qx / cellsPerTile];
+          if(diff[qx] > m) m = diff[qx];
+        }
+      }
+      tx = tx1;
+    }
+
+    uint64_t* row = map->dirty + (size_t)ty * map->wordsPerRow;
+    memset(row, 0, sizeof(uint64_t) * map->wordsPerRow);
+    for(int t = 0; t < map->tilesX; ++t) {
+      if(!map->hasReference || tileMax[t] > threshold) {
+        row[t >> 6] |= 1ull << (t & 63);
+        ++dirtyTiles;
+      }
+    }
+  }
+
+  BuildEighthLevel(map);
+  map->sad = sad;
+  map->dirtyTiles = dirtyTiles;
+
+  // the hint covers the frames since the last analysis, start over
+  if(map->hasMotionHint) {
+    memset(map->motionHint, 0, sizeof(uint64_t) * map->dirtyWords);
+    map->hasMotionHint = false;
+  }
+}
+
+// groups the dirty tiles into at most maxRegions pixel rectangles: runs of
+// tile rows with dirt become bands spanning their dirty columns, and bands
+// are merged while the merge costs less than a couple of tiles of extra
+// area or there are too many of them. Returns the number of regions.
+int SelectDirtyRegions(const ChangeMap* map, ChangeRegion* regions, int maxRegions) {
+  struct Band { int x0, y0, x1, y1; };
+  Band bands[64];
+  int bandCount = 0;
+  bool open = false;
+
+  for(int ty = 0; ty <= map->tilesY; ++ty) {
+    int minX = -1, maxX = -1;
+    if(ty < map->tilesY) {
+      const uint64_t* row = map->dirty + (size_t)ty * map->wordsPerRow;
+      for(int w = 0; w < map->wordsPerRow; ++w) {
+        if(row[w]) {
+          if(minX < 0) minX = w * 64 + __builtin_ctzll(row[w]);
+          maxX = w * 64 + 63 - __builtin_clzll(row[w]);
+        }
+      }
+    }
+
+    if(minX >= 0) {
+      if(open) {
+        Band& band = bands[bandCount - 1];
+        if(minX < band.x0) band.x0 = minX;
+        if(maxX > band.x1) band.x1 = maxX;
+        band.y1 = ty;
+      }
+      else if(bandCount < 64) {
+        bands[bandCount++] = {minX, ty, maxX, ty};
+        open = true;
+      }
+      else {
+        // out of bands, grow the last one
+        Band& band = bands[bandCount - 1];
+        if(minX < band.x0) band.x0 = minX;
+        if(maxX > band.x1) band.x1 = maxX;
+        band.y1 = ty;
+      }
+    }
+    else {
+      open = false;
+    }
+  }
+
+  auto area = [](const Band& b) { return (b.x1 - b.x0 + 1) * (b.y1 - b.y0 + 1); };
+  while(bandCount > 1) {
+    int best = -1;
+    int bestCost = 0;
+    for(int i = 0; i + 1 < bandCount; ++i) {
+      Band merged = {bands[i].x0 < bands[i + 1].x0 ? bands[i].x0 : bands[i + 1].x0, bands[i].y0,
+                     bands[i].x1 > bands[i + 1].x1 ? bands[i].x1 : bands[i + 1].x1, bands[i + 1].y1};
+      int cost = area(merged) - area(bands[i]) - area(bands[i + 1]);
+      if(best < 0 || cost < bestCost) {
+        best = i;
+        bestCost = cost;
+      }
+    }
+    if(bandCount <= maxRegions && bestCost > 2) {
+      break;
+    }
+    Band& a = bands[best];
+    const Band& b = bands[best + 1];
+    a = {a.x0 < b.x0 ? a.x0 : b.x0, a.y0, a.x1 > b.x1 ? a.x1 : b.x1, b.y1};
+    memmove(&bands[best + 1], &bands[best + 2], sizeof(Band) * (bandCount - best - 2));
+    --bandCount;
+  }
+
+  for(int i = 0; i < bandCount; ++i) {
+    ChangeRegion& region = regions[i];
+    region.left = bands[i].x0 * map->tileSize;
+    region.top = bands[i].y0 * map->tileSize;
+    int right = (bands[i].x1 + 1) * map->tileSize;
+    int bottom = (bands[i].y1 + 1) * map->tileSize;
+    region.width = (right < map->width ? right : map->width) - region.left;
+    region.height = (bottom < map->height ? bottom : map->height) - region.top;
+  }
+  return bandCount;
+}
+
+// the viewer now sees the current frame inside region
+void CommitChangeRegion(ChangeMap* map, const ChangeRegion& region) {
+  int qx0 = region.left / 4;
+  int qy0 = region.top / 4;
+  int qx1 = (region.left + region.width + 3) / 4;
+  int qy1 = (region.top + region.height + 3) / 4;
+  for(int qy = qy0; qy < qy1; ++qy) {
+    size_t offset = (size_t)qy * map->quarterWidth;
+    memcpy(map->reference + offset + qx0, map->quarter + offset + qx0, qx1 - qx0);
+  }
+  map->hasReference = true;
+}
+
+#endif
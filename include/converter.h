@@ -0,0 +1,835 @@
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "utils.h"
+#include "stats.h"
+#include "lzw.h"
+#include "palette.h"
+#include "scene.h"
+#include "motion.h"
+#include "budget.h"
+#include "quantize.h"
+#include "output.h"
+#include "gifwriter.h"
+#include "apngwriter.h"
+#include "webpwriter.h"
+#include "poster.h"
+#include "framecache.h"
+
+extern "C" {
+  #include <libavformat/avformat.h>
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/imgutils.h>
+
+  #include <gif_lib.h>
+}
+
+// packets in flight inside the decoder that we remember the demux time of,
+// far above the reorder delay of any H264 stream
+#define TRACE_PACKET_SLOTS 64
+// how much the two pass mode's frame cache may hold between its passes
+// when no memory limit says otherwise
+#define TWO_PASS_FRAME_CACHE_BYTES (512ull << 20)
+
+struct VideoInput {
+  AVFormatContext* formatContext = nullptr;
+  AVCodecContext* codecContext = nullptr;
+  int videoStreamIndex = -1;
+  int width = 0;
+  int height = 0;
+  int noFrames = 0;
+};
+
+struct ConvertOptions {
+  const char* outputFile = "output/out.gif";
+  // the container written to outputFile; the lzw options and compactPalette
+  // only apply to gif
+  OutputFormat format = OUTPUT_GIF;
+  int startFrameIndex = 0;
+  int noFramesToExtract = 0;
+  // clip by presentation time instead of frame index: seek to startSeconds
+  // and stop after durationSeconds of stream time (0 runs to the end)
+  bool timeRange = false;
+  double startSeconds = 0;
+  double durationSeconds = 0;
+  bool verbose = true;
+  ConvertStats* stats = nullptr;
+  TraceRecorder* trace = nullptr;
+  LzwOptions lzw;
+  // give frames that use few colors a smaller local color table
+  bool compactPalette = true;
+  SceneOptions scene;
+  // reused instead of creating one per call when set; its options are
+  // replaced by lzw for the duration of the call
+  LzwEncoder* lzwEncoder = nullptr;
+  // refuse to start when the estimated peak memory is above this, 0 for no limit
+  uint64_t maxMemory = 0;
+  // color output: a first pass counts the colors of the whole range into a
+  // global palette, the second encodes against it
+  bool twoPass = false;
+  // the analyzed frames are kept for the second pass, decoded or
+  // compressed, while they fit here (and under maxMemory) and keeping them
+  // is cheaper than decoding again; see FrameCache
+  uint64_t frameCacheBytes = TWO_PASS_FRAME_CACHE_BYTES;
+  // the grid of the palette lookup the second pass maps pixels through, 5
+  // or 6 bits per channel; 0 searches the nearest entry of every pixel
+  int colorLookupBits = PALETTE_LOOKUP_BITS;
+  // a pixel keeps the palette index it showed while its color stays within
+  // this RGB distance of that entry, 0 requantizes every written pixel
+  int colorHysteresis = 0;
+  // a quick preview from the keyframes alone: the decoder skips everything
+  // else and the demuxer seeks from one keyframe to the next. Needs a time
+  // range, frame numbers mean nothing when most frames are never decoded
+  bool keyframesOnly = false;
+  // stills picked from the analyzed frames of the same pass, null for none:
+  // the sharpest frame at full size, and a sheetColumns x sheetRows grid of
+  // the sharpest frame of every slice of the range
+  const char* posterFile = nullptr;
+  const char* contactSheetFile = nullptr;
+  int sheetColumns = 4;
+  int sheetRows = 4;
+  // split a time range at keyframes into up to this many parts converted
+  // side by side, each with its own demuxer and decoder, and join them in
+  // order; see ConvertToGifSegments. Gif only
+  int segments = 1;
+  // set on the options of each part by ConvertToGifSegments: the part of
+  // the range to convert and the file its images go to
+  GifSegment* segment = nullptr;
+  // called after every emitted frame
+  void (*onFrame)(void* user, int framesDecoded, int framesEmitted) = nullptr;
+  void* onFrameUser = nullptr;
+};
+
+struct ConvertResult {
+  int framesDecoded = 0;
+  int framesEmitted = 0;
+};
+
+void CreateColorMap(ColorMapObject *cmap) {
+  for(int i = 0; i < 256; ++i) {
+    cmap->Colors[i].Red = i;
+    cmap->Colors[i].Green = i;
+    cmap->Colors[i].Blue = i;
+  }
+}
+
+void CloseVideoInput(VideoInput* input) {
+  avcodec_free_context(&input->codecContext);
+  avformat_close_input(&input->formatContext);
+}
+
+// opens the container and picks the first video stream, which has to be H264;
+// enough to read the stream's size and frame count without a decoder
+int OpenVideoContainer(const char* path, VideoInput* input, bool verbose) {
+  if(avformat_open_input(&input->formatContext, path, nullptr, nullptr) < 0) {
+    fprintf(stderr, "cannot open file %s\n", path);
+    return 1;
+  }
+
+  AVFormatContext* formatContext = input->formatContext;
+  if(avformat_find_stream_info(formatContext, nullptr) < 0) {
+    fprintf(stderr, "cannot extract info from media file\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(verbose) printf("Found %u streams\n", formatContext->nb_streams);
+
+  bool isVideo = false;
+  int videoStreamIndex = -1;
+  for(int i = 0; i < formatContext->nb_streams; ++i) {
+    if(formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      isVideo = true;
+      videoStreamIndex = i;
+      break;
+    }
+  }
+
+  if(!isVideo) {
+    fprintf(stderr, "The given media container does not contain a video stream\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(verbose) {
+    printf("Found a video stream\n");
+    printf("Found %" PRId64 " frames\n", formatContext->streams[videoStreamIndex]->nb_frames);
+  }
+
+  if(formatContext->streams[videoStreamIndex]->codecpar->codec_id != AV_CODEC_ID_H264) {
+    fprintf(stderr, "Only H264 codec is supported\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(verbose) printf("Found an H264 encoded stream\n");
+
+  input->videoStreamIndex = videoStreamIndex;
+  input->width = formatContext->streams[videoStreamIndex]->codecpar->width;
+  input->height = formatContext->streams[videoStreamIndex]->codecpar->height;
+  input->noFrames = formatContext->streams[videoStreamIndex]->nb_frames;
+  if(verbose) printf("Video size: %dx%d\n", input->width, input->height);
+
+  return 0;
+}
+
+// opens an H264 decoder for the stream picked by OpenVideoContainer, with
+// motion vector export when the scene options are going to use them
+int OpenVideoDecoder(VideoInput* input, bool verbose, bool exportMotionVectors) {
+  AVFormatContext* formatContext = input->formatContext;
+  int videoStreamIndex = input->videoStreamIndex;
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if(!codec) {
+    fprintf(stderr, "did not find a proper decoder for H264 codec\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(verbose) printf("Found a decoder\n");
+
+  input->codecContext = avcodec_alloc_context3(codec);
+  if(!input->codecContext) {
+    fprintf(stderr, "Unable to allocate a codec context\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(avcodec_parameters_to_context(input->codecContext, formatContext->streams[videoStreamIndex]->codecpar) < 0) {
+    fprintf(stderr, "Failed to fill codec with read codec paras\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  if(exportMotionVectors) {
+    EnableMotionVectorExport(input->codecContext);
+  }
+
+  if(avcodec_open2(input->codecContext, codec, nullptr) < 0) {
+    fprintf(stderr, "unable to open the decoder\n");
+    CloseVideoInput(input);
+    return 1;
+  }
+
+  return 0;
+}
+
+int OpenVideoInput(const char* path, VideoInput* input, bool verbose, bool exportMotionVectors = false) {
+  if(OpenVideoContainer(path, input, verbose) != 0) {
+    return 1;
+  }
+  return OpenVideoDecoder(input, verbose, exportMotionVectors);
+}
+
+// opens the backend options.format asks for on options.outputFile
+bool OpenOutput(OutputBackend* output, const ConvertOptions& options, int width, int height, FrameArena* arena) {
+  switch(options.format) {
+    case OUTPUT_GIF:
+      if(options.segment) {
+        return OpenGifSegmentWriter(output, options.segment, width, height, options.lzw, options.lzwEncoder,
+                                    options.compactPalette, arena, options.stats, options.trace);
+      }
+      return OpenGifWriter(output, options.outputFile, width, height, options.lzw, options.lzwEncoder,
+                           options.compactPalette, arena, options.stats, options.trace);
+    case OUTPUT_APNG:
+      return OpenApngWriter(output, options.outputFile, width, height, arena, options.stats, options.trace);
+    case OUTPUT_WEBP:
+#ifdef HAVE_LIBWEBP
+      return OpenWebpWriter(output, options.outputFile, width, height, arena, options.stats, options.trace);
+#else
+      fprintf(stderr, "This build has no webp support, libwebp was not found\n");
+      return false;
+#endif
+  }
+  return false;
+}
+
+// the time range of options in the stream's time base, endPts is INT64_MAX
+// when the range runs to the end
+void TimeRangePts(const AVStream* stream, const ConvertOptions& options, int64_t* startPts, int64_t* endPts) {
+  int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  *startPts = origin + av_rescale_q((int64_t)(options.startSeconds * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+  *endPts = INT64_MAX;
+  if(options.durationSeconds > 0) {
+    *endPts = *startPts + av_rescale_q((int64_t)(options.durationSeconds * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+  }
+}
+
+// how long one frame shows, from the stream's frame rate
+double FrameDuration(const AVStream* stream) {
+  return stream->avg_frame_rate.num > 0 ? 1.0 / av_q2d(stream->avg_frame_rate) : 0.04;
+}
+
+// how long the range plays, 0 when a time range runs to the end of an
+// input that does not give its duration
+double RangeSeconds(const VideoInput* input, const ConvertOptions& options) {
+  const AVFormatContext* formatContext = input->formatContext;
+  if(!options.timeRange) {
+    return options.noFramesToExtract * FrameDuration(formatContext->streams[input->videoStreamIndex]);
+  }
+  double rangeSeconds = options.durationSeconds;
+  if(rangeSeconds <= 0 && formatContext->duration != AV_NOPTS_VALUE) {
+    rangeSeconds = formatContext->duration / (double)AV_TIME_BASE - options.startSeconds;
+  }
+  return std::max(rangeSeconds, 0.0);
+}
+
+// EstimateConvertBytes for this input and these options, without the two
+// pass mode's frame cache
+uint64_t EstimateBaseBytes(const VideoInput* input, const ConvertOptions& options) {
+  const AVCodecParameters* codecpar = input->formatContext->streams[input->videoStreamIndex]->codecpar;
+  uint64_t bytes = EstimateConvertBytes(input->width, input->height, codecpar->level, options.format, options.compactPalette, options.twoPass, options.scene);
+  if(options.twoPass) {
+    // the frame cache's lossless codec: the picture it inflates into and
+    // the encoder's packet buffer, at most a raw picture each
+    bytes += 2 * DecodedFrameBytes(input->width, input->height);
+  }
+  if(options.posterFile) {
+    bytes += EstimatePosterBytes(1, 1, input->width, input->width, input->height);
+  }
+  if(options.contactSheetFile) {
+    bytes += EstimatePosterBytes(options.sheetColumns, options.sheetRows, POSTER_TILE_WIDTH, input->width, input->height);
+  }
+  return bytes;
+}
+
+// what the two pass mode's frame cache may grow to: the analyzed frames of
+// the range, decoded, but no more than frameCacheBytes and whatever
+// maxMemory leaves over. Unlike the rest of the estimate it grows with the
+// length of the range, up to that cap
+uint64_t FrameCacheLimit(const VideoInput* input, const ConvertOptions& options) {
+  if(!options.twoPass) {
+    return 0;
+  }
+  uint64_t limit = options.frameCacheBytes;
+  double rangeSeconds = RangeSeconds(input, options);
+  if(rangeSeconds > 0) {
+    // every other frame of the range is analyzed, every keyframe in
+    // keyframe mode, and there are never more of those than frames
+    double rangeFrames = rangeSeconds / FrameDuration(input->formatContext->streams[input->videoStreamIndex]);
+    uint64_t analyzed = (uint64_t)(options.keyframesOnly ? rangeFrames : rangeFrames / 2) + 1;
+    limit = std::min(limit, analyzed * DecodedFrameBytes(input->width, input->height));
+  }
+  if(options.maxMemory > 0) {
+    uint64_t base = EstimateBaseBytes(input, options);
+    limit = options.maxMemory > base ? std::min(limit, options.maxMemory - base) : 0;
+  }
+  return limit;
+}
+
+// the peak memory of a conversion of this input with these options
+uint64_t EstimateInputBytes(const VideoInput* input, const ConvertOptions& options) {
+  return EstimateBaseBytes(input, options) + FrameCacheLimit(input, options);
+}
+
+// a failed conversion leaves no partial file behind; the file of a part of
+// a split range is removed by ConvertToGifSegments
+static void RemovePartialOutput(const ConvertOptions& options) {
+  if(!options.segment) {
+    unlink(options.outputFile);
+  }
+}
+
+// the poster and contact sheet come from the conversion's own decode, a
+// cached result cannot provide them
+bool WritesPosters(const ConvertOptions& options) {
+  return options.posterFile || options.contactSheetFile;
+}
+
+int ConvertToGif(VideoInput* input, const ConvertOptions& options, ConvertResult* result) {
+  int width = input->width;
+  int height = input->height;
+  int startFrameIndex = options.startFrameIndex;
+  int noFramesToExtract = options.startFrameIndex + options.noFramesToExtract;
+
+  AVFormatContext* formatContext = input->formatContext;
+  AVCodecContext* codecContext = input->codecContext;
+  int videoStreamIndex = input->videoStreamIndex;
+  AVStream* stream = formatContext->streams[videoStreamIndex];
+  double frameDuration = FrameDuration(stream);
+
+  // the time range in the stream's time base
+  int64_t startPts = 0;
+  int64_t endPts = INT64_MAX;
+  if(options.timeRange) {
+    bool pastEnd = formatContext->duration != AV_NOPTS_VALUE && options.startSeconds * AV_TIME_BASE >= formatContext->duration;
+    if(options.startSeconds < 0 || options.durationSeconds < 0 || pastEnd) {
+      fprintf(stderr, "Invalid time range given\n");
+      return 1;
+    }
+    TimeRangePts(stream, options, &startPts, &endPts);
+    if(options.segment) {
+      startPts = options.segment->startPts;
+      endPts = options.segment->endPts;
+    }
+  }
+  else if(startFrameIndex < 0 || startFrameIndex >= noFramesToExtract || noFramesToExtract < 0 || noFramesToExtract > input->noFrames) {
+    fprintf(stderr, "Invalid frames range given\n");
+    return 1;
+  }
+
+  if(options.maxMemory > 0) {
+    uint64_t needed = EstimateInputBytes(input, options);
+    if(options.verbose) printf("Estimated peak memory: %.1f MB\n", needed / 1048576.0);
+    if(needed > options.maxMemory) {
+      fprintf(stderr, "a %dx%d input needs about %.1f MB, over the %.1f MB memory limit\n",
+              width, height, needed / 1048576.0, options.maxMemory / 1048576.0);
+      return 1;
+    }
+  }
+
+  // how long the range plays, which the contact sheet cuts into slices
+  double rangeSeconds = RangeSeconds(input, options);
+  if(options.keyframesOnly && !options.timeRange) {
+    fprintf(stderr, "Keyframe mode needs a time range\n");
+    return 1;
+  }
+  if(options.contactSheetFile && rangeSeconds <= 0) {
+    fprintf(stderr, "The contact sheet needs the length of the range, which this input does not give\n");
+    return 1;
+  }
+
+  AVPacket packet;
+
+  int noColors = 256;
+  ColorMapObject* colorMapObj = GifMakeMapObject(noColors, nullptr);
+
+  if(!colorMapObj) {
+    fprintf(stderr, "Cannot create a color map object\n");
+    return 1;
+  }
+
+  // every frame sized buffer of the job comes from here, nothing in the
+  // loop below allocates
+  FrameArena* arena = CreateFrameArena();
+  OutputBackend output;
+  if(!OpenOutput(&output, options, width, height, arena)) {
+    GifFreeMapObject(colorMapObj);
+    FreeFrameArena(arena);
+    return 1;
+  }
+  uint8_t* colorIndices = options.twoPass ? ArenaArray<uint8_t>(arena, (size_t)width * height) : nullptr;
+
+  int counter = 0;
+  int framesEmitted = 0;
+  SceneDetector* sceneDetector = CreateSceneDetector(width, height, options.scene, arena);
+  PosterSheet* poster = options.posterFile ? CreatePosterSheet(options.posterFile, 1, 1, width, width, height, 0, arena) : nullptr;
+  PosterSheet* contactSheet = options.contactSheetFile ?
+    CreatePosterSheet(options.contactSheetFile, options.sheetColumns, options.sheetRows, POSTER_TILE_WIDTH, width, height, rangeSeconds, arena) : nullptr;
+  if(options.stats) {
+    options.stats->scratchBytes = arena->bytes;
+    options.stats->scratchChunks = arena->chunkCount;
+  }
+  ConvertStats* stats = options.stats;
+  TraceRecorder* trace = options.trace;
+  uint64_t startNs = stats ? MonotonicNs() : 0;
+  int64_t packetIndex = 0;
+  int64_t packetSlotPts[TRACE_PACKET_SLOTS];
+  uint64_t packetSlotNs[TRACE_PACKET_SLOTS];
+  if(trace) {
+    TraceSetThreadName(trace, "convert");
+    for(int j = 0; j < TRACE_PACKET_SLOTS; ++j) packetSlotPts[j] = AV_NOPTS_VALUE;
+  }
+
+  // lands on the last keyframe at or before the start, the frames from
+  // there up to the start are decoded and dropped; rewind also goes back
+  // to the start of the file for a second pass over it
+  int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  auto seekToRange = [&](bool rewind) -> bool {
+    int64_t target = options.timeRange && startPts > origin ? startPts : origin;
+    if(!rewind && target == origin) {
+      return true;
+    }
+    if(avformat_seek_file(formatContext, videoStreamIndex, INT64_MIN, target, target, 0) < 0) {
+      return false;
+    }
+    avcodec_flush_buffers(codecContext);
+    return true;
+  };
+
+  // frames inside the range, every other one of them is analyzed (every
+  // one in keyframe mode, there are few enough)
+  int rangeIndex = 0;
+
+  enum FramePick {
+    PICK_END,
+    PICK_SKIP,
+    PICK_ANALYZE
+  };
+
+  // where frame stands against the range, for the frame numbered counter
+  auto pickFrame = [&](const AVFrame* frame) -> FramePick {
+    bool inRange;
+    if(options.timeRange) {
+      // frames come out in presentation order, so the first one at or past the
+      // end means we are done; frames without a timestamp are kept
+      int64_t pts = frame->best_effort_timestamp;
+      if(pts != AV_NOPTS_VALUE && pts >= endPts) {
+        return PICK_END;
+      }
+      inRange = pts == AV_NOPTS_VALUE || pts >= startPts;
+    }
+    else {
+      if(counter >= noFramesToExtract) {
+        return PICK_END;
+      }
+      inRange = counter >= startFrameIndex;
+    }
+    if(inRange && options.keyframesOnly) {
+      return PICK_ANALYZE;
+    }
+    return inRange && (rangeIndex++ % 2) == 0 ? PICK_ANALYZE : PICK_SKIP;
+  };
+
+  // in keyframe mode only keyframe packets reach the decoder, and after
+  // each one the demuxer seeks on to the next instead of reading the
+  // packets in between; a seek that does not move forward turns seeking
+  // off and the packets are read and dropped instead
+  if(options.keyframesOnly) {
+    codecContext->skip_frame = AVDISCARD_NONKEY;
+  }
+  bool seekKeyframes = options.keyframesOnly;
+  int64_t lastKeyframePts = AV_NOPTS_VALUE;
+
+  // demuxes and decodes until handleFrame returns false or the input ends
+  auto decodeLoop = [&](auto&& handleFrame) {
+    AVFrame* frame = av_frame_alloc();
+    lastKeyframePts = AV_NOPTS_VALUE;
+    bool done = false;
+    while(!done) {
+      int readRet;
+      uint64_t demuxStartNs = trace ? MonotonicNs() : 0;
+      {
+        ScopedStageTimer timer(stats, STAGE_DEMUX, trace, packetIndex);
+        readRet = av_read_frame(formatContext, &packet);
+      }
+
+      // at the end of the file a null packet drains the frames still held
+      // back by the decoder for reordering
+      bool draining = readRet != 0;
+      if(!draining) {
+        if(stats) ++stats->packetsRead;
+        if(packet.stream_index != videoStreamIndex) {
+          av_packet_unref(&packet);
+          ++packetIndex;
+          continue;
+        }
+        if(options.keyframesOnly) {
+          bool keyframe = (packet.flags & AV_PKT_FLAG_KEY) != 0;
+          bool repeated = keyframe && packet.pts != AV_NOPTS_VALUE && lastKeyframePts != AV_NOPTS_VALUE && packet.pts <= lastKeyframePts;
+          if(repeated) {
+            seekKeyframes = false;
+          }
+          if(!keyframe || repeated) {
+            av_packet_unref(&packet);
+            ++packetIndex;
+            continue;
+          }
+          lastKeyframePts = packet.pts;
+        }
+        if(trace) {
+          packetSlotPts[packetIndex % TRACE_PACKET_SLOTS] = packet.pts;
+          packetSlotNs[packetIndex % TRACE_PACKET_SLOTS] = demuxStartNs;
+        }
+      }
+
+      {
+        ScopedStageTimer timer(stats, STAGE_DECODE, trace, packetIndex);
+        avcodec_send_packet(codecContext, draining ? nullptr : &packet);
+      }
+      if(!draining) av_packet_unref(&packet);
+      if(!draining && seekKeyframes && lastKeyframePts != AV_NOPTS_VALUE) {
+        ScopedStageTimer timer(stats, STAGE_DEMUX, trace, packetIndex);
+        if(avformat_seek_file(formatContext, videoStreamIndex, lastKeyframePts + 1, lastKeyframePts + 1, INT64_MAX, 0) < 0) {
+          seekKeyframes = false;
+        }
+      }
+
+      while(!done) {
+        int receiveRet;
+        {
+          ScopedStageTimer timer(stats, STAGE_DECODE, trace, packetIndex);
+          receiveRet = avcodec_receive_frame(codecContext, frame);
+        }
+        if(receiveRet != 0) {
+          break;
+        }
+        if(stats) ++stats->framesDecoded;
+        done = !handleFrame(frame);
+        av_frame_unref(frame);
+      }
+
+      ++packetIndex;
+      done = done || draining;
+    }
+    av_frame_free(&frame);
+  };
+
+  if(!seekToRange(false) && options.verbose) {
+    printf("Cannot seek, decoding from the start\n");
+  }
+
+  // the analysis pass: count the colors of every frame that is going to be
+  // analyzed, and hold on to those frames for the second pass while the
+  // frame cache's cost model says replaying them beats decoding again; see
+  // FrameCache
+  FrameCache* frameCache = nullptr;
+  bool replayFromCache = false;
+  if(options.twoPass) {
+    if(options.verbose) printf("Analyzing colors...\n");
+    frameCache = CreateFrameCache(FrameCacheLimit(input, options), width, height);
+    bool unsupported = false;
+    ColorHistogram* histogram = CreateColorHistogram(width, arena);
+    // what demuxing and decoding took in this pass, per analyzed frame, is
+    // what a second decode would cost
+    uint64_t passStartNs = MonotonicNs();
+    uint64_t handlerNs = 0;
+    int analyzedFrames = 0;
+    auto decodeNsPerFrame = [&]() -> uint64_t {
+      return (MonotonicNs() - passStartNs - handlerNs) / std::max(analyzedFrames, 1);
+    };
+
+    decodeLoop([&](AVFrame* frame) -> bool {
+      uint64_t handlerStartNs = MonotonicNs();
+      FramePick pick = pickFrame(frame);
+      if(pick == PICK_END) {
+        return false;
+      }
+      if(pick == PICK_ANALYZE) {
+        if(!IsQuantizableFrame(frame)) {
+          unsupported = true;
+          return false;
+        }
+        {
+          ScopedStageTimer timer(stats, STAGE_QUANTIZE, trace, counter);
+          AccumulateColorHistogram(histogram, frame);
+        }
+        ++analyzedFrames;
+        uint64_t decodeNs = decodeNsPerFrame();
+        handlerNs += MonotonicNs() - handlerStartNs;
+        FrameCacheAdd(frameCache, frame, counter, decodeNs);
+        handlerStartNs = MonotonicNs();
+      }
+      ++counter;
+      handlerNs += MonotonicNs() - handlerStartNs;
+      return true;
+    });
+
+    if(unsupported) {
+      fprintf(stderr, "Two pass mode needs 8 bit 4:2:0 or NV12 input\n");
+    }
+    else {
+      FrameArena* paletteScratch = CreateFrameArena();
+      BuildGlobalPalette(histogram, colorMapObj, paletteScratch);
+      FreeFrameArena(paletteScratch);
+    }
+    FreeColorHistogram(histogram);
+
+    replayFromCache = !unsupported && FrameCacheReplays(frameCache, decodeNsPerFrame());
+    if(options.verbose && !unsupported) {
+      if(replayFromCache) printf("Encoding %zu cached frames (%s, %.1f MB)\n", FrameCacheCount(frameCache),
+                                 FRAME_CACHE_MODE_NAMES[frameCache->mode], frameCache->bytes / 1048576.0);
+      else printf("Frames do not fit the frame cache, or caching them does not pay, decoding again\n");
+    }
+    if(!unsupported && !replayFromCache && !seekToRange(true)) {
+      fprintf(stderr, "Cannot rewind the input for the second pass\n");
+      unsupported = true;
+    }
+    if(unsupported) {
+      FreeFrameCache(frameCache);
+      output.close(output.state);
+      RemovePartialOutput(options);
+      if(poster) ClosePosterSheet(poster, false);
+      if(contactSheet) ClosePosterSheet(contactSheet, false);
+      GifFreeMapObject(colorMapObj);
+      FreeSceneDetector(sceneDetector);
+      FreeFrameArena(arena);
+      return 1;
+    }
+    if(!replayFromCache) {
+      counter = 0;
+      rangeIndex = 0;
+    }
+  }
+  else {
+    CreateColorMap(colorMapObj);
+  }
+
+  PaletteLookup* paletteLookup = options.twoPass ? CreatePaletteLookup(colorMapObj, options.colorLookupBits, width, arena) : nullptr;
+  if(paletteLookup) EnablePaletteHysteresis(paletteLookup, width, height, options.colorHysteresis, arena);
+  // a failed write stops the conversion, the file is removed at the end
+  bool writeFailed = output.begin(output.state, colorMapObj) != 0;
+
+  if(options.verbose) printf("Converting mp4 to %s...\n", OUTPUT_FORMAT_NAMES[options.format]);
+
+  // cached frames carry no motion hints for the frames between them, so a
+  // replay diffs every tile, and neither do keyframes
+  SceneOptions sceneOptions = options.scene;
+  if(replayFromCache || options.keyframesOnly) {
+    sceneOptions.motionVectors = false;
+  }
+
+  // presentation time of a frame, from its timestamp or else its number and
+  // the stream's frame rate; analyzed frames are timed from the first one,
+  // except in a part of a split range, where they keep the stream's clock
+  // so the delays between parts come out right when they are joined
+  double firstFrameSeconds = options.segment ? 0 : -1;
+  auto frameSeconds = [&](const AVFrame* frame, int frameNumber) -> double {
+    int64_t pts = frame->best_effort_timestamp;
+    double seconds = pts != AV_NOPTS_VALUE ? (pts - origin) * av_q2d(stream->time_base) : frameNumber * frameDuration;
+    if(firstFrameSeconds < 0) firstFrameSeconds = seconds;
+    return seconds - firstFrameSeconds;
+  };
+
+  // analyzes one picked frame and writes what changed, true if anything was
+  // written; frameNumber is its counter in the decode order
+  auto emitFrame = [&](const AVFrame* frame, int frameNumber) -> bool {
+    double seconds = frameSeconds(frame, frameNumber);
+    if(poster || contactSheet) {
+      ScopedStageTimer timer(stats, STAGE_POSTER, trace, frameNumber);
+      double score = SharpnessScore(frame->data[0], frame->linesize[0], frame->width, frame->height);
+      if(poster) OfferPosterFrame(poster, frame, seconds, score);
+      if(contactSheet) OfferPosterFrame(contactSheet, frame, seconds, score);
+    }
+
+    SceneChange change;
+    {
+      ScopedStageTimer timer(stats, STAGE_DIFF, trace, frameNumber);
+      change = AnalyzeFrame(sceneDetector, frame->data[0], frame->linesize[0], sceneOptions);
+    }
+    if(change.kind == FRAME_DUPLICATE) {
+      return false;
+    }
+
+    // a delta frame only carries the changed regions, the rest of the
+    // previous image stays on screen underneath them. Color regions are
+    // quantized first, side by side in the index plane (they never
+    // overlap): with hysteresis only the part whose indices changed is
+    // written, and a frame where none did is dropped like a duplicate.
+    OutputRegion images[MAX_CHANGE_REGIONS];
+    int imageCount = 0;
+    size_t indexOffset = 0;
+    for(int r = 0; r < change.regionCount; ++r) {
+      const ChangeRegion& region = change.regions[r];
+      OutputRegion image = {region.left, region.top, region.width, region.height,
+                            frame->data[0] + (size_t)region.top * frame->linesize[0] + region.left, frame->linesize[0]};
+      if(paletteLookup) {
+        ScopedStageTimer timer(stats, STAGE_QUANTIZE, trace, frameNumber);
+        uint8_t* indices = colorIndices + indexOffset;
+        indexOffset += (size_t)region.width * region.height;
+        QuantizedRect changed = QuantizeFrameRegion(paletteLookup, frame, region.left, region.top, region.width, region.height, indices, region.width);
+        if(changed.width == 0) {
+          continue;
+        }
+        image = {changed.left, changed.top, changed.width, changed.height,
+                 indices + (size_t)(changed.top - region.top) * region.width + (changed.left - region.left), region.width};
+      }
+      images[imageCount++] = image;
+    }
+    if(imageCount == 0) {
+      return false;
+    }
+
+    writeFailed = output.beginFrame(output.state, seconds, change.kind == FRAME_CUT, frameNumber) != 0;
+    for(int i = 0; i < imageCount && !writeFailed; ++i) {
+      writeFailed = output.writeRegion(output.state, images[i]) != 0;
+    }
+    if(writeFailed) {
+      return false;
+    }
+
+    CommitFrame(sceneDetector, change);
+    ++framesEmitted;
+    if(options.onFrame) options.onFrame(options.onFrameUser, frameNumber + 1, framesEmitted);
+
+    if(trace && !replayFromCache) {
+      // match the frame back to the packet it came out of through the pts
+      for(int j = 0; j < TRACE_PACKET_SLOTS; ++j) {
+        if(packetSlotPts[j] != AV_NOPTS_VALUE && packetSlotPts[j] == frame->pts) {
+          TraceAsyncSpan(trace, "frame latency", packetSlotNs[j], MonotonicNs(), frameNumber);
+          break;
+        }
+      }
+    }
+    return true;
+  };
+
+  bool replayFailed = false;
+  if(replayFromCache) {
+    for(size_t i = 0; i < FrameCacheCount(frameCache) && !writeFailed; ++i) {
+      const AVFrame* frame = FrameCacheFrame(frameCache, i);
+      if(!frame) {
+        fprintf(stderr, "Cannot inflate a cached frame\n");
+        replayFailed = true;
+        break;
+      }
+      emitFrame(frame, frameCache->counters[i]);
+      FrameCacheRelease(frameCache, i);
+    }
+  }
+  else if(!writeFailed) {
+    decodeLoop([&](AVFrame* frame) -> bool {
+      if(sceneOptions.motionVectors) {
+        AccumulateMotionHint(sceneDetector->changeMap, frame);
+      }
+      FramePick pick = pickFrame(frame);
+      if(pick == PICK_END) {
+        return false;
+      }
+      if(pick == PICK_ANALYZE) {
+        emitFrame(frame, counter);
+      }
+      ++counter;
+      return !writeFailed;
+    });
+  }
+
+  codecContext->skip_frame = AVDISCARD_DEFAULT;
+  if(frameCache) FreeFrameCache(frameCache);
+  int ret = output.close(output.state);
+  if(ret != 0 || writeFailed) {
+    fprintf(stderr, "Cannot write %s\n", options.outputFile);
+  }
+  if(writeFailed || replayFailed) {
+    ret = 1;
+  }
+  {
+    ScopedStageTimer timer(stats, STAGE_POSTER, trace, counter);
+    if(poster && ClosePosterSheet(poster, ret == 0) != 0) ret = 1;
+    if(contactSheet && ClosePosterSheet(contactSheet, ret == 0) != 0) ret = 1;
+  }
+  GifFreeMapObject(colorMapObj);
+  FreeSceneDetector(sceneDetector);
+  if(paletteLookup) FreePaletteLookup(paletteLookup);
+  FreeFrameArena(arena);
+  if(ret != 0) {
+    RemovePartialOutput(options);
+    return 1;
+  }
+
+  if(stats) {
+    stats->framesEmitted = framesEmitted;
+    stats->framesSkipped = counter - framesEmitted;
+    stats->wallNs = MonotonicNs() - startNs;
+  }
+
+  if(result) {
+    result->framesDecoded = counter;
+    result->framesEmitted = framesEmitted;
+  }
+
+  if(options.verbose) printf("Done: %s\n", options.outputFile);
+  if(options.verbose && options.posterFile) printf("Poster: %s\n", options.posterFile);
+  if(options.verbose && options.contactSheetFile) printf("Contact sheet: %s\n", options.contactSheetFile);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "converter.h"
+#include "cache.h"
+#include "segments.h"
+
+// Protocol, one job per connection: the client sends key=value lines ending
+// with an empty line, e.g.
+//
+//   input=/videos/a.mp4
+//   output=/tmp/a.gif
+//   ss=12.5
+//   t=3
+//
+// and gets back a "progress <decoded> <emitted>" line per emitted frame,
+// then "done <decoded> <emitted> <ms>" ("done 0 0 <ms> cached" when the
+// result came from the cache) or "error <message>". Other keys:
+// start/frames (frame index range), lossy, adaptive-clear, interlace, tile,
+// motion-vectors, compact-palette, two-pass, color-lookup (32, 64 or
+// exact), color-hysteresis, keyframes, segments, format (gif, apng or webp), poster
+// and contact-sheet (paths of stills, which bypass the cache) and grid (the
+// contact sheet's <columns>x<rows>).
+// Without a range the whole input is converted.
+
+#define DAEMON_MAX_REQUEST 8192
+// a client that sends nothing, or reads nothing, for this long loses its
+// job, so it cannot hold a worker forever
+#define DAEMON_IO_TIMEOUT_SECONDS 30
+
+struct DaemonQueue {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<int> clients;
+  bool stopping = false;
+};
+
+// with a memory limit, conversions reserve their estimated peak here before
+// the decoder is opened and wait while the rest of the workers hold too much
+// of it, so the number of jobs in flight follows from their frame sizes
+struct DaemonMemory {
+  std::mutex mutex;
+  std::condition_variable released;
+  uint64_t limit = 0;
+  uint64_t reserved = 0;
+};
+
+static void DaemonReserveMemory(DaemonMemory* memory, uint64_t bytes) {
+  std::unique_lock<std::mutex> lock(memory->mutex);
+  memory->released.wait(lock, [memory, bytes] { return memory->reserved + bytes <= memory->limit; });
+  memory->reserved += bytes;
+}
+
+static void DaemonReleaseMemory(DaemonMemory* memory, uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(memory->mutex);
+    memory->reserved -= bytes;
+  }
+  memory->released.notify_all();
+}
+
+static volatile sig_atomic_t daemonStopRequested = 0;
+static int daemonListenFd = -1;
+
+static void DaemonSignalHandler(int) {
+  daemonStopRequested = 1;
+  // wakes the accept below, shutdown is async signal safe
+  if(daemonListenFd >= 0) shutdown(daemonListenFd, SHUT_RDWR);
+}
+
+static bool DaemonSend(int fd, const char* line) {
+  size_t length = strlen(line);
+  while(length > 0) {
+    ssize_t n = send(fd, line, length, MSG_NOSIGNAL);
+    if(n <= 0) return false;
+    line += n;
+    length -= n;
+  }
+  return true;
+}
+
+// reads up to the empty line that ends a request, false with the reason
+// in error otherwise
+static bool DaemonReadRequest(int fd, std::string* request, std::string* error) {
+  char buffer[1024];
+  while(request->find("\n\n") == std::string::npos) {
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *error = "timeout";
+      return false;
+    }
+    if(n <= 0 || request->size() + n > DAEMON_MAX_REQUEST) {
+      *error = "bad request";
+      return false;
+    }
+    request->append(buffer, n);
+  }
+  return true;
+}
+
+// bounds every recv and send on an accepted connection
+static void DaemonSetTimeouts(int fd) {
+  timeval timeout = {DAEMON_IO_TIMEOUT_SECONDS, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+struct DaemonJob {
+  std::string input;
+  std::string output;
+  std::string poster;
+  std::string contactSheet;
+  ConvertOptions options;
+};
+
+// fills job from the request, false with a reason in error on a bad request
+static bool DaemonParseJob(const std::string& request, DaemonJob* job, std::string* error) {
+  job->options.verbose = false;
+  job->options.timeRange = true;
+  size_t pos = 0;
+  while(pos < request.size()) {
+    size_t end = request.find('\n', pos);
+    if(end == std::string::npos) end = request.size();
+    std::string line = request.substr(pos, end - pos);
+    pos = end + 1;
+    if(line.empty()) break;
+
+    size_t eq = line.find('=');
+    if(eq == std::string::npos) {
+      *error = "expected key=value, got " + line;
+      return false;
+    }
+    std::string key = line.substr(0, eq);
+    const char* value = line.c_str() + eq + 1;
+    ConvertOptions& options = job->options;
+    if(key == "input") job->input = value;
+    else if(key == "output") job->output = value;
+    else if(key == "ss") options.startSeconds = atof(value);
+    else if(key == "t") options.durationSeconds = atof(value);
+    else if(key == "start") { options.timeRange = false; options.startFrameIndex = atoi(value); }
+    else if(key == "frames") { options.timeRange = false; options.noFramesToExtract = atoi(value); }
+    else if(key == "lossy") options.lzw.lossy = atoi(value);
+    else if(key == "adaptive-clear") options.lzw.adaptiveClear = atoi(value) != 0;
+    else if(key == "interlace") options.lzw.interlace = atoi(value) != 0;
+    else if(key == "tile") options.scene.tileSize = atoi(value) == 8 ? 8 : 16;
+    else if(key == "motion-vectors") options.scene.motionVectors = atoi(value) != 0;
+    else if(key == "compact-palette") options.compactPalette = atoi(value) != 0;
+    else if(key == "two-pass") options.twoPass = atoi(value) != 0;
+    else if(key == "keyframes") options.keyframesOnly = atoi(value) != 0;
+    else if(key == "segments") options.segments = std::max(1, atoi(value));
+    else if(key == "color-hysteresis") {
+      if(!ParseColorHysteresis(value, &options.colorHysteresis)) {
+        *error = std::string("bad color hysteresis ") + value;
+        return false;
+      }
+    }
+    else if(key == "color-lookup") {
+      if(!ParseColorLookup(value, &options.colorLookupBits)) {
+        *error = std::string("unknown color lookup ") + value;
+        return false;
+      }
+    }
+    else if(key == "format") {
+      if(!ParseOutputFormat(value, &options.format)) {
+        *error = std::string("unknown format ") + value;
+        return false;
+      }
+    }
+    else if(key == "poster") job->poster = value;
+    else if(key == "contact-sheet") job->contactSheet = value;
+    else if(key == "grid") {
+      if(!ParsePosterGrid(value, &options.sheetColumns, &options.sheetRows)) {
+        *error = std::string("bad grid ") + value;
+        return false;
+      }
+    }
+    else {
+      *error = "unknown key " + key;
+      return false;
+    }
+  }
+
+  if(job->input.empty() || job->output.empty()) {
+    *error = "input and output are required";
+    return false;
+  }
+  if(job->options.colorHysteresis > 0 && !job->options.twoPass) {
+    *error = "color-hysteresis needs two-pass";
+    return false;
+  }
+  return true;
+}
+
+// once a send fails or times out the client is gone or not reading, and
+// nothing more is sent, so each line does not wait out the timeout again
+struct DaemonProgress {
+  int fd;
+  bool lost;
+};
+
+static void DaemonOnFrame(void* user, int framesDecoded, int framesEmitted) {
+  DaemonProgress* progress = (DaemonProgress*)user;
+  if(progress->lost) {
+    return;
+  }
+  char line[64];
+  snprintf(line, sizeof(line), "progress %d %d\n", framesDecoded, framesEmitted);
+  progress->lost = !DaemonSend(progress->fd, line);
+}
+
+static void DaemonRunJob(int fd, LzwEncoder* lzwEncoder, const ResultCache* cache, DaemonMemory* memory) {
+  std::string request;
+  std::string error;
+  if(!DaemonReadRequest(fd, &request, &error)) {
+    DaemonSend(fd, ("error " + error + "\n").c_str());
+    return;
+  }
+
+  DaemonJob job;
+  if(!DaemonParseJob(request, &job, &error)) {
+    DaemonSend(fd, ("error " + error + "\n").c_str());
+    return;
+  }
+
+  uint64_t startNs = MonotonicNs();
+  char line[128];
+  char cacheKey[CACHE_KEY_LENGTH + 1];
+  std::string cacheTempPath;
+  job.options.outputFile = job.output.c_str();
+  if(!job.poster.empty()) job.options.posterFile = job.poster.c_str();
+  if(!job.contactSheet.empty()) job.options.contactSheetFile = job.contactSheet.c_str();
+  if(WritesPosters(job.options)) {
+    cache = nullptr;
+  }
+  // the limit a split job's part count is cut down by, which the cache
+  // key has to see
+  job.options.maxMemory = memory->limit;
+  if(cache) {
+    if(CacheKeyFor(job.input.c_str(), job.options, cacheKey) != 0) {
+      DaemonSend(fd, "error cannot read input\n");
+      return;
+    }
+    if(CacheFetch(*cache, cacheKey, job.options.format, job.output.c_str())) {
+      snprintf(line, sizeof(line), "done 0 0 %.1f cached\n", (MonotonicNs() - startNs) / 1e6);
+      DaemonSend(fd, line);
+      return;
+    }
+    cacheTempPath = CacheTempPath(*cache, job.options.format);
+    job.options.outputFile = cacheTempPath.c_str();
+  }
+
+  VideoInput input;
+  if(OpenVideoContainer(job.input.c_str(), &input, false) != 0) {
+    DaemonSend(fd, "error cannot open input\n");
+    return;
+  }
+
+  // the estimate covers the two pass mode's frame cache, which gets at most
+  // what was reserved for it
+  uint64_t reservedBytes = 0;
+  if(memory->limit > 0) {
+    reservedBytes = EstimateInputBytes(&input, job.options);
+    if(reservedBytes > memory->limit) {
+      CloseVideoInput(&input);
+      snprintf(line, sizeof(line), "error input needs about %.1f MB, over the memory limit\n", reservedBytes / 1048576.0);
+      DaemonSend(fd, line);
+      return;
+    }
+    // every part of a split job holds the buffers of a whole conversion
+    job.options.segments = (int)std::max<uint64_t>(1, std::min<uint64_t>(job.options.segments, memory->limit / std::max<uint64_t>(reservedBytes, 1)));
+    reservedBytes *= job.options.segments;
+    job.options.maxMemory = reservedBytes;
+    DaemonReserveMemory(memory, reservedBytes);
+  }
+
+  if(OpenVideoDecoder(&input, false, job.options.scene.motionVectors) != 0) {
+    if(reservedBytes > 0) DaemonReleaseMemory(memory, reservedBytes);
+    DaemonSend(fd, "error cannot open input\n");
+    return;
+  }
+
+  DaemonProgress progress = {fd, false};
+  job.options.lzwEncoder = lzwEncoder;
+  job.options.onFrame = DaemonOnFrame;
+  job.options.onFrameUser = &progress;
+  ConvertResult result;
+  int ret = ConvertToGifSegments(job.input.c_str(), &input, job.options, &result);
+  CloseVideoInput(&input);
+  if(reservedBytes > 0) {
+    DaemonReleaseMemory(memory, reservedBytes);
+  }
+
+  if(cache) {
+    if(ret == 0) {
+      ret = CachePublish(*cache, cacheKey, job.options.format, cacheTempPath.c_str(), job.output.c_str());
+    }
+    else {
+      unlink(cacheTempPath.c_str());
+    }
+  }
+
+  if(ret == 0) {
+    snprintf(line, sizeof(line), "done %d %d %.1f\n", result.framesDecoded, result.framesEmitted, (MonotonicNs() - startNs) / 1e6);
+  }
+  else {
+    snprintf(line, sizeof(line), "error conversion failed\n");
+  }
+  if(!progress.lost) DaemonSend(fd, line);
+}
+
+// each worker keeps its lzw encoder (and its 2MB dictionary) across jobs
+static void DaemonWorker(DaemonQueue* queue, const ResultCache* cache, DaemonMemory* memory) {
+  LzwEncoder* lzwEncoder = CreateLzwEncoder(LzwOptions());
+  while(true) {
+    int fd;
+    {
+      std::unique_lock<std::mutex> lock(queue->mutex);
+      queue->ready.wait(lock, [queue] { return queue->stopping || !queue->clients.empty(); });
+      if(queue->stopping) break;
+      fd = queue->clients.front();
+      queue->clients.pop_front();
+    }
+    DaemonRunJob(fd, lzwEncoder, cache, memory);
+    close(fd);
+  }
+  FreeLzwEncoder(lzwEncoder);
+}
+
+// opens and closes one H264 decoder so the codec's one time table setup is
+// paid at startup and not by the first job
+static void WarmDecoder() {
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if(!codec) return;
+  AVCodecContext* codecContext = avcodec_alloc_context3(codec);
+  if(codecContext) {
+    avcodec_open2(codecContext, codec, nullptr);
+    avcodec_free_context(&codecContext);
+  }
+}
+
+// serves jobs on a unix socket at socketPath until SIGINT/SIGTERM, running
+// up to workers conversions at once, through cache when it is not null and
+// within maxMemory bytes of estimated peak memory when it is not 0
+int RunDaemon(const char* socketPath, int workers, const ResultCache* cache, uint64_t maxMemory) {
+  if(cache && CacheOpen(*cache) != 0) {
+    return 1;
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if(strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", socketPath);
+    return 1;
+  }
+  strcpy(address.sun_path, socketPath);
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listenFd < 0) {
+    fprintf(stderr, "cannot create socket\n");
+    return 1;
+  }
+  unlink(socketPath);
+  // a job writes wherever output= says, so only our own user may connect
+  if(bind(listenFd, (sockaddr*)&address, sizeof(address)) < 0 || chmod(socketPath, 0600) < 0 || listen(listenFd, 64) < 0) {
+    fprintf(stderr, "cannot listen on %s\n", socketPath);
+    close(listenFd);
+    return 1;
+  }
+
+  WarmDecoder();
+
+  daemonListenFd = listenFd;
+  signal(SIGINT, DaemonSignalHandler);
+  signal(SIGTERM, DaemonSignalHandler);
+
+  DaemonQueue queue;
+  DaemonMemory memory;
+  memory.limit = maxMemory;
+  std::vector<std::thread> threads;
+  for(int i = 0; i < workers; ++i) {
+    threads.emplace_back(DaemonWorker, &queue, cache, &memory);
+  }
+  printf("Listening on %s with %d workers\n", socketPath, workers);
+  fflush(stdout);
+
+  while(!daemonStopRequested) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if(fd < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    DaemonSetTimeouts(fd);
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.clients.push_back(fd);
+    queue.ready.notify_one();
+  }
+
+  // jobs already running finish, the ones still queued are turned away
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.stopping = true;
+  }
+  queue.ready.notify_all();
+  for(std::thread& thread : threads) {
+    thread.join();
+  }
+  for(int fd : queue.clients) {
+    DaemonSend(fd, "error stopping\n");
+    close(fd);
+  }
+
+  daemonListenFd = -1;
+  close(listenFd);
+  unlink(socketPath);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "budget.h"
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/frame.h>
+}
+
+// frames compressed (and inflated once) before the cost model compares
+// compressing with decoding again
+#define FRAME_CACHE_PROBE_FRAMES 8
+
+enum FrameCacheMode {
+  FRAME_CACHE_RAW,
+  FRAME_CACHE_COMPRESSED,
+  FRAME_CACHE_OFF
+};
+
+static const char* const FRAME_CACHE_MODE_NAMES[] = {"decoded", "compressed", "off"};
+
+// The analyzed frames of the two pass mode's first pass, held for the
+// second. While the decoded pictures fit the limit they are kept as they
+// are, replaying them costs nothing. When they stop fitting they are
+// compressed losslessly with libavcodec's UtVideo, an intra only codec built
+// for speed, and the second pass inflates them again. That only pays while
+// compressing and inflating a frame is cheaper than demuxing and decoding
+// the range again, so the cost model times the first few frames of both
+// and drops the cache when decoding again wins, or when even the compressed
+// frames do not fit.
+struct FrameCache {
+  FrameCacheMode mode;
+  uint64_t limit;
+  uint64_t bytes;
+  uint64_t frameBytes;
+  // the pictures in raw mode; in compressed mode frame-less copies of
+  // their properties, next to the packet each one is in
+  std::vector<AVFrame*> frames;
+  std::vector<AVPacket*> packets;
+  std::vector<int> counters;
+  AVCodecContext* encoder;
+  AVCodecContext* decoder;
+  AVFrame* inflated;
+  // what compressing and inflating took over the frames measured
+  uint64_t compressNs;
+  uint64_t inflateNs;
+  int compressedFrames;
+  int inflatedFrames;
+};
+
+FrameCache* CreateFrameCache(uint64_t limit, int width, int height) {
+  FrameCache* cache = new FrameCache();
+  cache->limit = limit;
+  cache->bytes = 0;
+  cache->frameBytes = DecodedFrameBytes(width, height);
+  cache->mode = limit >= cache->frameBytes ? FRAME_CACHE_RAW : FRAME_CACHE_OFF;
+  cache->encoder = nullptr;
+  cache->decoder = nullptr;
+  cache->inflated = nullptr;
+  cache->compressNs = 0;
+  cache->inflateNs = 0;
+  cache->compressedFrames = 0;
+  cache->inflatedFrames = 0;
+  return cache;
+}
+
+static void ClearFrameCache(FrameCache* cache) {
+  for(AVFrame* frame : cache->frames) av_frame_free(&frame);
+  for(AVPacket* packet : cache->packets) av_packet_free(&packet);
+  cache->frames.clear();
+  cache->packets.clear();
+  cache->counters.clear();
+  cache->bytes = 0;
+}
+
+// gives up on the cache, the second pass decodes again
+static void DropFrameCache(FrameCache* cache) {
+  ClearFrameCache(cache);
+  cache->mode = FRAME_CACHE_OFF;
+}
+
+void FreeFrameCache(FrameCache* cache) {
+  ClearFrameCache(cache);
+  avcodec_free_context(&cache->encoder);
+  avcodec_free_context(&cache->decoder);
+  av_frame_free(&cache->inflated);
+  delete cache;
+}
+
+// one frame at a time in and out, so a packet comes back for every picture
+static AVCodecContext* OpenFrameCacheCodec(const AVCodec* codec, int width, int height) {
+  AVCodecContext* context = codec ? avcodec_alloc_context3(codec) : nullptr;
+  if(!context) {
+    return nullptr;
+  }
+  context->width = width;
+  context->height = height;
+  context->pix_fmt = AV_PIX_FMT_YUV420P;
+  context->time_base = {1, 25};
+  context->thread_count = 1;
+  if(avcodec_open2(context, codec, nullptr) < 0) {
+    avcodec_free_context(&context);
+  }
+  return context;
+}
+
+// UtVideo takes planar 4:2:0 only; full range pictures have the same
+// layout and get their range back from the properties on replay
+static bool OpenFrameCacheCodecs(FrameCache* cache, const AVFrame* frame) {
+  if(frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+    return false;
+  }
+  if(!cache->encoder) {
+    cache->encoder = OpenFrameCacheCodec(avcodec_find_encoder(AV_CODEC_ID_UTVIDEO), frame->width, frame->height);
+    cache->decoder = OpenFrameCacheCodec(avcodec_find_decoder(AV_CODEC_ID_UTVIDEO), frame->width, frame->height);
+    cache->inflated = av_frame_alloc();
+  }
+  return cache->encoder && cache->decoder && cache->inflated;
+}
+
+// compresses frame into a packet and a copy of its properties; the first
+// few packets are inflated once too, to time the replay
+static bool CompressCacheFrame(FrameCache* cache, const AVFrame* frame, AVFrame** shell, AVPacket** packet) {
+  uint64_t startNs = MonotonicNs();
+  AVFrame* picture = av_frame_clone(frame);
+  *packet = av_packet_alloc();
+  bool ok = picture && *packet;
+  if(ok) {
+    picture->format = AV_PIX_FMT_YUV420P;
+    picture->pts = cache->compressedFrames;
+    ok = avcodec_send_frame(cache->encoder, picture) == 0 && avcodec_receive_packet(cache->encoder, *packet) == 0;
+  }
+  av_frame_free(&picture);
+  *shell = ok ? av_frame_alloc() : nullptr;
+  if(*shell) {
+    (*shell)->format = frame->format;
+    (*shell)->width = frame->width;
+    (*shell)->height = frame->height;
+    ok = av_frame_copy_props(*shell, frame) >= 0;
+  }
+  if(!ok || !*shell) {
+    av_packet_free(packet);
+    av_frame_free(shell);
+    return false;
+  }
+  uint64_t compressedNs = MonotonicNs();
+  cache->compressNs += compressedNs - startNs;
+  ++cache->compressedFrames;
+
+  if(cache->inflatedFrames < FRAME_CACHE_PROBE_FRAMES) {
+    bool inflated = avcodec_send_packet(cache->decoder, *packet) == 0 && avcodec_receive_frame(cache->decoder, cache->inflated) == 0;
+    av_frame_unref(cache->inflated);
+    if(!inflated) {
+      av_packet_free(packet);
+      av_frame_free(shell);
+      return false;
+    }
+    cache->inflateNs += MonotonicNs() - compressedNs;
+    ++cache->inflatedFrames;
+  }
+  return true;
+}
+
+// the cost model: compressing a frame now and inflating it in the second
+// pass has to be cheaper than what demuxing and decoding cost per analyzed
+// frame in the first pass, which is what decoding again would cost
+static bool CompressingPays(const FrameCache* cache, uint64_t decodeNsPerFrame) {
+  if(cache->compressedFrames < FRAME_CACHE_PROBE_FRAMES || cache->inflatedFrames == 0) {
+    return true;
+  }
+  uint64_t perFrame = cache->compressNs / cache->compressedFrames + cache->inflateNs / cache->inflatedFrames;
+  return perFrame < decodeNsPerFrame;
+}
+
+// adds a compressed frame, false when it does not fit or does not pay
+static bool AddCompressedFrame(FrameCache* cache, const AVFrame* frame, uint64_t decodeNsPerFrame, AVFrame** shell, AVPacket** packet) {
+  if(!CompressCacheFrame(cache, frame, shell, packet)) {
+    return false;
+  }
+  if(cache->bytes + (*packet)->size > cache->limit || !CompressingPays(cache, decodeNsPerFrame)) {
+    av_packet_free(packet);
+    av_frame_free(shell);
+    return false;
+  }
+  cache->bytes += (*packet)->size;
+  return true;
+}
+
+// the held pictures no longer fit: compresses them in place, dropping the
+// cache when that fails, overflows or does not pay
+static bool SwitchToCompressed(FrameCache* cache, const AVFrame* frame, uint64_t decodeNsPerFrame) {
+  if(!OpenFrameCacheCodecs(cache, frame)) {
+    return false;
+  }
+  cache->mode = FRAME_CACHE_COMPRESSED;
+  cache->bytes = (uint64_t)cache->frames.size() * cache->frameBytes;
+  for(size_t i = 0; i < cache->frames.size(); ++i) {
+    AVFrame* shell;
+    AVPacket* packet;
+    cache->bytes -= cache->frameBytes;
+    if(!AddCompressedFrame(cache, cache->frames[i], decodeNsPerFrame, &shell, &packet)) {
+      return false;
+    }
+    av_frame_free(&cache->frames[i]);
+    cache->frames[i] = shell;
+    cache->packets.push_back(packet);
+  }
+  return true;
+}
+
+// offers a picture picked for analysis, with its counter and what decoding
+// has cost per analyzed frame so far; false when the cache is off, or just
+// got dropped
+bool FrameCacheAdd(FrameCache* cache, const AVFrame* frame, int counter, uint64_t decodeNsPerFrame) {
+  if(cache->mode == FRAME_CACHE_RAW) {
+    if(cache->bytes + cache->frameBytes <= cache->limit) {
+      AVFrame* held = av_frame_clone(frame);
+      if(held) {
+        cache->frames.push_back(held);
+        cache->counters.push_back(counter);
+        cache->bytes += cache->frameBytes;
+        return true;
+      }
+    }
+    else if(!SwitchToCompressed(cache, frame, decodeNsPerFrame)) {
+      DropFrameCache(cache);
+      return false;
+    }
+  }
+  if(cache->mode == FRAME_CACHE_COMPRESSED) {
+    AVFrame* shell;
+    AVPacket* packet;
+    if(AddCompressedFrame(cache, frame, decodeNsPerFrame, &shell, &packet)) {
+      cache->frames.push_back(shell);
+      cache->packets.push_back(packet);
+      cache->counters.push_back(counter);
+      return true;
+    }
+  }
+  DropFrameCache(cache);
+  return false;
+}
+
+// after the first pass: whether the second replays the cache. A
+// compressed one only still has to be inflated, which is set against
+// decoding the range again
+bool FrameCacheReplays(FrameCache* cache, uint64_t decodeNsPerFrame) {
+  if(cache->mode == FRAME_CACHE_COMPRESSED && cache->inflatedFrames > 0 &&
+     cache->inflateNs / cache->inflatedFrames >= decodeNsPerFrame) {
+    DropFrameCache(cache);
+  }
+  return cache->mode != FRAME_CACHE_OFF;
+}
+
+size_t FrameCacheCount(const FrameCache* cache) {
+  return cache->frames.size();
+}
+
+// the i-th held picture, inflated in compressed mode; valid until the
+// next call. Null when it does not inflate
+const AVFrame* FrameCacheFrame(FrameCache* cache, size_t i) {
+  if(cache->mode == FRAME_CACHE_RAW) {
+    return cache->frames[i];
+  }
+  av_frame_unref(cache->inflated);
+  if(avcodec_send_packet(cache->decoder, cache->packets[i]) != 0 ||
+     avcodec_receive_frame(cache->decoder, cache->inflated) != 0 ||
+     av_frame_copy_props(cache->inflated, cache->frames[i]) < 0) {
+    return nullptr;
+  }
+  cache->inflated->format = cache->frames[i]->format;
+  return cache->inflated;
+}
+
+// frees what the i-th entry holds once it has been replayed
+void FrameCacheRelease(FrameCache* cache, size_t i) {
+  av_frame_free(&cache->frames[i]);
+  if(i < cache->packets.size()) av_packet_free(&cache->packets[i]);
+}
+
+#endif
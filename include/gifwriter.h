@@ -0,0 +1,349 @@
+#ifndef GIFWRITER_H
+#define GIFWRITER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include "output.h"
+#include "arena.h"
+#include "stats.h"
+#include "lzw.h"
+#include "palette.h"
+
+extern "C" {
+  #include <gif_lib.h>
+}
+
+// the delay of the last frame when nothing after it says how long it stays
+#define GIF_LAST_FRAME_CENTIS 10
+// browsers show an image with a delay under 2/100s for 1/10s instead
+#define GIF_MIN_DELAY_CENTIS 2
+
+// A part of the range written as a gif file of its own, so parts can be
+// converted side by side and joined afterwards. Joining keeps the first
+// part's header, drops the other headers and every trailer but the last,
+// and sets the delay of each part's last image from the next part's first
+// image time, which the part's own writer could not know.
+struct GifSegment {
+  // the part of the range, in the stream's time base
+  int64_t startPts = 0;
+  int64_t endPts = INT64_MAX;
+  std::string path;
+  FILE* file = nullptr;
+  // bytes written so far, and how many of them are the screen description
+  // and loop extension in front of the first image
+  uint64_t bytes = 0;
+  uint64_t headerBytes = 0;
+  int images = 0;
+  // file offset of the last image's delay, and the times of the first and
+  // last image in 1/100s
+  uint64_t lastDelayOffset = 0;
+  int64_t firstCentis = 0;
+  int64_t lastCentis = 0;
+};
+
+// Every video frame becomes one gif image with a graphics control block
+// carrying its delay, which is only known once the next frame's time is.
+// So the changed regions are copied onto a screen of the current picture
+// and the frame is written from there, as the bounding box of its regions,
+// when the next one begins; a browser would hold an extra image per region
+// for 1/10s, whatever delay it asks for.
+struct GifWriter {
+  GifFileType* gifFile;
+  int width;
+  int height;
+  const ColorMapObject* globalMap;
+  LzwEncoder* lzwEncoder;
+  bool ownsEncoder;
+  CompactPalette* compactPalette;
+  const ColorMapObject* lzwPalette;
+  bool cut;
+  int64_t frameNumber;
+  uint8_t* screen;
+  bool pending;
+  int pendingLeft;
+  int pendingTop;
+  int pendingRight;
+  int pendingBottom;
+  int64_t frameCentis;
+  int64_t pendingCentis;
+  int lastDelay;
+  GifSegment* segment;
+  ConvertStats* stats;
+  TraceRecorder* trace;
+};
+
+int WriteNetscapeLoopExtension(GifFileType *gifFile, int loopCount) {
+    unsigned char nsAppId[] = {'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0'};
+    if (EGifPutExtensionLeader(gifFile, APPLICATION_EXT_FUNC_CODE) == GIF_ERROR) {
+        return GIF_ERROR;
+    }
+    if (EGifPutExtensionBlock(gifFile, sizeof(nsAppId), nsAppId) == GIF_ERROR) {
+        return GIF_ERROR;
+    }
+
+    unsigned char nsLoopBlock[] = {0x01, (unsigned char)(loopCount & 0xFF), (unsigned char)((loopCount >> 8) & 0xFF)};
+    if (EGifPutExtensionBlock(gifFile, sizeof(nsLoopBlock), nsLoopBlock) == GIF_ERROR) {
+        return GIF_ERROR;
+    }
+
+    if (EGifPutExtensionTrailer(gifFile) == GIF_ERROR) {
+        return GIF_ERROR;
+    }
+
+    return GIF_OK;
+}
+
+static int GifWriterBegin(void* state, const ColorMapObject* globalMap) {
+  GifWriter* writer = (GifWriter*)state;
+  writer->globalMap = globalMap;
+  LzwSetPalette(writer->lzwEncoder, globalMap);
+  writer->lzwPalette = globalMap;
+
+  EGifSetGifVersion(writer->gifFile, true);
+
+  int ret = EGifPutScreenDesc(writer->gifFile, writer->width, writer->height, 8, 0, globalMap);
+
+  if(ret == GIF_ERROR) {
+    fprintf(stderr, "Cannot set screen description: %s\n", GifErrorString(ret));
+  }
+
+  int loopCount = 0;
+  int res = WriteNetscapeLoopExtension(writer->gifFile, loopCount);
+  if(res == GIF_ERROR) {
+    fprintf(stderr, "Cannot write loop extension block\n");
+  }
+  if(writer->segment) {
+    writer->segment->headerBytes = writer->segment->bytes;
+  }
+  return ret == GIF_ERROR || res == GIF_ERROR ? 1 : 0;
+}
+
+// writes the frame gathered on the screen, shown for delay 1/100s
+static int GifFlushPending(GifWriter* writer, int delay) {
+  if(!writer->pending) {
+    return 0;
+  }
+  writer->pending = false;
+  int left = writer->pendingLeft;
+  int top = writer->pendingTop;
+  int width = writer->pendingRight - left;
+  int height = writer->pendingBottom - top;
+  const uint8_t* imagePixels = writer->screen + (size_t)top * writer->width + left;
+  int imageStride = writer->width;
+  ColorMapObject* localMap = nullptr;
+  if(writer->compactPalette) {
+    ScopedStageTimer timer(writer->stats, STAGE_QUANTIZE, writer->trace, writer->frameNumber);
+    localMap = CompactFramePalette(writer->compactPalette, writer->globalMap, imagePixels, width, height, imageStride, writer->cut);
+    if(localMap) {
+      imagePixels = writer->compactPalette->indices;
+      imageStride = width;
+    }
+  }
+  const ColorMapObject* imagePalette = localMap ? localMap : writer->globalMap;
+  if(imagePalette != writer->lzwPalette || localMap) {
+    LzwSetPalette(writer->lzwEncoder, imagePalette);
+    writer->lzwPalette = imagePalette;
+  }
+
+  ScopedStageTimer timer(writer->stats, STAGE_GIF_WRITE, writer->trace, writer->frameNumber);
+  delay = std::min(std::max(delay, GIF_MIN_DELAY_CENTIS), 65535);
+  if(writer->segment) {
+    GifSegment* segment = writer->segment;
+    if(segment->images++ == 0) segment->firstCentis = writer->pendingCentis;
+    segment->lastCentis = writer->pendingCentis;
+    // introducer, label, block size and packed fields come before the delay
+    segment->lastDelayOffset = segment->bytes + 4;
+  }
+  // disposal 1, leave the image in place for the next one to draw over
+  unsigned char graphicsControl[4] = {1 << 2, (unsigned char)(delay & 0xff), (unsigned char)(delay >> 8), 0};
+  int ret = EGifPutExtension(writer->gifFile, GRAPHICS_EXT_FUNC_CODE, sizeof(graphicsControl), graphicsControl);
+  if(ret != GIF_ERROR) {
+    ret = EGifPutImageDesc(writer->gifFile, left, top, width, height, writer->lzwEncoder->options.interlace, localMap);
+  }
+  if(ret != GIF_ERROR) {
+    ret = WriteImageData(writer->gifFile, writer->lzwEncoder, imagePixels, width, height, imageStride, GifMinCodeSize(imagePalette));
+  }
+  return ret == GIF_ERROR ? 1 : 0;
+}
+
+static int GifWriterBeginFrame(void* state, double time, bool cut, int64_t frameNumber) {
+  GifWriter* writer = (GifWriter*)state;
+  // delays come from the rounded times, so rounding never adds up to drift
+  int64_t centis = (int64_t)(time * 100 + 0.5);
+  int ret = 0;
+  if(writer->pending) {
+    int delay = (int)(centis - writer->pendingCentis);
+    if(delay > 0) writer->lastDelay = delay;
+    ret = GifFlushPending(writer, delay);
+  }
+  writer->cut = cut;
+  writer->frameNumber = frameNumber;
+  writer->frameCentis = centis;
+  return ret;
+}
+
+static int GifWriterRegion(void* state, const OutputRegion& region) {
+  GifWriter* writer = (GifWriter*)state;
+  for(int y = 0; y < region.height; ++y) {
+    memcpy(writer->screen + (size_t)(region.top + y) * writer->width + region.left,
+           region.pixels + (size_t)y * region.stride, region.width);
+  }
+  if(!writer->pending) {
+    writer->pending = true;
+    writer->pendingLeft = region.left;
+    writer->pendingTop = region.top;
+    writer->pendingRight = region.left + region.width;
+    writer->pendingBottom = region.top + region.height;
+    writer->pendingCentis = writer->frameCentis;
+    return 0;
+  }
+  writer->pendingLeft = std::min(writer->pendingLeft, region.left);
+  writer->pendingTop = std::min(writer->pendingTop, region.top);
+  writer->pendingRight = std::max(writer->pendingRight, region.left + region.width);
+  writer->pendingBottom = std::max(writer->pendingBottom, region.top + region.height);
+  return 0;
+}
+
+static int GifWriterClose(void* state) {
+  GifWriter* writer = (GifWriter*)state;
+  // the last frame stays up as long as the one before it did
+  int flushed = GifFlushPending(writer, writer->lastDelay);
+  int ret = EGifCloseFile(writer->gifFile, NULL);
+  if(flushed != 0) ret = GIF_ERROR;
+  if(writer->segment && fclose(writer->segment->file) != 0) ret = GIF_ERROR;
+  if(writer->ownsEncoder) FreeLzwEncoder(writer->lzwEncoder);
+  if(writer->compactPalette) FreeCompactPalette(writer->compactPalette);
+  delete writer;
+  return ret == GIF_ERROR ? 1 : 0;
+}
+
+static int GifSegmentWrite(GifFileType* gifFile, const GifByteType* data, int length) {
+  GifSegment* segment = (GifSegment*)gifFile->UserData;
+  size_t written = fwrite(data, 1, length, segment->file);
+  segment->bytes += written;
+  return (int)written;
+}
+
+static void StartGifWriter(OutputBackend* backend, GifFileType* gifFile, GifSegment* segment, int width, int height, const LzwOptions& lzwOptions,
+                           LzwEncoder* lzwEncoder, bool compactPalette, FrameArena* arena, ConvertStats* stats, TraceRecorder* trace) {
+  // the screen is described in GifWriterBegin, once the palette is known
+  GifWriter* writer = new GifWriter();
+  writer->gifFile = gifFile;
+  writer->width = width;
+  writer->height = height;
+  writer->globalMap = nullptr;
+  writer->ownsEncoder = !lzwEncoder;
+  if(lzwEncoder) {
+    lzwEncoder->options = lzwOptions;
+  }
+  else {
+    lzwEncoder = CreateLzwEncoder(lzwOptions);
+  }
+  writer->lzwEncoder = lzwEncoder;
+  LzwReserve(lzwEncoder, (size_t)width * height);
+  writer->compactPalette = compactPalette ? CreateCompactPalette(width, height, arena) : nullptr;
+  writer->lzwPalette = nullptr;
+  writer->cut = true;
+  writer->frameNumber = 0;
+  writer->screen = ArenaArray<uint8_t>(arena, (size_t)width * height);
+  writer->pending = false;
+  writer->frameCentis = 0;
+  writer->pendingCentis = 0;
+  writer->lastDelay = GIF_LAST_FRAME_CENTIS;
+  writer->segment = segment;
+  writer->stats = stats;
+  writer->trace = trace;
+
+  backend->state = writer;
+  backend->begin = GifWriterBegin;
+  backend->beginFrame = GifWriterBeginFrame;
+  backend->writeRegion = GifWriterRegion;
+  backend->close = GifWriterClose;
+}
+
+// lzwEncoder is reused when not null, with its options replaced by
+// lzwOptions; buffers sized by the frame come from arena
+bool OpenGifWriter(OutputBackend* backend, const char* path, int width, int height, const LzwOptions& lzwOptions,
+                   LzwEncoder* lzwEncoder, bool compactPalette, FrameArena* arena, ConvertStats* stats, TraceRecorder* trace) {
+  int errCode = 0;
+
+  GifFileType* gifFile = EGifOpenFileName(path, false, &errCode);
+
+  if(!gifFile) {
+    fprintf(stderr, "Cannot open gif file: %s\n", GifErrorString(errCode));
+    return false;
+  }
+  StartGifWriter(backend, gifFile, nullptr, width, height, lzwOptions, lzwEncoder, compactPalette, arena, stats, trace);
+  return true;
+}
+
+// the same writer over segment->path, keeping track of what joining the
+// segment needs
+bool OpenGifSegmentWriter(OutputBackend* backend, GifSegment* segment, int width, int height, const LzwOptions& lzwOptions,
+                          LzwEncoder* lzwEncoder, bool compactPalette, FrameArena* arena, ConvertStats* stats, TraceRecorder* trace) {
+  segment->file = fopen(segment->path.c_str(), "wb");
+  if(!segment->file) {
+    fprintf(stderr, "Cannot open gif file: %s\n", segment->path.c_str());
+    return false;
+  }
+  int errCode = 0;
+  GifFileType* gifFile = EGifOpen(segment, GifSegmentWrite, &errCode);
+  if(!gifFile) {
+    fprintf(stderr, "Cannot open gif file: %s\n", GifErrorString(errCode));
+    fclose(segment->file);
+    return false;
+  }
+  StartGifWriter(backend, gifFile, segment, width, height, lzwOptions, lzwEncoder, compactPalette, arena, stats, trace);
+  return true;
+}
+
+// writes segments[0..count), converted in that order, as one gif at path;
+// a segment without images adds nothing. The segment files stay in place.
+int JoinGifSegments(const char* path, const GifSegment* segments, int count) {
+  FILE* out = fopen(path, "wb");
+  if(!out) {
+    fprintf(stderr, "Cannot open gif file: %s\n", path);
+    return 1;
+  }
+  static const uint8_t trailer = 0x3b;
+  uint8_t buffer[1 << 16];
+  bool ok = true;
+  for(int i = 0; i < count && ok; ++i) {
+    const GifSegment& segment = segments[i];
+    if(i > 0 && segment.images == 0) continue;
+    // the last image stays up until the next segment's first one
+    int delay = 0;
+    for(int j = i + 1; j < count && delay == 0; ++j) {
+      if(segments[j].images > 0) delay = (int)(segments[j].firstCentis - segment.lastCentis);
+    }
+    delay = delay > 0 ? std::min(std::max(delay, GIF_MIN_DELAY_CENTIS), 65535) : 0;
+
+    FILE* in = fopen(segment.path.c_str(), "rb");
+    uint64_t position = i == 0 ? 0 : segment.headerBytes;
+    uint64_t end = segment.bytes > 0 ? segment.bytes - 1 : 0;
+    ok = in && fseek(in, (long)position, SEEK_SET) == 0;
+    while(ok && position < end) {
+      size_t n = fread(buffer, 1, (size_t)std::min<uint64_t>(sizeof(buffer), end - position), in);
+      ok = n > 0;
+      for(int b = 0; b < 2 && segment.images > 0 && delay > 0; ++b) {
+        uint64_t at = segment.lastDelayOffset + b;
+        if(at >= position && at < position + n) buffer[at - position] = (uint8_t)(delay >> (8 * b));
+      }
+      ok = ok && fwrite(buffer, 1, n, out) == n;
+      position += n;
+    }
+    if(in) fclose(in);
+  }
+  ok = ok && fwrite(&trailer, 1, 1, out) == 1;
+  ok = fclose(out) == 0 && ok;
+  if(!ok) {
+    fprintf(stderr, "Cannot join the parts of %s\n", path);
+  }
+  return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef LZW_H
+#define LZW_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+  #include <gif_lib.h>
+}
+
+#define LZW_MAX_BITS 12
+// like giflib, the dictionary is full when the next free code would be 4095
+#define LZW_MAX_CODE 4095
+#define LZW_MAX_ALPHABET_BITS 8
+#define GIF_SUB_BLOCK_SIZE 255
+// how many substitutes lossy matching tries for a pixel, nearest first
+#define LZW_LOSSY_NEIGHBORS 16
+
+struct LzwOptions {
+  // keep coding with a full dictionary and only clear once it stops paying
+  // off, instead of clearing as soon as it fills like giflib does
+  bool adaptiveClear = false;
+  // with a full dictionary, compare pixels per code of the last window of
+  // this many codes against the average since the last clear
+  int clearCheckCodes = 256;
+  // and clear when the window is this much worse than the average
+  float clearRatioDrop = 0.15f;
+  // lossy matching: a pixel may be replaced by a palette color up to this
+  // euclidean rgb distance away if that extends the current string, 0 is lossless
+  int lossy = 0;
+  // write the rows in gif's four pass interlaced order, so a viewer can
+  // show a coarse full frame after the first eighth of the rows arrived
+  bool interlace = false;
+};
+
+// children[(prefix << minCodeSize) | pixel] is the code extending prefix by
+// pixel, 0 when there is none (0 is always a root so it is never a child).
+// slots[code] remembers where each code went so a clear only touches the
+// entries that were actually used instead of the whole 2MB table.
+// neighbors[i] lists the palette entries within options.lossy of entry i.
+struct LzwEncoder {
+  LzwOptions options;
+  uint16_t* children;
+  uint32_t slots[1 << LZW_MAX_BITS];
+  uint8_t neighbors[1 << LZW_MAX_ALPHABET_BITS][LZW_LOSSY_NEIGHBORS];
+  uint8_t neighborCounts[1 << LZW_MAX_ALPHABET_BITS];
+  std::vector<uint8_t> packed;
+  std::vector<uint8_t> blocks;
+  size_t blockLength;
+};
+
+LzwEncoder* CreateLzwEncoder(const LzwOptions& options) {
+  LzwEncoder* encoder = new LzwEncoder();
+  encoder->options = options;
+  encoder->children = new uint16_t[(1 << LZW_MAX_BITS) << LZW_MAX_ALPHABET_BITS]();
+  memset(encoder->neighborCounts, 0, sizeof(encoder->neighborCounts));
+  encoder->blockLength = 0;
+  return encoder;
+}
+
+// the worst case output of an image: at most one 12 bit code per pixel plus
+// the clears, 16 bits per pixel covers both
+static size_t LzwPackedBound(size_t pixelCount) {
+  return pixelCount * 2 + 16;
+}
+
+// sizes the output buffers for images of up to pixelCount pixels up front,
+// so encoding them never reallocates
+void LzwReserve(LzwEncoder* encoder, size_t pixelCount) {
+  size_t packed = LzwPackedBound(pixelCount);
+  if(encoder->packed.size() < packed) {
+    encoder->packed.resize(packed);
+  }
+  if(encoder->blocks.size() < packed + packed / GIF_SUB_BLOCK_SIZE + 1) {
+    encoder->blocks.resize(packed + packed / GIF_SUB_BLOCK_SIZE + 1);
+  }
+}
+
+void FreeLzwEncoder(LzwEncoder* encoder) {
+  delete[] encoder->children;
+  delete encoder;
+}
+
+// the lzw minimum code size giflib writes after the image descriptor
+int GifMinCodeSize(const ColorMapObject* colorMap) {
+  return colorMap->BitsPerPixel < 2 ? 2 : colorMap->BitsPerPixel;
+}
+
+// rebuilds the lossy substitution lists for the palette the next images use,
+// a no-op for lossless encoders
+void LzwSetPalette(LzwEncoder* encoder, const ColorMapObject* colorMap) {
+  memset(encoder->neighborCounts, 0, sizeof(encoder->neighborCounts));
+  if(encoder->options.lossy <= 0) {
+    return;
+  }
+
+  int maxDistance = encoder->options.lossy * encoder->options.lossy;
+  int colorCount = colorMap->ColorCount < 256 ? colorMap->ColorCount : 256;
+  for(int i = 0; i < colorCount; ++i) {
+    // insertion sort into a short list, nearest first
+    int distances[LZW_LOSSY_NEIGHBORS];
+    int count = 0;
+    const GifColorType& a = colorMap->Colors[i];
+    for(int j = 0; j < colorCount; ++j) {
+      const GifColorType& b = colorMap->Colors[j];
+      int dr = a.Red - b.Red, dg = a.Green - b.Green, db = a.Blue - b.Blue;
+      int distance = dr * dr + dg * dg + db * db;
+      if(j == i || distance > maxDistance) continue;
+      if(count == LZW_LOSSY_NEIGHBORS && distance >= distances[count - 1]) continue;
+
+      int k = count < LZW_LOSSY_NEIGHBORS ? count++ : count - 1;
+      while(k > 0 && distances[k - 1] > distance) {
+        distances[k] = distances[k - 1];
+        encoder->neighbors[i][k] = encoder->neighbors[i][k - 1];
+        --k;
+      }
+      distances[k] = distance;
+      encoder->neighbors[i][k] = j;
+    }
+    encoder->neighborCounts[i] = count;
+  }
+}
+
+// the source row of the i-th row in gif's interlaced order: every 8th row
+// from 0, every 8th from 4, every 4th from 2, then the odd rows
+static inline int GifInterlacedRow(int i, int height) {
+  int pass1 = (height + 7) / 8;
+  if(i < pass1) return i * 8;
+  i -= pass1;
+  int pass2 = (height + 3) / 8;
+  if(i < pass2) return i * 8 + 4;
+  i -= pass2;
+  int pass3 = (height + 1) / 4;
+  if(i < pass3) return i * 4 + 2;
+  return (i - pass3) * 2 + 1;
+}
+
+// compresses a width x height image (rows stride bytes apart) into encoder->packed
+// and returns the number of bytes written; pixels above the code size are masked.
+// Interlaced images are read in pass order straight from the source rows.
+size_t LzwEncode(LzwEncoder* encoder, const uint8_t* pixels, int width, int height, int stride, int minCodeSize) {
+  const uint32_t clearCode = 1u << minCodeSize;
+  const uint32_t eoiCode = clearCode + 1;
+  const uint32_t pixelMask = clearCode - 1;
+  const size_t pixelCount = (size_t)width * height;
+  const bool lossy = encoder->options.lossy > 0;
+  const bool adaptiveClear = encoder->options.adaptiveClear;
+  const bool interlace = encoder->options.interlace;
+  const uint32_t clearCheckCodes = encoder->options.clearCheckCodes > 0 ? encoder->options.clearCheckCodes : 1;
+  const float clearRatioKeep = 1.0f - encoder->options.clearRatioDrop;
+
+  if(encoder->packed.size() < LzwPackedBound(pixelCount)) {
+    encoder->packed.resize(LzwPackedBound(pixelCount));
+  }
+
+  uint16_t* children = encoder->children;
+  uint32_t* slots = encoder->slots;
+  uint8_t* out = encoder->packed.data();
+  uint64_t bitBuffer = 0;
+  int bitCount = 0;
+  int codeSize = minCodeSize + 1;
+  uint32_t nextCode = eoiCode + 1;
+
+  // bookkeeping for adaptive clears, positions are pixel offsets into the image
+  uint32_t codesSinceClear = 0;
+  size_t clearPosition = 0;
+  uint32_t windowCodes = 0;
+  size_t windowPosition = 0;
+
+  auto emit = [&](uint32_t code) {
+    bitBuffer |= (uint64_t)code << bitCount;
+    bitCount += codeSize;
+    if(bitCount >= 32) {
+      out[0] = (uint8_t)bitBuffer;
+      out[1] = (uint8_t)(bitBuffer >> 8);
+      out[2] = (uint8_t)(bitBuffer >> 16);
+      out[3] = (uint8_t)(bitBuffer >> 24);
+      out += 4;
+      bitBuffer >>= 32;
+      bitCount -= 32;
+    }
+  };
+
+  auto clear = [&](size_t position) {
+    emit(clearCode);
+    for(uint32_t code = eoiCode + 1; code < nextCode; ++code) {
+      children[slots[code]] = 0;
+    }
+    nextCode = eoiCode + 1;
+    codeSize = minCodeSize + 1;
+    codesSinceClear = 0;
+    clearPosition = position;
+    windowCodes = 0;
+  };
+
+  emit(clearCode);
+
+  if(pixelCount > 0) {
+    uint32_t prefix = pixels[0] & pixelMask;
+    for(int y = 0; y < height; ++y) {
+      const uint8_t* row = pixels + (size_t)(interlace ? GifInterlacedRow(y, height) : y) * stride;
+      for(int x = (y == 0) ? 1 : 0; x < width; ++x) {
+        uint32_t pixel = row[x] & pixelMask;
+        uint32_t slot = (prefix << minCodeSize) | pixel;
+        uint32_t child = children[slot];
+        if(child) {
+          prefix = child;
+          continue;
+        }
+
+        if(lossy) {
+          const uint8_t* neighbors = encoder->neighbors[pixel];
+          for(int k = 0; k < encoder->neighborCounts[pixel]; ++k) {
+            child = children[(prefix << minCodeSize) | neighbors[k]];
+            if(child) break;
+          }
+          if(child) {
+            prefix = child;
+            continue;
+          }
+        }
+
+        emit(prefix);
+        // the decoder widens one code later than it adds, this keeps us in step with it
+        if(nextCode >= (1u << codeSize) && codeSize < LZW_MAX_BITS) {
+          ++codeSize;
+        }
+        ++codesSinceClear;
+
+        if(nextCode < LZW_MAX_CODE) {
+          children[slot] = nextCode;
+          slots[nextCode] = slot;
+          ++nextCode;
+          windowPosition = (size_t)y * width + x;
+        }
+        else if(!adaptiveClear) {
+          clear((size_t)y * width + x);
+        }
+        else if(++windowCodes >= clearCheckCodes) {
+          // the dictionary is full and frozen, every code is 12 bits so
+          // pixels per code is the compression ratio
+          size_t position = (size_t)y * width + x;
+          float windowRatio = (float)(position - windowPosition) / windowCodes;
+          float averageRatio = (float)(position - clearPosition) / codesSinceClear;
+          windowCodes = 0;
+          windowPosition = position;
+          if(windowRatio < averageRatio * clearRatioKeep) {
+            clear(position);
+          }
+        }
+        prefix = pixel;
+      }
+    }
+
+    emit(prefix);
+    if(nextCode >= (1u << codeSize) && codeSize < LZW_MAX_BITS) {
+      ++codeSize;
+    }
+  }
+
+  emit(eoiCode);
+  while(bitCount > 0) {
+    *out++ = (uint8_t)bitBuffer;
+    bitBuffer >>= 8;
+    bitCount -= 8;
+  }
+
+  for(uint32_t code = eoiCode + 1; code < nextCode; ++code) {
+    children[slots[code]] = 0;
+  }
+
+  return out - encoder->packed.data();
+}
+
+// frames packed[0, length) as gif data sub blocks into encoder->blocks:
+// a length byte followed by up to 255 bytes, repeated. blocks only ever
+// grows, blockLength is how much of it this image used.
+void LzwFrameSubBlocks(LzwEncoder* encoder, size_t length) {
+  if(encoder->blocks.size() < length + length / GIF_SUB_BLOCK_SIZE + 1) {
+    encoder->blocks.resize(length + length / GIF_SUB_BLOCK_SIZE + 1);
+  }
+  const uint8_t* in = encoder->packed.data();
+  uint8_t* out = encoder->blocks.data();
+  while(length > 0) {
+    size_t n = length < GIF_SUB_BLOCK_SIZE ? length : GIF_SUB_BLOCK_SIZE;
+    *out++ = (uint8_t)n;
+    memcpy(out, in, n);
+    out += n;
+    in += n;
+    length -= n;
+  }
+  encoder->blockLength = out - encoder->blocks.data();
+}
+
+// writes the image data for the descriptor just put with EGifPutImageDesc,
+// which has to be flagged interlaced when the encoder's options are.
+// giflib has already written the code size byte at that point; its own
+// compressor is bypassed by handing it finished sub blocks.
+int WriteImageData(GifFileType* gifFile, LzwEncoder* encoder, const uint8_t* pixels, int width, int height, int stride, int minCodeSize) {
+  size_t length = LzwEncode(encoder, pixels, width, height, stride, minCodeSize);
+  LzwFrameSubBlocks(encoder, length);
+
+  const uint8_t* block = encoder->blocks.data();
+  const uint8_t* end = block + encoder->blockLength;
+  while(block < end) {
+    if(EGifPutCodeNext(gifFile, block) == GIF_ERROR) {
+      return GIF_ERROR;
+    }
+    block += block[0] + 1;
+  }
+  return EGifPutCodeNext(gifFile, nullptr);
+}
+
+#endif
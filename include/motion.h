@@ -0,0 +1,88 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "changemap.h"
+
+extern "C" {
+  #include <libavcodec/avcodec.h>
+  #include <libavutil/frame.h>
+  #include <libavutil/motion_vector.h>
+}
+
+// asks the decoder to attach AV_FRAME_DATA_MOTION_VECTORS to every frame;
+// call before avcodec_open2
+void EnableMotionVectorExport(AVCodecContext* codecContext) {
+  codecContext->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+}
+
+// folds one decoded frame's motion vectors into map->motionHint. A block
+// predicted from the past with a zero vector is taken as unchanged; intra
+// blocks have no vector and stay marked, and a frame without side data (a
+// keyframe, or a decoder that does not export) marks every tile. Call it for
+// every decoded frame, not only the analyzed ones, since the hint has to
+// cover everything between two analyses.
+void AccumulateMotionHint(ChangeMap* map, const AVFrame* frame) {
+  map->hasMotionHint = true;
+
+  const AVFrameSideData* sideData = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+  if(!sideData) {
+    for(size_t w = 0; w < map->dirtyWords; ++w) {
+      map->motionHint[w] = ~0ull;
+    }
+    return;
+  }
+
+  uint8_t* staticCells = map->staticCells;
+  memset(staticCells, 0, map->quarterCount);
+
+  const AVMotionVector* vectors = (const AVMotionVector*)sideData->data;
+  size_t count = sideData->size / sizeof(AVMotionVector);
+  for(size_t i = 0; i < count; ++i) {
+    const AVMotionVector& mv = vectors[i];
+    if(mv.source >= 0 || mv.motion_x != 0 || mv.motion_y != 0) {
+      continue;
+    }
+    // dst is the block center, partitions are at least 4x4 and 4 aligned
+    int qx0 = (mv.dst_x - mv.w / 2) / 4;
+    int qy0 = (mv.dst_y - mv.h / 2) / 4;
+    int qx1 = qx0 + mv.w / 4;
+    int qy1 = qy0 + mv.h / 4;
+    if(qx0 < 0) qx0 = 0;
+    if(qy0 < 0) qy0 = 0;
+    if(qx1 > map->quarterWidth) qx1 = map->quarterWidth;
+    if(qy1 > map->quarterHeight) qy1 = map->quarterHeight;
+    for(int qy = qy0; qy < qy1; ++qy) {
+      memset(staticCells + (size_t)qy * map->quarterWidth + qx0, 1, qx1 > qx0 ? qx1 - qx0 : 0);
+    }
+  }
+
+  int cellsPerTile = map->tileSize / 4;
+  for(int ty = 0; ty < map->tilesY; ++ty) {
+    uint64_t* row = map->motionHint + (size_t)ty * map->wordsPerRow;
+    int qy0 = ty * cellsPerTile;
+    int qy1 = qy0 + cellsPerTile < map->quarterHeight ? qy0 + cellsPerTile : map->quarterHeight;
+    for(int tx = 0; tx < map->tilesX; ++tx) {
+      if((row[tx >> 6] >> (tx & 63)) & 1) continue;
+      int qx0 = tx * cellsPerTile;
+      int qx1 = qx0 + cellsPerTile < map->quarterWidth ? qx0 + cellsPerTile : map->quarterWidth;
+      bool moved = false;
+      for(int qy = qy0; qy < qy1 && !moved; ++qy) {
+        const uint8_t* cells = staticCells + (size_t)qy * map->quarterWidth;
+        for(int qx = qx0; qx < qx1; ++qx) {
+          if(!cells[qx]) {
+            moved = true;
+            break;
+          }
+        }
+      }
+      if(moved) {
+        row[tx >> 6] |= 1ull << (tx & 63);
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef NEAREST_H
+#define NEAREST_H
+
+#include <cstdint>
+#include <algorithm>
+
+#include "arena.h"
+
+extern "C" {
+  #include <gif_lib.h>
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NEAREST_X86 1
+#endif
+
+// palette entries per k-d tree leaf, two vector steps of the AVX2 kernel
+#define NEAREST_LEAF_SIZE 16
+// a split of more than NEAREST_LEAF_SIZE entries leaves at least 8 on each
+// side, so 256 entries make at most 32 leaves
+#define NEAREST_MAX_NODES 128
+// slots past the last entry, so a kernel may always read whole vectors
+#define NEAREST_PAD 8
+// the color of a padding slot, far from every color yet small enough that
+// its squared distance fits an int
+#define NEAREST_FAR 0x3fff
+
+struct NearestNode {
+  // 0..2 splits on that channel at split, 3 is a leaf
+  uint8_t axis;
+  uint8_t split;
+  // children of a split; first slot and entry count of a leaf
+  uint16_t left;
+  uint16_t right;
+};
+
+// exact nearest palette entry search: a k-d tree over the palette whose
+// leaves hold a few entries each, stored channel by channel so a leaf is
+// compared in one or two vector steps. The channels sit in 32 bit lanes with
+// a zero top half, which lets the SSE2 kernel square them with madd.
+struct PaletteSearch {
+  int32_t channel[3][256 + NEAREST_PAD];
+  uint8_t index[256 + NEAREST_PAD];
+  NearestNode nodes[NEAREST_MAX_NODES];
+  int nodeCount;
+  int count;
+};
+
+// the closest of the count slots from begin to (r, g, b), if closer than
+// *bestDistance; kernels may compare slots past the range too, which are
+// real entries or padding, so the answer stays exact
+typedef void (*NearestSlotsFunc)(const PaletteSearch* search, int begin, int count, int r, int g, int b, int* bestDistance, int* bestSlot);
+
+static void NearestSlotsScalar(const PaletteSearch* search, int begin, int count, int r, int g, int b, int* bestDistance, int* bestSlot) {
+  for(int i = begin; i < begin + count; ++i) {
+    int dr = search->channel[0][i] - r;
+    int dg = search->channel[1][i] - g;
+    int db = search->channel[2][i] - b;
+    int distance = dr * dr + dg * dg + db * db;
+    if(distance < *bestDistance) {
+      *bestDistance = distance;
+      *bestSlot = i;
+    }
+  }
+}
+
+#ifdef NEAREST_X86
+// lane by lane minimum, then the lowest slot among the lanes that hold it
+static inline void ReduceNearestLanes(const int32_t* distances, const int32_t* slots, int lanes, int* bestDistance, int* bestSlot) {
+  for(int i = 0; i < lanes; ++i) {
+    if(distances[i] < *bestDistance || (distances[i] == *bestDistance && slots[i] < *bestSlot)) {
+      *bestDistance = distances[i];
+      *bestSlot = slots[i];
+    }
+  }
+}
+
+static void NearestSlotsSse2(const PaletteSearch* search, int begin, int count, int r, int g, int b, int* bestDistance, int* bestSlot) {
+  const __m128i qr = _mm_set1_epi32(r);
+  const __m128i qg = _mm_set1_epi32(g);
+  const __m128i qb = _mm_set1_epi32(b);
+  __m128i best = _mm_set1_epi32(*bestDistance);
+  __m128i bestSlots = _mm_set1_epi32(*bestSlot);
+  __m128i slots = _mm_setr_epi32(begin, begin + 1, begin + 2, begin + 3);
+  for(int i = begin; i < begin + count; i += 4) {
+    __m128i dr = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(search->channel[0] + i)), qr);
+    __m128i dg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(search->channel[1] + i)), qg);
+    __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(search->channel[2] + i)), qb);
+    __m128i distance = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(dr, dr), _mm_madd_epi16(dg, dg)), _mm_madd_epi16(db, db));
+    __m128i closer = _mm_cmplt_epi32(distance, best);
+    best = _mm_or_si128(_mm_and_si128(closer, distance), _mm_andnot_si128(closer, best));
+    bestSlots = _mm_or_si128(_mm_and_si128(closer, slots), _mm_andnot_si128(closer, bestSlots));
+    slots = _mm_add_epi32(slots, _mm_set1_epi32(4));
+  }
+  int32_t distances[4];
+  int32_t laneSlots[4];
+  _mm_storeu_si128((__m128i*)distances, best);
+  _mm_storeu_si128((__m128i*)laneSlots, bestSlots);
+  ReduceNearestLanes(distances, laneSlots, 4, bestDistance, bestSlot);
+}
+
+__attribute__((target("avx2")))
+static void NearestSlotsAvx2(const PaletteSearch* search, int begin, int count, int r, int g, int b, int* bestDistance, int* bestSlot) {
+  const __m256i qr = _mm256_set1_epi32(r);
+  const __m256i qg = _mm256_set1_epi32(g);
+  const __m256i qb = _mm256_set1_epi32(b);
+  __m256i best = _mm256_set1_epi32(*bestDistance);
+  __m256i bestSlots = _mm256_set1_epi32(*bestSlot);
+  __m256i slots = _mm256_add_epi32(_mm256_set1_epi32(begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  for(int i = begin; i < begin + count; i += 8) {
+    __m256i dr = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(search->channel[0] + i)), qr);
+    __m256i dg = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(search->channel[1] + i)), qg);
+    __m256i db = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(search->channel[2] + i)), qb);
+    __m256i distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)), _mm256_mullo_epi32(db, db));
+    __m256i closer = _mm256_cmpgt_epi32(best, distance);
+    best = _mm256_min_epi32(best, distance);
+    bestSlots = _mm256_blendv_epi8(bestSlots, slots, closer);
+    slots = _mm256_add_epi32(slots, _mm256_set1_epi32(8));
+  }
+  alignas(32) int32_t distances[8];
+  alignas(32) int32_t laneSlots[8];
+  _mm256_store_si256((__m256i*)distances, best);
+  _mm256_store_si256((__m256i*)laneSlots, bestSlots);
+  ReduceNearestLanes(distances, laneSlots, 8, bestDistance, bestSlot);
+}
+#endif
+
+// picked once per process: AVX2 when the cpu has it, SSE2 on any other
+// x86-64, plain C elsewhere
+static NearestSlotsFunc GetNearestSlotsKernel() {
+  static const NearestSlotsFunc kernel = [] {
+    NearestSlotsFunc k = NearestSlotsScalar;
+#ifdef NEAREST_X86
+    k = NearestSlotsSse2;
+    if(__builtin_cpu_supports("avx2")) {
+      k = NearestSlotsAvx2;
+    }
+#endif
+    return k;
+  }();
+  return kernel;
+}
+
+struct NearestEntry {
+  uint8_t channel[3];
+  uint8_t index;
+};
+
+// splits entries [begin, end) at the median of their widest channel until
+// a part fits a leaf; the entries end up sorted into leaf order
+static int BuildNearestNode(PaletteSearch* search, NearestEntry* entries, int begin, int end) {
+  int node = search->nodeCount++;
+  if(end - begin <= NEAREST_LEAF_SIZE) {
+    search->nodes[node] = {3, 0, (uint16_t)begin, (uint16_t)(end - begin)};
+    return node;
+  }
+  int lo[3] = {255, 255, 255};
+  int hi[3] = {0, 0, 0};
+  for(int i = begin; i < end; ++i) {
+    for(int c = 0; c < 3; ++c) {
+      lo[c] = std::min<int>(lo[c], entries[i].channel[c]);
+      hi[c] = std::max<int>(hi[c], entries[i].channel[c]);
+    }
+  }
+  int axis = 0;
+  for(int c = 1; c < 3; ++c) {
+    if(hi[c] - lo[c] > hi[axis] - lo[axis]) axis = c;
+  }
+  std::sort(entries + begin, entries + end, [axis](const NearestEntry& a, const NearestEntry& b) {
+    return a.channel[axis] < b.channel[axis];
+  });
+  int middle = (begin + end) / 2;
+  // everything left of middle is at most the split, everything right at least
+  search->nodes[node].axis = axis;
+  search->nodes[node].split = entries[middle].channel[axis];
+  uint16_t left = BuildNearestNode(search, entries, begin, middle);
+  uint16_t right = BuildNearestNode(search, entries, middle, end);
+  search->nodes[node].left = left;
+  search->nodes[node].right = right;
+  return node;
+}
+
+PaletteSearch* CreatePaletteSearch(const ColorMapObject* colorMap, FrameArena* arena) {
+  PaletteSearch* search = ArenaArray<PaletteSearch>(arena, 1);
+  NearestEntry entries[256];
+  int count = std::min(colorMap->ColorCount, 256);
+  for(int i = 0; i < count; ++i) {
+    entries[i] = {{colorMap->Colors[i].Red, colorMap->Colors[i].Green, colorMap->Colors[i].Blue}, (uint8_t)i};
+  }
+  search->count = count;
+  search->nodeCount = 0;
+  BuildNearestNode(search, entries, 0, count);
+  for(int i = 0; i < 256 + NEAREST_PAD; ++i) {
+    for(int c = 0; c < 3; ++c) {
+      search->channel[c][i] = i < count ? entries[i].channel[c] : NEAREST_FAR;
+    }
+    search->index[i] = i < count ? entries[i].index : 0;
+  }
+  return search;
+}
+
+// the palette index closest to (r, g, b): walks the tree to the query's
+// leaf, then backs out into the other side of a split only while the
+// split plane is nearer than the best entry found so far
+uint8_t NearestPaletteEntry(const PaletteSearch* search, int r, int g, int b) {
+  NearestSlotsFunc kernel = GetNearestSlotsKernel();
+  const int query[3] = {r, g, b};
+  int bestDistance = INT32_MAX;
+  int bestSlot = 0;
+  // a pending node and how far its side of the split is from the query
+  int stack[NEAREST_MAX_NODES];
+  int stackPlane[NEAREST_MAX_NODES];
+  int depth = 0;
+  stack[depth] = 0;
+  stackPlane[depth++] = 0;
+  while(depth > 0) {
+    --depth;
+    if(stackPlane[depth] >= bestDistance) continue;
+    const NearestNode* node = &search->nodes[stack[depth]];
+    while(node->axis != 3) {
+      int delta = query[node->axis] - node->split;
+      int nearChild = delta < 0 ? node->left : node->right;
+      int farChild = delta < 0 ? node->right : node->left;
+      stack[depth] = farChild;
+      stackPlane[depth++] = delta * delta;
+      node = &search->nodes[nearChild];
+    }
+    kernel(search, node->left, node->right, r, g, b, &bestDistance, &bestSlot);
+  }
+  return search->index[bestSlot];
+}
+
+// the same answer by comparing every entry with the given kernel; the
+// bench measures the tree against it
+uint8_t NearestPaletteEntryLinear(const PaletteSearch* search, NearestSlotsFunc kernel, int r, int g, int b) {
+  int bestDistance = INT32_MAX;
+  int bestSlot = 0;
+  kernel(search, 0, search->count, r, g, b, &bestDistance, &bestSlot);
+  return search->index[bestSlot];
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+  #include <gif_lib.h>
+}
+
+enum OutputFormat {
+  OUTPUT_GIF,
+  OUTPUT_APNG,
+  OUTPUT_WEBP
+};
+
+static const char* const OUTPUT_FORMAT_NAMES[] = {"gif", "apng", "webp"};
+static const char* const OUTPUT_FORMAT_EXTENSIONS[] = {"gif", "png", "webp"};
+
+// "gif", "apng" or "webp", false for anything else
+bool ParseOutputFormat(const char* name, OutputFormat* format) {
+  for(int i = 0; i <= OUTPUT_WEBP; ++i) {
+    if(strcmp(name, OUTPUT_FORMAT_NAMES[i]) == 0) {
+      *format = (OutputFormat)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// a changed rectangle of the frame, as indices into the global palette
+struct OutputRegion {
+  int left;
+  int top;
+  int width;
+  int height;
+  const uint8_t* pixels;
+  int stride;
+};
+
+// what the frame pipeline hands its output to. Per file: begin once with
+// the global palette, then for every emitted frame beginFrame followed by
+// one writeRegion per changed rectangle, and close at the end (also after
+// a failure), which frees state. time is the frame's presentation time in
+// seconds from the start of the range, frameNumber its index in decode
+// order for stats and traces.
+struct OutputBackend {
+  void* state;
+  int (*begin)(void* state, const ColorMapObject* globalMap);
+  int (*beginFrame)(void* state, double time, bool cut, int64_t frameNumber);
+  int (*writeRegion)(void* state, const OutputRegion& region);
+  int (*close)(void* state);
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "arena.h"
+
+extern "C" {
+  #include <gif_lib.h>
+}
+
+// frames using up to 2^7 colors get a local table of the smallest power of two
+// that fits, anything above that keeps the 8 bit global table
+#define MAX_COMPACT_PALETTE_BITS 7
+
+#define COMPACT_PALETTE_UNUSED 0xff
+
+// maps[k] is a reusable 2^k entry local color map, current the one picked at
+// the last rebuild (nullptr when that frame had too many colors), remap[] takes
+// a global index to its slot in current and indices holds the remapped frame
+struct CompactPalette {
+  ColorMapObject* maps[MAX_COMPACT_PALETTE_BITS + 1];
+  ColorMapObject* current;
+  uint8_t remap[256];
+  uint8_t* indices;
+};
+
+CompactPalette* CreateCompactPalette(int width, int height, FrameArena* arena) {
+  CompactPalette* palette = new CompactPalette();
+  palette->maps[0] = nullptr;
+  for(int bits = 1; bits <= MAX_COMPACT_PALETTE_BITS; ++bits) {
+    palette->maps[bits] = GifMakeMapObject(1 << bits, nullptr);
+  }
+  palette->current = nullptr;
+  palette->indices = ArenaArray<uint8_t>(arena, (size_t)width * height);
+  return palette;
+}
+
+void FreeCompactPalette(CompactPalette* palette) {
+  for(int bits = 1; bits <= MAX_COMPACT_PALETTE_BITS; ++bits) {
+    GifFreeMapObject(palette->maps[bits]);
+  }
+  delete palette;
+}
+
+// remaps the frame against the current local map, false as soon as it hits a
+// color the map does not have
+static bool RemapFramePalette(CompactPalette* palette, const uint8_t* pixels, int width, int height, int stride) {
+  uint8_t* out = palette->indices;
+  for(int y = 0; y < height; ++y) {
+    const uint8_t* row = pixels + (size_t)y * stride;
+    uint8_t missing = 0;
+    for(int x = 0; x < width; ++x) {
+      out[x] = palette->remap[row[x]];
+      missing |= (out[x] == COMPACT_PALETTE_UNUSED);
+    }
+    if(missing) {
+      return false;
+    }
+    out += width;
+  }
+  return true;
+}
+
+// picks the local map for a frame. With rebuild set (a scene cut) the colors
+// are counted from scratch; otherwise the previous choice is kept as long as
+// the frame's colors fit it, so within a scene that needed the full table no
+// counting happens at all. When a local map is returned the frame has been
+// rewritten into palette->indices (stride width) against it; nullptr means the
+// frame should go out as is against the global map.
+ColorMapObject* CompactFramePalette(CompactPalette* palette, const ColorMapObject* colorMap, const uint8_t* pixels, int width, int height, int stride, bool rebuild) {
+  if(!rebuild) {
+    if(!palette->current) {
+      return nullptr;
+    }
+    if(RemapFramePalette(palette, pixels, width, height, stride)) {
+      return palette->current;
+    }
+  }
+
+  const int maxColors = 1 << MAX_COMPACT_PALETTE_BITS;
+  uint8_t seen[256] = {};
+  int distinct = 0;
+  palette->current = nullptr;
+
+  for(int y = 0; y < height; ++y) {
+    const uint8_t* row = pixels + (size_t)y * stride;
+    for(int x = 0; x < width; ++x) {
+      distinct += !seen[row[x]];
+      seen[row[x]] = 1;
+    }
+    // most camera footage gets here within a few rows
+    if(distinct > maxColors) {
+      return nullptr;
+    }
+  }
+
+  int bits = 1;
+  while((1 << bits) < distinct) {
+    ++bits;
+  }
+
+  // keep the global order so neighbouring values stay neighbours
+  ColorMapObject* localMap = palette->maps[bits];
+  memset(localMap->Colors, 0, sizeof(GifColorType) * localMap->ColorCount);
+  memset(palette->remap, COMPACT_PALETTE_UNUSED, sizeof(palette->remap));
+  int next = 0;
+  for(int i = 0; i < 256; ++i) {
+    if(!seen[i]) continue;
+    palette->remap[i] = next;
+    if(i < colorMap->ColorCount) {
+      localMap->Colors[next] = colorMap->Colors[i];
+    }
+    ++next;
+  }
+
+  palette->current = localMap;
+  RemapFramePalette(palette, pixels, width, height, stride);
+  return localMap;
+}
+
+#endif
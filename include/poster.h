@@ -0,0 +1,213 @@
+#ifndef POSTER_H
+#define POSTER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+
+#include "arena.h"
+#include "budget.h"
+#include "quantize.h"
+
+extern "C" {
+  #include <libavutil/frame.h>
+
+  #include "stb_image_write.h"
+}
+
+// width of one contact sheet tile, the height follows the aspect ratio
+#define POSTER_TILE_WIDTH 320
+#define POSTER_JPEG_QUALITY 90
+#define POSTER_MAX_GRID 16
+
+// "<columns>x<rows>", each 1 to POSTER_MAX_GRID
+bool ParsePosterGrid(const char* value, int* columns, int* rows) {
+  int c = 0;
+  int r = 0;
+  char tail = 0;
+  if(sscanf(value, "%dx%d%c", &c, &r, &tail) != 2 || c < 1 || r < 1 || c > POSTER_MAX_GRID || r > POSTER_MAX_GRID) {
+    return false;
+  }
+  *columns = c;
+  *rows = r;
+  return true;
+}
+
+// how much a frame is worth as a still: the variance of a 4 neighbour
+// laplacian over its luma, taken on every other pixel of every other row.
+// Motion blur, defocus and fades leave little second derivative, so the
+// sharpest, most detailed frame scores highest.
+double SharpnessScore(const uint8_t* luma, int stride, int width, int height) {
+  int64_t sum = 0;
+  int64_t sumSquares = 0;
+  int64_t samples = 0;
+  for(int y = 1; y < height - 1; y += 2) {
+    const uint8_t* row = luma + (size_t)y * stride;
+    const uint8_t* up = row - stride;
+    const uint8_t* down = row + stride;
+    int64_t rowSum = 0;
+    int64_t rowSquares = 0;
+    for(int x = 1; x < width - 1; x += 2) {
+      int laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+      rowSum += laplacian;
+      rowSquares += laplacian * laplacian;
+    }
+    sum += rowSum;
+    sumSquares += rowSquares;
+    samples += (width - 1) / 2;
+  }
+  if(samples == 0) {
+    return 0;
+  }
+  double mean = (double)sum / samples;
+  return (double)sumSquares / samples - mean * mean;
+}
+
+// a poster (one tile at the frame's size) or a contact sheet written from
+// the frames the conversion analyzes anyway, so it costs no second decode.
+// The range is cut into columns x rows slices of equal time and every tile
+// shows the sharpest frame of its slice. Only the best frame of the open
+// slice is held, as a reference to the decoded picture, and it is drawn
+// into the canvas when the next slice starts.
+struct PosterSheet {
+  const char* path;
+  int columns;
+  int rows;
+  int tileWidth;
+  int tileHeight;
+  double rangeSeconds;
+  uint8_t* canvas;
+  int slot;
+  double bestScore;
+  AVFrame* best;
+  bool hasBest;
+};
+
+// a poster asks for a 1x1 grid with tileWidth set to the frame width;
+// rangeSeconds is the length of the converted range, only needed for a grid
+PosterSheet* CreatePosterSheet(const char* path, int columns, int rows, int tileWidth, int frameWidth, int frameHeight,
+                               double rangeSeconds, FrameArena* arena) {
+  PosterSheet* sheet = new PosterSheet();
+  sheet->path = path;
+  sheet->columns = columns;
+  sheet->rows = rows;
+  sheet->tileWidth = tileWidth;
+  sheet->tileHeight = (int)((int64_t)frameHeight * tileWidth / frameWidth);
+  if(sheet->tileHeight < 1) sheet->tileHeight = 1;
+  sheet->rangeSeconds = rangeSeconds;
+  sheet->canvas = ArenaArray<uint8_t>(arena, (size_t)3 * columns * tileWidth * rows * sheet->tileHeight);
+  sheet->slot = 0;
+  sheet->bestScore = 0;
+  sheet->best = av_frame_alloc();
+  sheet->hasBest = false;
+  return sheet;
+}
+
+// the canvas and the held frame, on top of what the conversion needs
+uint64_t EstimatePosterBytes(int columns, int rows, int tileWidth, int frameWidth, int frameHeight) {
+  uint64_t tileHeight = (uint64_t)frameHeight * tileWidth / frameWidth;
+  return 3ull * columns * tileWidth * rows * tileHeight + DecodedFrameBytes(frameWidth, frameHeight);
+}
+
+// box filters frame down to one tile and converts it to RGB in place on the
+// canvas; layouts other than 8 bit 4:2:0 are drawn from luma alone, in gray
+static void DrawPosterTile(PosterSheet* sheet, const AVFrame* frame, int slot) {
+  YuvToRgb m = YuvToRgbFor(frame);
+  bool color = IsQuantizableFrame(frame);
+  // NV12 keeps U and V side by side in one plane
+  int chromaStep = frame->format == AV_PIX_FMT_NV12 ? 2 : 1;
+  int vPlane = chromaStep == 2 ? 1 : 2;
+  int vOffset = chromaStep == 2 ? 1 : 0;
+  int canvasStride = 3 * sheet->columns * sheet->tileWidth;
+  uint8_t* tile = sheet->canvas + (size_t)(slot / sheet->columns) * sheet->tileHeight * canvasStride
+                                + (size_t)(slot % sheet->columns) * sheet->tileWidth * 3;
+  for(int ty = 0; ty < sheet->tileHeight; ++ty) {
+    int y0 = (int)((int64_t)ty * frame->height / sheet->tileHeight);
+    int y1 = std::max(y0 + 1, (int)((int64_t)(ty + 1) * frame->height / sheet->tileHeight));
+    uint8_t* out = tile + (size_t)ty * canvasStride;
+    for(int tx = 0; tx < sheet->tileWidth; ++tx) {
+      int x0 = (int)((int64_t)tx * frame->width / sheet->tileWidth);
+      int x1 = std::max(x0 + 1, (int)((int64_t)(tx + 1) * frame->width / sheet->tileWidth));
+      uint32_t luma = 0;
+      for(int y = y0; y < y1; ++y) {
+        const uint8_t* row = frame->data[0] + (size_t)y * frame->linesize[0];
+        for(int x = x0; x < x1; ++x) luma += row[x];
+      }
+      int count = (y1 - y0) * (x1 - x0);
+      int u = 128;
+      int v = 128;
+      if(color) {
+        uint32_t uSum = 0;
+        uint32_t vSum = 0;
+        int cx1 = (x1 + 1) / 2;
+        int cy1 = (y1 + 1) / 2;
+        for(int cy = y0 / 2; cy < cy1; ++cy) {
+          const uint8_t* uRow = frame->data[1] + (size_t)cy * frame->linesize[1];
+          const uint8_t* vRow = frame->data[vPlane] + (size_t)cy * frame->linesize[vPlane] + vOffset;
+          for(int cx = x0 / 2; cx < cx1; ++cx) {
+            uSum += uRow[cx * chromaStep];
+            vSum += vRow[cx * chromaStep];
+          }
+        }
+        int chromaCount = (cy1 - y0 / 2) * (cx1 - x0 / 2);
+        u = (uSum + chromaCount / 2) / chromaCount;
+        v = (vSum + chromaCount / 2) / chromaCount;
+      }
+      ConvertYuvPixel(m, (luma + count / 2) / count, u, v, out, out + 1, out + 2);
+      out += 3;
+    }
+  }
+}
+
+static void FlushPosterSlot(PosterSheet* sheet) {
+  if(!sheet->hasBest) {
+    return;
+  }
+  DrawPosterTile(sheet, sheet->best, sheet->slot);
+  av_frame_unref(sheet->best);
+  sheet->hasBest = false;
+}
+
+// offers an analyzed frame shown at seconds into the range with its
+// SharpnessScore; frames come in presentation order
+void OfferPosterFrame(PosterSheet* sheet, const AVFrame* frame, double seconds, double score) {
+  int slots = sheet->columns * sheet->rows;
+  int slot = slots > 1 && sheet->rangeSeconds > 0 ? (int)(seconds * slots / sheet->rangeSeconds) : 0;
+  slot = std::min(std::max(slot, sheet->slot), slots - 1);
+  if(slot != sheet->slot) {
+    FlushPosterSlot(sheet);
+    sheet->slot = slot;
+  }
+  if(sheet->hasBest && score <= sheet->bestScore) {
+    return;
+  }
+  av_frame_unref(sheet->best);
+  sheet->hasBest = av_frame_ref(sheet->best, frame) == 0;
+  sheet->bestScore = score;
+}
+
+// draws the last slice and writes the image, jpeg when the path ends in
+// .jpg or .jpeg and png otherwise; with write false it only frees the sheet
+int ClosePosterSheet(PosterSheet* sheet, bool write) {
+  int ret = 0;
+  if(write) {
+    FlushPosterSlot(sheet);
+    int width = sheet->columns * sheet->tileWidth;
+    int height = sheet->rows * sheet->tileHeight;
+    const char* dot = strrchr(sheet->path, '.');
+    bool jpeg = dot && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+    int written = jpeg ? stbi_write_jpg(sheet->path, width, height, 3, sheet->canvas, POSTER_JPEG_QUALITY)
+                       : stbi_write_png(sheet->path, width, height, 3, sheet->canvas, 3 * width);
+    if(!written) {
+      fprintf(stderr, "Cannot write %s\n", sheet->path);
+      ret = 1;
+    }
+  }
+  av_frame_free(&sheet->best);
+  delete sheet;
+  return ret;
+}
+
+#endif
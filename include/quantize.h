@@ -0,0 +1,365 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "arena.h"
+#include "yuv.h"
+#include "nearest.h"
+
+extern "C" {
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+
+  #include <gif_lib.h>
+}
+
+// colors are counted and looked up at 5 bits per channel
+#define QUANTIZE_BITS 5
+#define QUANTIZE_CELLS (1 << (3 * QUANTIZE_BITS))
+// the palette lookup's grid, 5 or 6 bits per channel
+#define PALETTE_LOOKUP_BITS 5
+#define PALETTE_LOOKUP_MAX_BITS 6
+#define PALETTE_LOOKUP_UNSET 0xffff
+// past this RGB distance every color is within reach of every entry
+#define PALETTE_HYSTERESIS_MAX 442
+
+// the layouts the color path reads, 8 bit 4:2:0 planar or NV12
+bool IsQuantizableFrame(const AVFrame* frame) {
+  return frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_NV12;
+}
+
+static inline uint32_t QuantizeCell(uint8_t r, uint8_t g, uint8_t b) {
+  const int shift = 8 - QUANTIZE_BITS;
+  return ((uint32_t)(r >> shift) << (2 * QUANTIZE_BITS)) | ((uint32_t)(g >> shift) << QUANTIZE_BITS) | (b >> shift);
+}
+
+// what the analysis pass keeps of a clip: how often every 5:5:5 color was
+// seen, whatever the clip's length, and the rows a frame is converted through
+struct ColorHistogram {
+  uint32_t* cells;
+  uint64_t samples;
+  uint8_t* luma;
+  uint8_t* u;
+  uint8_t* v;
+  uint8_t* rgb;
+};
+
+// width is the frame width; the scratch rows are half of it
+ColorHistogram* CreateColorHistogram(int width, FrameArena* arena) {
+  int chromaWidth = width / 2;
+  ColorHistogram* histogram = new ColorHistogram();
+  histogram->cells = ArenaArray<uint32_t>(arena, QUANTIZE_CELLS);
+  histogram->samples = 0;
+  histogram->luma = ArenaArray<uint8_t>(arena, chromaWidth);
+  histogram->u = ArenaArray<uint8_t>(arena, chromaWidth);
+  histogram->v = ArenaArray<uint8_t>(arena, chromaWidth);
+  histogram->rgb = ArenaArray<uint8_t>(arena, (size_t)3 * chromaWidth);
+  return histogram;
+}
+
+void FreeColorHistogram(ColorHistogram* histogram) {
+  delete histogram;
+}
+
+// one sample per chroma sample: the mean of its 2x2 luma block with its U
+// and V, a half resolution thumbnail counted straight into the histogram.
+// Each row pair is halved and converted as a whole by the row kernels.
+void AccumulateColorHistogram(ColorHistogram* histogram, const AVFrame* frame) {
+  const YuvKernels& kernels = GetYuvKernels();
+  YuvToRgb m = YuvToRgbFor(frame);
+  int chromaWidth = frame->width / 2;
+  int chromaHeight = frame->height / 2;
+  bool nv12 = frame->format == AV_PIX_FMT_NV12;
+  uint32_t* cells = histogram->cells;
+  const uint8_t* rgb = histogram->rgb;
+  for(int cy = 0; cy < chromaHeight; ++cy) {
+    const uint8_t* y0 = frame->data[0] + (size_t)(2 * cy) * frame->linesize[0];
+    kernels.halveRows(y0, y0 + frame->linesize[0], chromaWidth, histogram->luma);
+    const uint8_t* u = frame->data[1] + (size_t)cy * frame->linesize[1];
+    const uint8_t* v = nv12 ? nullptr : frame->data[2] + (size_t)cy * frame->linesize[2];
+    if(nv12) {
+      for(int cx = 0; cx < chromaWidth; ++cx) {
+        histogram->u[cx] = u[2 * cx];
+        histogram->v[cx] = u[2 * cx + 1];
+      }
+      u = histogram->u;
+      v = histogram->v;
+    }
+    kernels.yuv444(m, histogram->luma, u, v, chromaWidth, histogram->rgb);
+    for(int cx = 0; cx < chromaWidth; ++cx) {
+      ++cells[QuantizeCell(rgb[3 * cx], rgb[3 * cx + 1], rgb[3 * cx + 2])];
+    }
+  }
+  histogram->samples += (uint64_t)chromaWidth * chromaHeight;
+}
+
+struct HistogramColor {
+  uint8_t channel[3];
+  uint32_t count;
+};
+
+struct MedianCutBox {
+  int begin;
+  int end;
+  uint64_t count;
+  int axis;
+  int range;
+};
+
+static void MeasureBox(const HistogramColor* colors, MedianCutBox* box) {
+  int lo[3] = {255, 255, 255};
+  int hi[3] = {0, 0, 0};
+  box->count = 0;
+  for(int i = box->begin; i < box->end; ++i) {
+    for(int c = 0; c < 3; ++c) {
+      lo[c] = std::min<int>(lo[c], colors[i].channel[c]);
+      hi[c] = std::max<int>(hi[c], colors[i].channel[c]);
+    }
+    box->count += colors[i].count;
+  }
+  box->axis = 0;
+  for(int c = 1; c < 3; ++c) {
+    if(hi[c] - lo[c] > hi[box->axis] - lo[box->axis]) box->axis = c;
+  }
+  box->range = hi[box->axis] - lo[box->axis];
+}
+
+// median cut over the histogram's occupied cells: keep splitting the box
+// with the most pixels times extent at the weighted median of its longest
+// axis, then take every box's weighted mean. The result is sorted by luma
+// so neighbouring indices stay close in color, which the compact palette
+// relies on. Unused entries are black.
+void BuildGlobalPalette(const ColorHistogram* histogram, ColorMapObject* colorMap, FrameArena* scratch) {
+  const int shift = 8 - QUANTIZE_BITS;
+  const int half = 1 << (shift - 1);
+  HistogramColor* colors = ArenaArray<HistogramColor>(scratch, QUANTIZE_CELLS);
+  int colorCount = 0;
+  for(uint32_t cell = 0; cell < QUANTIZE_CELLS; ++cell) {
+    if(!histogram->cells[cell]) continue;
+    HistogramColor& color = colors[colorCount++];
+    color.channel[0] = ((cell >> (2 * QUANTIZE_BITS)) << shift) | half;
+    color.channel[1] = (((cell >> QUANTIZE_BITS) & ((1 << QUANTIZE_BITS) - 1)) << shift) | half;
+    color.channel[2] = ((cell & ((1 << QUANTIZE_BITS) - 1)) << shift) | half;
+    color.count = histogram->cells[cell];
+  }
+
+  int maxBoxes = colorMap->ColorCount;
+  MedianCutBox boxes[256];
+  int boxCount = 0;
+  if(colorCount > 0) {
+    boxes[0] = {0, colorCount, 0, 0, 0};
+    MeasureBox(colors, &boxes[0]);
+    boxCount = 1;
+  }
+  while(boxCount < maxBoxes) {
+    int pick = -1;
+    uint64_t best = 0;
+    for(int i = 0; i < boxCount; ++i) {
+      uint64_t score = boxes[i].count * (uint64_t)boxes[i].range;
+      if(boxes[i].end - boxes[i].begin > 1 && score > best) {
+        best = score;
+        pick = i;
+      }
+    }
+    if(pick < 0) break;
+
+    MedianCutBox& box = boxes[pick];
+    int axis = box.axis;
+    std::sort(colors + box.begin, colors + box.end, [axis](const HistogramColor& a, const HistogramColor& b) {
+      return a.channel[axis] < b.channel[axis];
+    });
+    uint64_t seen = 0;
+    int split = box.begin + 1;
+    for(int i = box.begin; i < box.end - 1; ++i) {
+      seen += colors[i].count;
+      split = i + 1;
+      if(seen * 2 >= box.count) break;
+    }
+    boxes[boxCount] = {split, box.end, 0, 0, 0};
+    box.end = split;
+    MeasureBox(colors, &box);
+    MeasureBox(colors, &boxes[boxCount]);
+    ++boxCount;
+  }
+
+  memset(colorMap->Colors, 0, sizeof(GifColorType) * colorMap->ColorCount);
+  for(int i = 0; i < boxCount; ++i) {
+    uint64_t sum[3] = {0, 0, 0};
+    for(int j = boxes[i].begin; j < boxes[i].end; ++j) {
+      for(int c = 0; c < 3; ++c) sum[c] += (uint64_t)colors[j].channel[c] * colors[j].count;
+    }
+    GifColorType& out = colorMap->Colors[i];
+    out.Red = (sum[0] + boxes[i].count / 2) / boxes[i].count;
+    out.Green = (sum[1] + boxes[i].count / 2) / boxes[i].count;
+    out.Blue = (sum[2] + boxes[i].count / 2) / boxes[i].count;
+  }
+  std::sort(colorMap->Colors, colorMap->Colors + boxCount, [](const GifColorType& a, const GifColorType& b) {
+    return 77 * a.Red + 150 * a.Green + 29 * a.Blue < 77 * b.Red + 150 * b.Green + 29 * b.Blue;
+  });
+}
+
+// the inverse color map: the nearest palette entry of every cell of a
+// 2^bits per channel grid, filled in the first time a pixel lands in the
+// cell and kept for every later frame, so mapping a pixel is a table load
+// after a few frames. With bits 0 there is no table and every pixel is
+// searched exactly.
+struct PaletteLookup {
+  int bits;
+  uint16_t* cells;
+  PaletteSearch* search;
+  // one converted row, a pixel longer for regions starting at an odd x
+  uint8_t* rgb;
+  // temporal hysteresis, off while shown is null: the indices on screen, and
+  // the squared distance from its shown entry within which a pixel keeps it
+  uint8_t* shown;
+  int shownWidth;
+  int shownHeight;
+  bool hasShown;
+  int keepDistance;
+  GifColorType colors[256];
+};
+
+// "32" or "64", the grid side of the table, or "exact" for no table
+bool ParseColorLookup(const char* value, int* bits) {
+  if(strcmp(value, "32") == 0) *bits = 5;
+  else if(strcmp(value, "64") == 0) *bits = 6;
+  else if(strcmp(value, "exact") == 0) *bits = 0;
+  else return false;
+  return true;
+}
+
+// the hysteresis distance, a whole number from 0 to PALETTE_HYSTERESIS_MAX
+bool ParseColorHysteresis(const char* value, int* distance) {
+  char* end;
+  long parsed = strtol(value, &end, 10);
+  if(end == value || *end != '\0' || parsed < 0 || parsed > PALETTE_HYSTERESIS_MAX) {
+    return false;
+  }
+  *distance = (int)parsed;
+  return true;
+}
+
+// width is the widest region that will be quantized, the frame width
+PaletteLookup* CreatePaletteLookup(const ColorMapObject* colorMap, int bits, int width, FrameArena* arena) {
+  PaletteLookup* lookup = new PaletteLookup();
+  lookup->bits = bits;
+  lookup->cells = nullptr;
+  if(bits > 0) {
+    size_t cells = (size_t)1 << (3 * bits);
+    lookup->cells = ArenaArray<uint16_t>(arena, cells);
+    memset(lookup->cells, 0xff, cells * sizeof(uint16_t));
+  }
+  lookup->search = CreatePaletteSearch(colorMap, arena);
+  lookup->rgb = ArenaArray<uint8_t>(arena, (size_t)3 * (width + 1));
+  lookup->shown = nullptr;
+  lookup->hasShown = false;
+  int colors = std::min(colorMap->ColorCount, 256);
+  memcpy(lookup->colors, colorMap->Colors, sizeof(GifColorType) * colors);
+  return lookup;
+}
+
+// keeps the index a pixel showed last time while its color is within
+// distance of that entry, so still and noisy areas stop flickering between
+// neighbouring entries and need no lookup; distance 0 leaves it off
+void EnablePaletteHysteresis(PaletteLookup* lookup, int width, int height, int distance, FrameArena* arena) {
+  if(distance <= 0) {
+    return;
+  }
+  lookup->shown = ArenaArray<uint8_t>(arena, (size_t)width * height);
+  lookup->shownWidth = width;
+  lookup->shownHeight = height;
+  lookup->keepDistance = distance * distance;
+}
+
+static inline uint8_t LookupPaletteColor(PaletteLookup* lookup, uint8_t r, uint8_t g, uint8_t b) {
+  int bits = lookup->bits;
+  if(bits == 0) {
+    return NearestPaletteEntry(lookup->search, r, g, b);
+  }
+  int shift = 8 - bits;
+  uint32_t cell = ((uint32_t)(r >> shift) << (2 * bits)) | ((uint32_t)(g >> shift) << bits) | (b >> shift);
+  uint16_t entry = lookup->cells[cell];
+  if(entry == PALETTE_LOOKUP_UNSET) {
+    // the cell's center stands for all of it
+    int half = 1 << (shift - 1);
+    entry = NearestPaletteEntry(lookup->search, (r >> shift << shift) | half, (g >> shift << shift) | half, (b >> shift << shift) | half);
+    lookup->cells[cell] = entry;
+  }
+  return entry;
+}
+
+void FreePaletteLookup(PaletteLookup* lookup) {
+  delete lookup;
+}
+
+// the part of a quantized region whose indices differ from what is on
+// screen, width 0 when all of it kept its indices
+struct QuantizedRect {
+  int left;
+  int top;
+  int width;
+  int height;
+};
+
+// maps the width x height rectangle at (left, top) of frame to palette
+// indices, written to out with the given stride. Without hysteresis the
+// whole rectangle counts as changed.
+QuantizedRect QuantizeFrameRegion(PaletteLookup* lookup, const AVFrame* frame, int left, int top, int width, int height, uint8_t* out, int outStride) {
+  const YuvKernels& kernels = GetYuvKernels();
+  YuvToRgb m = YuvToRgbFor(frame);
+  if(!lookup->shown) {
+    for(int y = top; y < top + height; ++y) {
+      const uint8_t* rgb = ConvertFrameRow(kernels, m, frame, y, left, width, lookup->rgb);
+      uint8_t* row = out + (size_t)(y - top) * outStride;
+      for(int x = 0; x < width; ++x) {
+        row[x] = LookupPaletteColor(lookup, rgb[3 * x], rgb[3 * x + 1], rgb[3 * x + 2]);
+      }
+    }
+    return {left, top, width, height};
+  }
+
+  // until a whole frame went out the screen holds nothing to keep
+  bool keep = lookup->hasShown;
+  int minX = width;
+  int maxX = -1;
+  int minY = height;
+  int maxY = -1;
+  for(int y = top; y < top + height; ++y) {
+    const uint8_t* rgb = ConvertFrameRow(kernels, m, frame, y, left, width, lookup->rgb);
+    uint8_t* row = out + (size_t)(y - top) * outStride;
+    uint8_t* shown = lookup->shown + (size_t)y * lookup->shownWidth + left;
+    int rowMin = width;
+    int rowMax = -1;
+    for(int x = 0; x < width; ++x) {
+      uint8_t r = rgb[3 * x], g = rgb[3 * x + 1], b = rgb[3 * x + 2];
+      const GifColorType& color = lookup->colors[shown[x]];
+      int dr = r - color.Red, dg = g - color.Green, db = b - color.Blue;
+      uint8_t index = keep && dr * dr + dg * dg + db * db <= lookup->keepDistance ? shown[x] : LookupPaletteColor(lookup, r, g, b);
+      row[x] = index;
+      if(!keep || index != shown[x]) {
+        if(rowMin > x) rowMin = x;
+        rowMax = x;
+      }
+      shown[x] = index;
+    }
+    if(rowMax >= 0) {
+      minX = std::min(minX, rowMin);
+      maxX = std::max(maxX, rowMax);
+      if(minY > y - top) minY = y - top;
+      maxY = y - top;
+    }
+  }
+  if(left == 0 && top == 0 && width == lookup->shownWidth && height == lookup->shownHeight) {
+    lookup->hasShown = true;
+  }
+  if(maxX < 0) {
+    return {left, top, 0, 0};
+  }
+  return {left + minX, top + minY, maxX - minX + 1, maxY - minY + 1};
+}
+
+#endif
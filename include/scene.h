@@ -0,0 +1,129 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "changemap.h"
+
+#define SCENE_HISTOGRAM_BINS 32
+
+struct SceneOptions {
+  // half the L1 distance between consecutive normalized luma histograms, 0..1
+  float cutHistogramDistance = 0.35f;
+  // mean absolute difference of the 4x4 cell means against the last emitted frame, 0..255
+  float cutMeanDiff = 40.0f;
+  // a 4x4 cell whose mean moved by no more than this counts as unchanged
+  int cellThreshold = 3;
+  // side of the dirty tiles in pixels, 8 or 16
+  int tileSize = 16;
+  // a delta frame goes out as at most this many rectangles
+  int maxRegions = MAX_CHANGE_REGIONS;
+  // only diff the tiles the decoder's motion vectors say may have changed;
+  // the input has to be opened with motion vector export for this
+  bool motionVectors = false;
+  // and still diff every tile once per this many analyzed frames, since a
+  // block coded with a zero vector can carry a residual the vectors do not show
+  int motionRefresh = 30;
+};
+
+enum FrameKind {
+  FRAME_CUT,
+  FRAME_DELTA,
+  FRAME_DUPLICATE
+};
+
+// cut: emit the whole frame and rebuild the palette; delta: emit only the
+// regions (in pixels, tile aligned) covering the dirty tiles; duplicate: skip
+struct SceneChange {
+  FrameKind kind;
+  float histogramDistance;
+  float meanDiff;
+  int dirtyTiles;
+  int regionCount;
+  ChangeRegion regions[MAX_CHANGE_REGIONS];
+};
+
+// changeMap carries the pyramid of the frame being analyzed and the
+// reference the viewer currently sees; the histogram is taken over the 1/8
+// level, histogram/prevHistogram are the last two frames
+struct SceneDetector {
+  int width;
+  int height;
+  ChangeMap* changeMap;
+  int hintedFrames;
+  uint32_t histogram[SCENE_HISTOGRAM_BINS];
+  uint32_t prevHistogram[SCENE_HISTOGRAM_BINS];
+};
+
+SceneDetector* CreateSceneDetector(int width, int height, const SceneOptions& options, FrameArena* arena) {
+  SceneDetector* detector = new SceneDetector();
+  detector->width = width;
+  detector->height = height;
+  detector->changeMap = CreateChangeMap(width, height, options.tileSize == 8 ? 8 : 16, arena);
+  detector->hintedFrames = 0;
+  return detector;
+}
+
+void FreeSceneDetector(SceneDetector* detector) {
+  FreeChangeMap(detector->changeMap);
+  delete detector;
+}
+
+SceneChange AnalyzeFrame(SceneDetector* detector, const uint8_t* luma, int stride, const SceneOptions& options) {
+  ChangeMap* map = detector->changeMap;
+  bool hadReference = map->hasReference;
+  bool useMotionHint = options.motionVectors && detector->hintedFrames < options.motionRefresh;
+  detector->hintedFrames = useMotionHint ? detector->hintedFrames + 1 : 0;
+  BuildChangeMap(map, luma, stride, options.cellThreshold, useMotionHint);
+
+  memset(detector->histogram, 0, sizeof(detector->histogram));
+  const uint8_t* eighth = map->eighth;
+  size_t eighthCount = map->eighthCount;
+  for(size_t i = 0; i < eighthCount; ++i) {
+    ++detector->histogram[eighth[i] * SCENE_HISTOGRAM_BINS / 256];
+  }
+
+  SceneChange change = {};
+  change.kind = FRAME_CUT;
+  change.dirtyTiles = map->dirtyTiles;
+  change.regionCount = 1;
+  change.regions[0] = {0, 0, detector->width, detector->height};
+
+  if(hadReference) {
+    uint32_t histogramDiff = 0;
+    for(int i = 0; i < SCENE_HISTOGRAM_BINS; ++i) {
+      histogramDiff += abs((int)detector->histogram[i] - (int)detector->prevHistogram[i]);
+    }
+    change.histogramDistance = histogramDiff / (2.0f * eighthCount);
+    change.meanDiff = (float)map->sad / ((size_t)map->quarterWidth * map->quarterHeight);
+
+    if(change.histogramDistance > options.cutHistogramDistance || change.meanDiff > options.cutMeanDiff) {
+      change.kind = FRAME_CUT;
+    }
+    else if(map->dirtyTiles == 0) {
+      change.kind = FRAME_DUPLICATE;
+      change.regionCount = 0;
+    }
+    else {
+      change.kind = FRAME_DELTA;
+      int maxRegions = options.maxRegions < 1 ? 1 : (options.maxRegions > MAX_CHANGE_REGIONS ? MAX_CHANGE_REGIONS : options.maxRegions);
+      change.regionCount = SelectDirtyRegions(map, change.regions, maxRegions);
+    }
+  }
+
+  memcpy(detector->prevHistogram, detector->histogram, sizeof(detector->histogram));
+  return change;
+}
+
+// call once the frame analyzed last was emitted: what the viewer sees now
+// matches it inside the emitted regions
+void CommitFrame(SceneDetector* detector, const SceneChange& change) {
+  for(int i = 0; i < change.regionCount; ++i) {
+    CommitChangeRegion(detector->changeMap, change.regions[i]);
+  }
+}
+
+#endif
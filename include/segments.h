@@ -0,0 +1,207 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+
+#include "stats.h"
+#include "gifwriter.h"
+#include "converter.h"
+
+extern "C" {
+  #include <libavformat/avformat.h>
+  #include <libavcodec/avcodec.h>
+}
+
+// the most parts a range is split into
+#define MAX_GIF_SEGMENTS 64
+// no part is planned shorter than this: each one starts with a full image
+// and opens a decoder of its own
+#define GIF_SEGMENT_MIN_SECONDS 1.0
+
+// the pts of the keyframe at or before pts, read from its packet after a
+// seek, AV_NOPTS_VALUE when there is none
+static int64_t KeyframePtsAt(AVFormatContext* formatContext, int videoStreamIndex, int64_t pts, AVPacket* packet) {
+  if(avformat_seek_file(formatContext, videoStreamIndex, INT64_MIN, pts, pts, 0) < 0) {
+    return AV_NOPTS_VALUE;
+  }
+  while(av_read_frame(formatContext, packet) == 0) {
+    bool keyframe = packet->stream_index == videoStreamIndex && (packet->flags & AV_PKT_FLAG_KEY);
+    int64_t keyframePts = packet->pts;
+    av_packet_unref(packet);
+    if(keyframe) {
+      return keyframePts;
+    }
+  }
+  return AV_NOPTS_VALUE;
+}
+
+// the progress of every part, summed into the caller's onFrame
+struct SegmentProgress {
+  std::mutex mutex;
+  const ConvertOptions* options;
+  int decoded[MAX_GIF_SEGMENTS];
+  int emitted[MAX_GIF_SEGMENTS];
+};
+
+struct SegmentProgressSlot {
+  SegmentProgress* progress;
+  int index;
+};
+
+static void SegmentOnFrame(void* user, int framesDecoded, int framesEmitted) {
+  SegmentProgressSlot* slot = (SegmentProgressSlot*)user;
+  SegmentProgress* progress = slot->progress;
+  std::lock_guard<std::mutex> lock(progress->mutex);
+  progress->decoded[slot->index] = framesDecoded;
+  progress->emitted[slot->index] = framesEmitted;
+  int decoded = 0;
+  int emitted = 0;
+  for(int i = 0; i < MAX_GIF_SEGMENTS; ++i) {
+    decoded += progress->decoded[i];
+    emitted += progress->emitted[i];
+  }
+  progress->options->onFrame(progress->options->onFrameUser, decoded, emitted);
+}
+
+// ConvertToGif with the time range split at keyframes into up to
+// options.segments parts of about equal length. Every part runs on a
+// thread of its own with its own demuxer and decoder (the first one uses
+// input) and writes a gif file of its own; the files are then joined in
+// presentation order. A part's first frame has nothing before it to diff
+// against, so it is written whole, and the every other frame analysis
+// starts over in each part; apart from that the result is the serial one.
+// Whatever needs the whole range in one pass (two pass palettes, posters,
+// keyframe mode), frame number ranges, other formats and ranges too short
+// to split are converted serially.
+int ConvertToGifSegments(const char* path, VideoInput* input, const ConvertOptions& options, ConvertResult* result) {
+  AVFormatContext* formatContext = input->formatContext;
+  int videoStreamIndex = input->videoStreamIndex;
+  AVStream* stream = formatContext->streams[videoStreamIndex];
+  bool splittable = options.segments > 1 && options.format == OUTPUT_GIF && options.timeRange && options.startSeconds >= 0 &&
+                    !options.twoPass && !options.keyframesOnly && !WritesPosters(options) && !options.segment;
+  double rangeSeconds = RangeSeconds(input, options);
+  int parts = std::min(options.segments, MAX_GIF_SEGMENTS);
+  parts = rangeSeconds > 0 ? std::min(parts, (int)(rangeSeconds / GIF_SEGMENT_MIN_SECONDS)) : 1;
+  // every part holds the buffers of a whole conversion
+  uint64_t needed = EstimateInputBytes(input, options);
+  if(options.maxMemory > 0 && needed > 0) {
+    parts = (int)std::min<uint64_t>(parts, options.maxMemory / needed);
+  }
+  if(!splittable || parts < 2) {
+    return ConvertToGif(input, options, result);
+  }
+
+  // the parts start at the keyframes at or before even steps over the range
+  int64_t startPts;
+  int64_t endPts;
+  TimeRangePts(stream, options, &startPts, &endPts);
+  std::vector<int64_t> bounds = {startPts};
+  AVPacket packet;
+  for(int i = 1; i < parts; ++i) {
+    int64_t target = startPts + av_rescale_q((int64_t)(rangeSeconds * i / parts * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+    int64_t keyframePts = KeyframePtsAt(formatContext, videoStreamIndex, target, &packet);
+    if(keyframePts != AV_NOPTS_VALUE && keyframePts > bounds.back() && keyframePts < endPts) {
+      bounds.push_back(keyframePts);
+    }
+  }
+  bounds.push_back(endPts);
+  // back where an input that was just opened stands, ConvertToGif only
+  // seeks when the range starts past the origin
+  int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+  if(avformat_seek_file(formatContext, videoStreamIndex, INT64_MIN, origin, origin, 0) < 0) {
+    fprintf(stderr, "Cannot rewind the input after looking for keyframes\n");
+    return 1;
+  }
+  parts = (int)bounds.size() - 1;
+  if(parts < 2) {
+    return ConvertToGif(input, options, result);
+  }
+  if(options.verbose) printf("Converting in %d parts split at keyframes...\n", parts);
+
+  uint64_t startNs = MonotonicNs();
+  std::vector<GifSegment> segments(parts);
+  std::vector<ConvertStats> partStats(parts);
+  std::vector<ConvertResult> partResults(parts);
+  std::vector<int> partRets(parts, 1);
+  std::vector<SegmentProgressSlot> slots(parts);
+  SegmentProgress progress;
+  progress.options = &options;
+  std::fill(progress.decoded, progress.decoded + MAX_GIF_SEGMENTS, 0);
+  std::fill(progress.emitted, progress.emitted + MAX_GIF_SEGMENTS, 0);
+  for(int i = 0; i < parts; ++i) {
+    segments[i].startPts = bounds[i];
+    segments[i].endPts = bounds[i + 1];
+    segments[i].path = std::string(options.outputFile) + ".part" + std::to_string(i);
+    slots[i] = {&progress, i};
+  }
+
+  auto convertPart = [&](int i) {
+    ConvertOptions part = options;
+    part.verbose = false;
+    part.maxMemory = 0;
+    part.segment = &segments[i];
+    part.stats = options.stats ? &partStats[i] : nullptr;
+    part.lzwEncoder = i == 0 ? options.lzwEncoder : nullptr;
+    part.onFrame = options.onFrame ? SegmentOnFrame : nullptr;
+    part.onFrameUser = &slots[i];
+    if(i == 0) {
+      partRets[i] = ConvertToGif(input, part, &partResults[i]);
+      return;
+    }
+    VideoInput own;
+    if(OpenVideoInput(path, &own, false, options.scene.motionVectors) == 0) {
+      partRets[i] = ConvertToGif(&own, part, &partResults[i]);
+      CloseVideoInput(&own);
+    }
+  };
+  std::vector<std::thread> threads;
+  for(int i = 1; i < parts; ++i) {
+    threads.emplace_back(convertPart, i);
+  }
+  convertPart(0);
+  for(std::thread& thread : threads) {
+    thread.join();
+  }
+
+  int ret = 0;
+  for(int i = 0; i < parts; ++i) {
+    if(partRets[i] != 0) ret = 1;
+  }
+  if(ret == 0) {
+    ret = JoinGifSegments(options.outputFile, segments.data(), parts);
+  }
+  else {
+    fprintf(stderr, "A part of the range failed to convert\n");
+  }
+  for(const GifSegment& segment : segments) {
+    unlink(segment.path.c_str());
+  }
+  if(ret != 0) {
+    return 1;
+  }
+
+  int framesDecoded = 0;
+  int framesEmitted = 0;
+  for(int i = 0; i < parts; ++i) {
+    framesDecoded += partResults[i].framesDecoded;
+    framesEmitted += partResults[i].framesEmitted;
+    if(options.stats) MergeStats(options.stats, partStats[i]);
+  }
+  if(options.stats) {
+    options.stats->wallNs = MonotonicNs() - startNs;
+  }
+  if(result) {
+    result->framesDecoded = framesDecoded;
+    result->framesEmitted = framesEmitted;
+  }
+  if(options.verbose) printf("Done: %s\n", options.outputFile);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef SPRITES_H
+#define SPRITES_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "arena.h"
+#include "stats.h"
+#include "poster.h"
+#include "converter.h"
+
+extern "C" {
+  #include <libavformat/avformat.h>
+  #include <libavcodec/avcodec.h>
+}
+
+// width of one sprite, the height follows the aspect ratio
+#define SPRITE_TILE_WIDTH 160
+
+struct SpriteOptions {
+  // the image, jpeg or png by extension; the index goes next to it with the
+  // extension replaced by .json
+  const char* path = nullptr;
+  int columns = 4;
+  int rows = 4;
+  int tileWidth = SPRITE_TILE_WIDTH;
+  // the part of the input to cover, the whole of it without a time range
+  bool timeRange = false;
+  double startSeconds = 0;
+  double durationSeconds = 0;
+  bool verbose = true;
+  ConvertStats* stats = nullptr;
+};
+
+// <name>.json for <name>.<ext>
+std::string SpriteIndexPath(const char* path) {
+  std::string index = path;
+  size_t dot = index.rfind('.');
+  size_t slash = index.rfind('/');
+  if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+    index.erase(dot);
+  }
+  return index + ".json";
+}
+
+// text as the inside of a json string: quotes, backslashes and control
+// characters escaped, everything else (utf-8 included) as is
+static std::string JsonEscape(const char* text) {
+  std::string escaped;
+  for(const char* c = text; *c; ++c) {
+    if(*c == '"' || *c == '\\') {
+      escaped += '\\';
+      escaped += *c;
+    }
+    else if((unsigned char)*c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", (unsigned char)*c);
+      escaped += code;
+    }
+    else {
+      escaped += *c;
+    }
+  }
+  return escaped;
+}
+
+enum KeyframeResult {
+  KEYFRAME_NONE,
+  KEYFRAME_REPEAT,
+  KEYFRAME_DECODED
+};
+
+// seeks to the keyframe at or before pts and decodes it into frame, with its
+// pts in keyframePts. When that is lastKeyframePts the picture is already
+// known and nothing is decoded. The keyframe packet is sent alone and the
+// decoder drained right away, so it never waits for the packets after it to
+// fill its reorder delay; the flush afterwards makes it take packets again.
+static KeyframeResult DecodeKeyframeAt(AVFormatContext* formatContext, AVCodecContext* codecContext, int videoStreamIndex,
+                                       int64_t pts, int64_t lastKeyframePts, AVPacket* packet, AVFrame* frame,
+                                       int64_t* keyframePts, ConvertStats* stats) {
+  if(avformat_seek_file(formatContext, videoStreamIndex, INT64_MIN, pts, pts, 0) < 0 &&
+     avformat_seek_file(formatContext, videoStreamIndex, INT64_MIN, pts, INT64_MAX, 0) < 0) {
+    return KEYFRAME_NONE;
+  }
+
+  while(true) {
+    int readRet;
+    {
+      ScopedStageTimer timer(stats, STAGE_DEMUX);
+      readRet = av_read_frame(formatContext, packet);
+    }
+    if(readRet != 0) {
+      return KEYFRAME_NONE;
+    }
+    if(stats) ++stats->packetsRead;
+    if(packet->stream_index == videoStreamIndex && (packet->flags & AV_PKT_FLAG_KEY)) {
+      break;
+    }
+    av_packet_unref(packet);
+  }
+  *keyframePts = packet->pts;
+  if(packet->pts != AV_NOPTS_VALUE && packet->pts == lastKeyframePts) {
+    av_packet_unref(packet);
+    return KEYFRAME_REPEAT;
+  }
+
+  ScopedStageTimer timer(stats, STAGE_DECODE);
+  bool decoded = avcodec_send_packet(codecContext, packet) == 0;
+  av_packet_unref(packet);
+  avcodec_send_packet(codecContext, nullptr);
+  decoded = decoded && avcodec_receive_frame(codecContext, frame) == 0;
+  // whatever else the drain holds is of no use
+  AVFrame* rest = av_frame_alloc();
+  while(avcodec_receive_frame(codecContext, rest) == 0) av_frame_unref(rest);
+  av_frame_free(&rest);
+  avcodec_flush_buffers(codecContext);
+  if(!decoded) {
+    return KEYFRAME_NONE;
+  }
+  if(stats) ++stats->framesDecoded;
+  return KEYFRAME_DECODED;
+}
+
+// An N x M sheet of thumbnails at even time steps over the range, for
+// scrubbing, and a json index of where each tile is and what time it shows.
+// The decoder only ever sees keyframes: each tile seeks to the keyframe at
+// or before its time and decodes that one picture, so a tile costs one
+// intra decode however long the GOP is. Tiles that land on the keyframe of
+// the tile before them copy it instead of decoding it again. The time in the
+// index is the keyframe's own, next to the time the tile was aimed at.
+int WriteSpriteSheet(VideoInput* input, const SpriteOptions& options) {
+  AVFormatContext* formatContext = input->formatContext;
+  AVCodecContext* codecContext = input->codecContext;
+  int videoStreamIndex = input->videoStreamIndex;
+  AVStream* stream = formatContext->streams[videoStreamIndex];
+  int64_t origin = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+  double startSeconds = options.timeRange ? options.startSeconds : 0;
+  double rangeSeconds = options.timeRange ? options.durationSeconds : 0;
+  if(rangeSeconds <= 0 && formatContext->duration != AV_NOPTS_VALUE) {
+    rangeSeconds = formatContext->duration / (double)AV_TIME_BASE - startSeconds;
+  }
+  if(startSeconds < 0 || rangeSeconds <= 0) {
+    fprintf(stderr, "Invalid time range given\n");
+    return 1;
+  }
+
+  FrameArena* arena = CreateFrameArena();
+  PosterSheet* sheet = CreatePosterSheet(options.path, options.columns, options.rows, options.tileWidth,
+                                         input->width, input->height, 0, arena);
+  int tiles = options.columns * options.rows;
+  double step = rangeSeconds / tiles;
+  std::string indexPath = SpriteIndexPath(options.path);
+  FILE* index = fopen(indexPath.c_str(), "w");
+  if(!index) {
+    fprintf(stderr, "Cannot open %s\n", indexPath.c_str());
+    ClosePosterSheet(sheet, false);
+    FreeFrameArena(arena);
+    return 1;
+  }
+
+  const char* name = strrchr(options.path, '/');
+  name = name ? name + 1 : options.path;
+  fprintf(index, "{\"image\": \"%s\", \"columns\": %d, \"rows\": %d, \"tile_width\": %d, \"tile_height\": %d, \"interval\": %.3f, \"tiles\": [",
+          JsonEscape(name).c_str(), options.columns, options.rows, sheet->tileWidth, sheet->tileHeight, step);
+
+  if(options.verbose) printf("Writing %d sprites, one every %.3fs\n", tiles, step);
+  codecContext->skip_frame = AVDISCARD_NONKEY;
+  AVPacket packet;
+  AVFrame* frame = av_frame_alloc();
+  int64_t lastKeyframePts = AV_NOPTS_VALUE;
+  int lastSlot = -1;
+  int canvasStride = 3 * options.columns * sheet->tileWidth;
+  int decoded = 0;
+  for(int i = 0; i < tiles; ++i) {
+    double target = startSeconds + i * step;
+    int64_t pts = origin + av_rescale_q((int64_t)(target * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+    int64_t keyframePts = AV_NOPTS_VALUE;
+    KeyframeResult keyframe = DecodeKeyframeAt(formatContext, codecContext, videoStreamIndex, pts, lastKeyframePts,
+                                               &packet, frame, &keyframePts, options.stats);
+    if(keyframe == KEYFRAME_NONE || (keyframe == KEYFRAME_REPEAT && lastSlot < 0)) {
+      // past the last keyframe or a broken one, the tile stays black
+      continue;
+    }
+    int x = (i % options.columns) * sheet->tileWidth;
+    int y = (i / options.columns) * sheet->tileHeight;
+    {
+      ScopedStageTimer timer(options.stats, STAGE_POSTER, nullptr, i);
+      if(keyframe == KEYFRAME_REPEAT) {
+        int lastX = (lastSlot % options.columns) * sheet->tileWidth;
+        int lastY = (lastSlot / options.columns) * sheet->tileHeight;
+        for(int row = 0; row < sheet->tileHeight; ++row) {
+          memcpy(sheet->canvas + (size_t)(y + row) * canvasStride + 3 * x,
+                 sheet->canvas + (size_t)(lastY + row) * canvasStride + 3 * lastX, 3 * sheet->tileWidth);
+        }
+      }
+      else {
+        DrawPosterTile(sheet, frame, i);
+        av_frame_unref(frame);
+        ++decoded;
+      }
+    }
+    double shown = keyframePts != AV_NOPTS_VALUE ? (keyframePts - origin) * av_q2d(stream->time_base) : target;
+    fprintf(index, "%s\n  {\"index\": %d, \"x\": %d, \"y\": %d, \"target\": %.3f, \"time\": %.3f}",
+            lastSlot < 0 ? "" : ",", i, x, y, target, shown);
+    lastKeyframePts = keyframePts;
+    lastSlot = i;
+  }
+  fprintf(index, "\n]}\n");
+  av_frame_free(&frame);
+  codecContext->skip_frame = AVDISCARD_DEFAULT;
+
+  int ret = fclose(index) != 0 ? 1 : 0;
+  if(ret != 0) {
+    fprintf(stderr, "Cannot write %s\n", indexPath.c_str());
+  }
+  if(ClosePosterSheet(sheet, ret == 0) != 0) {
+    ret = 1;
+  }
+  FreeFrameArena(arena);
+  if(ret == 0 && options.stats) {
+    options.stats->framesEmitted = decoded;
+  }
+  if(ret == 0 && options.verbose) {
+    printf("Done: %s (%d keyframes decoded for %d tiles), index in %s\n", options.path, decoded, tiles, indexPath.c_str());
+  }
+  return ret;
+}
+
+#endif
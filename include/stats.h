@@ -0,0 +1,152 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+
+#include "utils.h"
+#include "trace.h"
+
+enum Stage {
+  STAGE_DEMUX,
+  STAGE_DECODE,
+  STAGE_DIFF,
+  STAGE_QUANTIZE,
+  STAGE_GIF_WRITE,
+  STAGE_POSTER,
+  STAGE_COUNT
+};
+
+static const char* const STAGE_NAMES[STAGE_COUNT] = {"demux", "decode", "diff", "quantize", "gif_write", "poster"};
+
+// bucket i holds samples in [2^i, 2^(i+1)) microseconds, bucket 0 also takes
+// everything under 1us and the last one is open ended
+#define STATS_HISTOGRAM_BUCKETS 24
+
+struct StageStats {
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t minNs;
+  uint64_t maxNs;
+  uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+// filled by ConvertToGif when ConvertOptions::stats is set, every hook is a
+// single null check otherwise
+struct ConvertStats {
+  StageStats stages[STAGE_COUNT];
+  uint64_t packetsRead;
+  uint64_t framesDecoded;
+  uint64_t framesSkipped;
+  uint64_t framesEmitted;
+  uint64_t wallNs;
+  // per job scratch taken from the frame arena before the loop starts
+  uint64_t scratchBytes;
+  uint64_t scratchChunks;
+};
+
+void StatsRecord(ConvertStats* stats, Stage stage, uint64_t ns) {
+  StageStats& s = stats->stages[stage];
+  if(s.count == 0 || ns < s.minNs) s.minNs = ns;
+  if(ns > s.maxNs) s.maxNs = ns;
+  ++s.count;
+  s.totalNs += ns;
+
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while(us > 1 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  ++s.histogram[bucket];
+}
+
+// adds the stats of a part of the job that ran on its own; wallNs is left
+// to the caller, the parts overlap in time
+void MergeStats(ConvertStats* into, const ConvertStats& from) {
+  for(int i = 0; i < STAGE_COUNT; ++i) {
+    StageStats& s = into->stages[i];
+    const StageStats& f = from.stages[i];
+    if(f.count == 0) continue;
+    if(s.count == 0 || f.minNs < s.minNs) s.minNs = f.minNs;
+    if(f.maxNs > s.maxNs) s.maxNs = f.maxNs;
+    s.count += f.count;
+    s.totalNs += f.totalNs;
+    for(int b = 0; b < STATS_HISTOGRAM_BUCKETS; ++b) s.histogram[b] += f.histogram[b];
+  }
+  into->packetsRead += from.packetsRead;
+  into->framesDecoded += from.framesDecoded;
+  into->framesSkipped += from.framesSkipped;
+  into->framesEmitted += from.framesEmitted;
+  into->scratchBytes += from.scratchBytes;
+  into->scratchChunks += from.scratchChunks;
+}
+
+// times one stage call into the stats and, when tracing, emits it as a span
+// tagged with id (packet number for demux/decode, frame number after that)
+struct ScopedStageTimer {
+  ConvertStats* stats;
+  TraceRecorder* trace;
+  Stage stage;
+  int64_t id;
+  uint64_t start;
+
+  ScopedStageTimer(ConvertStats* stats, Stage stage, TraceRecorder* trace = nullptr, int64_t id = -1)
+    : stats(stats), trace(trace), stage(stage), id(id), start((stats || trace) ? MonotonicNs() : 0) {}
+  ~ScopedStageTimer() {
+    if(!stats && !trace) return;
+    uint64_t end = MonotonicNs();
+    if(stats) StatsRecord(stats, stage, end - start);
+    if(trace) TraceSpan(trace, STAGE_NAMES[stage], start, end, id);
+  }
+};
+
+// upper bound of the bucket holding the given percentile, good to a factor of two
+double StatsPercentileUs(const StageStats& s, double percentile) {
+  uint64_t target = (uint64_t)(s.count * percentile / 100.0);
+  uint64_t seen = 0;
+  for(int i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+    seen += s.histogram[i];
+    if(seen > target) return (double)(2ull << i);
+  }
+  return s.maxNs / 1000.0;
+}
+
+void PrintStatsSummary(FILE* out, const ConvertStats& stats) {
+  fprintf(out, "packets read: %" PRIu64 ", frames decoded: %" PRIu64 ", skipped: %" PRIu64 ", emitted: %" PRIu64 ", wall: %.1f ms\n",
+          stats.packetsRead, stats.framesDecoded, stats.framesSkipped, stats.framesEmitted, stats.wallNs / 1e6);
+  fprintf(out, "scratch: %.1f KB in %" PRIu64 " arena chunks\n", stats.scratchBytes / 1024.0, stats.scratchChunks);
+  fprintf(out, "%-10s %8s %11s %9s %9s %9s %9s %9s\n", "stage", "calls", "total ms", "mean us", "min us", "max us", "p50 us", "p99 us");
+  for(int i = 0; i < STAGE_COUNT; ++i) {
+    const StageStats& s = stats.stages[i];
+    if(s.count == 0) continue;
+    fprintf(out, "%-10s %8" PRIu64 " %11.2f %9.1f %9.1f %9.1f %9.0f %9.0f\n", STAGE_NAMES[i], s.count,
+            s.totalNs / 1e6, s.totalNs / 1e3 / s.count, s.minNs / 1e3, s.maxNs / 1e3,
+            StatsPercentileUs(s, 50), StatsPercentileUs(s, 99));
+  }
+}
+
+void PrintStatsJson(FILE* out, const ConvertStats& stats) {
+  fprintf(out, "{\"packets_read\": %" PRIu64 ", \"frames_decoded\": %" PRIu64 ", \"frames_skipped\": %" PRIu64 ", \"frames_emitted\": %" PRIu64 ", \"wall_ns\": %" PRIu64 ", "
+               "\"scratch_bytes\": %" PRIu64 ", \"scratch_chunks\": %" PRIu64 ", \"stages\": {",
+          stats.packetsRead, stats.framesDecoded, stats.framesSkipped, stats.framesEmitted, stats.wallNs,
+          stats.scratchBytes, stats.scratchChunks);
+  bool first = true;
+  for(int i = 0; i < STAGE_COUNT; ++i) {
+    const StageStats& s = stats.stages[i];
+    if(s.count == 0) continue;
+    fprintf(out, "%s\"%s\": {\"calls\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"histogram_log2_us\": [",
+            first ? "" : ", ", STAGE_NAMES[i], s.count, s.totalNs, s.minNs, s.maxNs);
+    int last = STATS_HISTOGRAM_BUCKETS - 1;
+    while(last > 0 && s.histogram[last] == 0) --last;
+    for(int b = 0; b <= last; ++b) {
+      fprintf(out, "%s%" PRIu64, b ? ", " : "", s.histogram[b]);
+    }
+    fprintf(out, "]}");
+    first = false;
+  }
+  fprintf(out, "}}");
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <cinttypes>
+#include <cstdio>
+#include <atomic>
+
+#include "utils.h"
+
+// per thread ring size, once full the oldest events are overwritten
+#define TRACE_RING_CAPACITY (1 << 16)
+
+enum TracePhase {
+  TRACE_PHASE_COMPLETE,
+  TRACE_PHASE_ASYNC
+};
+
+struct TraceEvent {
+  const char* name;
+  uint64_t startNs;
+  uint64_t endNs;
+  int64_t id;
+  TracePhase phase;
+};
+
+// only the owning thread writes events, head is published with release so a
+// reader that acquires it sees every event below it
+struct TraceThreadBuffer {
+  TraceEvent events[TRACE_RING_CAPACITY];
+  std::atomic<uint64_t> head;
+  int tid;
+  const char* threadName;
+  TraceThreadBuffer* next;
+};
+
+struct TraceRecorder {
+  std::atomic<TraceThreadBuffer*> buffers;
+  std::atomic<int> nextTid;
+  uint64_t generation;
+  uint64_t originNs;
+};
+
+static std::atomic<uint64_t> traceGeneration(0);
+
+TraceRecorder* CreateTraceRecorder() {
+  TraceRecorder* trace = new TraceRecorder();
+  trace->buffers.store(nullptr);
+  trace->nextTid.store(1);
+  trace->generation = ++traceGeneration;
+  trace->originNs = MonotonicNs();
+  return trace;
+}
+
+void FreeTraceRecorder(TraceRecorder* trace) {
+  TraceThreadBuffer* buffer = trace->buffers.load();
+  while(buffer) {
+    TraceThreadBuffer* next = buffer->next;
+    delete buffer;
+    buffer = next;
+  }
+  delete trace;
+}
+
+// first call on a thread allocates its ring and pushes it onto the recorder's
+// list with a cas, every later call is a thread_local compare
+TraceThreadBuffer* TraceThreadBufferFor(TraceRecorder* trace) {
+  thread_local uint64_t cachedGeneration = 0;
+  thread_local TraceThreadBuffer* cachedBuffer = nullptr;
+  if(cachedGeneration == trace->generation) {
+    return cachedBuffer;
+  }
+
+  TraceThreadBuffer* buffer = new TraceThreadBuffer();
+  buffer->head.store(0);
+  buffer->tid = trace->nextTid.fetch_add(1);
+  buffer->threadName = nullptr;
+  buffer->next = trace->buffers.load();
+  while(!trace->buffers.compare_exchange_weak(buffer->next, buffer)) {}
+
+  cachedGeneration = trace->generation;
+  cachedBuffer = buffer;
+  return buffer;
+}
+
+void TraceSetThreadName(TraceRecorder* trace, const char* name) {
+  TraceThreadBufferFor(trace)->threadName = name;
+}
+
+void TraceRecord(TraceRecorder* trace, const char* name, uint64_t startNs, uint64_t endNs, int64_t id, TracePhase phase) {
+  TraceThreadBuffer* buffer = TraceThreadBufferFor(trace);
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  TraceEvent& event = buffer->events[head & (TRACE_RING_CAPACITY - 1)];
+  event.name = name;
+  event.startNs = startNs;
+  event.endNs = endNs;
+  event.id = id;
+  event.phase = phase;
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void TraceSpan(TraceRecorder* trace, const char* name, uint64_t startNs, uint64_t endNs, int64_t id) {
+  TraceRecord(trace, name, startNs, endNs, id, TRACE_PHASE_COMPLETE);
+}
+
+// a span that may start on one thread and end on another, drawn on its own
+// track keyed by id; used for the per frame latency from demux to gif write
+void TraceAsyncSpan(TraceRecorder* trace, const char* name, uint64_t startNs, uint64_t endNs, int64_t id) {
+  TraceRecord(trace, name, startNs, endNs, id, TRACE_PHASE_ASYNC);
+}
+
+// writes the chrome trace event format, loadable in chrome://tracing and ui.perfetto.dev;
+// call it once the traced threads are done
+int WriteChromeTrace(TraceRecorder* trace, const char* path) {
+  FILE* out = fopen(path, "w");
+  if(!out) {
+    fprintf(stderr, "cannot open trace file %s\n", path);
+    return 1;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  bool first = true;
+  for(TraceThreadBuffer* buffer = trace->buffers.load(); buffer; buffer = buffer->next) {
+    if(buffer->threadName) {
+      fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+              first ? "" : ",\n", buffer->tid, buffer->threadName);
+      first = false;
+    }
+
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    uint64_t begin = head > TRACE_RING_CAPACITY ? head - TRACE_RING_CAPACITY : 0;
+    for(uint64_t i = begin; i < head; ++i) {
+      const TraceEvent& event = buffer->events[i & (TRACE_RING_CAPACITY - 1)];
+      double ts = (int64_t)(event.startNs - trace->originNs) / 1000.0;
+      double dur = (event.endNs - event.startNs) / 1000.0;
+      if(event.phase == TRACE_PHASE_COMPLETE) {
+        fprintf(out, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"id\": %" PRId64 "}}",
+                first ? "" : ",\n", event.name, buffer->tid, ts, dur, event.id);
+      }
+      else {
+        fprintf(out, "%s{\"name\": \"%s\", \"cat\": \"latency\", \"ph\": \"b\", \"id\": %" PRId64 ", \"pid\": 1, \"tid\": %d, \"ts\": %.3f},\n"
+                     "{\"name\": \"%s\", \"cat\": \"latency\", \"ph\": \"e\", \"id\": %" PRId64 ", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                first ? "" : ",\n", event.name, event.id, buffer->tid, ts, event.name, event.id, buffer->tid, ts + dur);
+      }
+      first = false;
+    }
+  }
+  fprintf(out, "\n]}\n");
+
+  fclose(out);
+  return 0;
+}
+
+#endif
@@ -4,18 +4,12 @@
 #include <cstdint>
 #include <cstddef>
 #include <cmath>
+#include <ctime>
 
-float GetFramesRepeatRatio(uint8_t *frame1, uint8_t *frame2, size_t len) {
-    float noOfNonZeroBytes = 0;
-
-    for(int i = 0;i < len; ++i) {
-        int dif = frame1[i]-frame2[i];
-        if(dif > 0) {
-            ++noOfNonZeroBytes;
-        } 
-    }
-    
-    return noOfNonZeroBytes / len * 100.0f;
+uint64_t MonotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 #endif
\ No newline at end of file
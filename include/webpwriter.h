@@ -0,0 +1,174 @@
+#ifndef WEBPWRITER_H
+#define WEBPWRITER_H
+
+// only built when the Makefile finds libwebpmux, which defines HAVE_LIBWEBP
+#ifdef HAVE_LIBWEBP
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+
+#include "output.h"
+#include "arena.h"
+#include "stats.h"
+
+extern "C" {
+  #include <webp/encode.h>
+  #include <webp/mux.h>
+}
+
+// lossy quality of every frame, 0..100
+#define WEBP_QUALITY 75
+#define WEBP_LAST_FRAME_MS 100
+
+// WebPAnimEncoder wants whole frames, so the changed rectangles are painted
+// into an RGBA canvas and the canvas is added once the frame is complete;
+// the encoder finds the changed area again on its own
+struct WebpWriter {
+  std::string path;
+  int width;
+  int height;
+  WebPAnimEncoder* encoder;
+  WebPConfig config;
+  WebPPicture picture;
+  uint8_t* canvas;
+  GifColorType palette[256];
+  bool frameOpen;
+  int framesAdded;
+  int frameMs;
+  int lastDurationMs;
+  int64_t frameNumber;
+  bool failed;
+  ConvertStats* stats;
+  TraceRecorder* trace;
+};
+
+static void WebpAddCanvas(WebpWriter* writer) {
+  if(!writer->frameOpen) {
+    return;
+  }
+  ScopedStageTimer timer(writer->stats, STAGE_GIF_WRITE, writer->trace, writer->frameNumber);
+  if(!WebPPictureImportRGBA(&writer->picture, writer->canvas, writer->width * 4) ||
+     !WebPAnimEncoderAdd(writer->encoder, &writer->picture, writer->frameMs, &writer->config)) {
+    writer->failed = true;
+  }
+  ++writer->framesAdded;
+  writer->frameOpen = false;
+}
+
+static int WebpWriterBegin(void* state, const ColorMapObject* globalMap) {
+  WebpWriter* writer = (WebpWriter*)state;
+  int colors = globalMap->ColorCount < 256 ? globalMap->ColorCount : 256;
+  for(int i = 0; i < colors; ++i) {
+    writer->palette[i] = globalMap->Colors[i];
+  }
+  return 0;
+}
+
+static int WebpWriterBeginFrame(void* state, double time, bool, int64_t frameNumber) {
+  WebpWriter* writer = (WebpWriter*)state;
+  int ms = (int)(time * 1000 + 0.5);
+  // timestamps have to increase
+  if(writer->frameOpen && ms <= writer->frameMs) {
+    ms = writer->frameMs + 1;
+  }
+  if(writer->frameOpen) {
+    writer->lastDurationMs = ms - writer->frameMs;
+  }
+  WebpAddCanvas(writer);
+  writer->frameMs = ms;
+  writer->frameNumber = frameNumber;
+  writer->frameOpen = true;
+  return writer->failed ? 1 : 0;
+}
+
+static int WebpWriterRegion(void* state, const OutputRegion& region) {
+  WebpWriter* writer = (WebpWriter*)state;
+  for(int y = 0; y < region.height; ++y) {
+    const uint8_t* row = region.pixels + (size_t)y * region.stride;
+    uint8_t* out = writer->canvas + ((size_t)(region.top + y) * writer->width + region.left) * 4;
+    for(int x = 0; x < region.width; ++x) {
+      const GifColorType& color = writer->palette[row[x]];
+      out[4 * x] = color.Red;
+      out[4 * x + 1] = color.Green;
+      out[4 * x + 2] = color.Blue;
+      out[4 * x + 3] = 255;
+    }
+  }
+  return 0;
+}
+
+static int WebpWriterClose(void* state) {
+  WebpWriter* writer = (WebpWriter*)state;
+  int endMs = writer->frameMs + writer->lastDurationMs;
+  WebpAddCanvas(writer);
+
+  WebPData data;
+  WebPDataInit(&data);
+  // with no frames libwebp assembles nothing, and an empty file is no webp
+  if(writer->framesAdded == 0) {
+    writer->failed = true;
+  }
+  if(!writer->failed) {
+    writer->failed = !WebPAnimEncoderAdd(writer->encoder, nullptr, endMs, nullptr) ||
+                     !WebPAnimEncoderAssemble(writer->encoder, &data);
+  }
+  if(!writer->failed) {
+    FILE* file = fopen(writer->path.c_str(), "wb");
+    writer->failed = !file || fwrite(data.bytes, 1, data.size, file) != data.size;
+    if(file && fclose(file) != 0) writer->failed = true;
+  }
+  if(writer->failed) {
+    fprintf(stderr, "Cannot write webp file: %s\n", writer->path.c_str());
+  }
+  bool failed = writer->failed;
+  WebPDataClear(&data);
+  WebPPictureFree(&writer->picture);
+  WebPAnimEncoderDelete(writer->encoder);
+  delete writer;
+  return failed ? 1 : 0;
+}
+
+bool OpenWebpWriter(OutputBackend* backend, const char* path, int width, int height, FrameArena* arena, ConvertStats* stats, TraceRecorder* trace) {
+  WebpWriter* writer = new WebpWriter();
+  writer->path = path;
+  writer->width = width;
+  writer->height = height;
+
+  WebPAnimEncoderOptions encoderOptions;
+  WebPAnimEncoderOptionsInit(&encoderOptions);
+  writer->encoder = WebPAnimEncoderNew(width, height, &encoderOptions);
+  WebPConfigInit(&writer->config);
+  writer->config.quality = WEBP_QUALITY;
+  WebPPictureInit(&writer->picture);
+  writer->picture.width = width;
+  writer->picture.height = height;
+  writer->picture.use_argb = 1;
+  if(!writer->encoder || !WebPPictureAlloc(&writer->picture)) {
+    fprintf(stderr, "Cannot create a webp encoder\n");
+    if(writer->encoder) WebPAnimEncoderDelete(writer->encoder);
+    delete writer;
+    return false;
+  }
+
+  writer->canvas = ArenaArray<uint8_t>(arena, (size_t)width * height * 4);
+  writer->frameOpen = false;
+  writer->framesAdded = 0;
+  writer->frameMs = 0;
+  writer->lastDurationMs = WEBP_LAST_FRAME_MS;
+  writer->frameNumber = 0;
+  writer->failed = false;
+  writer->stats = stats;
+  writer->trace = trace;
+
+  backend->state = writer;
+  backend->begin = WebpWriterBegin;
+  backend->beginFrame = WebpWriterBeginFrame;
+  backend->writeRegion = WebpWriterRegion;
+  backend->close = WebpWriterClose;
+  return true;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef YUV_H
+#define YUV_H
+
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+  #include <libavutil/frame.h>
+  #include <libavutil/pixfmt.h>
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define YUV_X86 1
+#endif
+
+// 6 bit fixed point YUV -> RGB for one matrix and range, picked per frame.
+// At 6 bits every product and sum of the formula fits a 16 bit lane, so
+// the SIMD kernels below give exactly the bytes the scalar code does.
+struct YuvToRgb {
+  int yOffset;
+  int yScale;
+  int rv;
+  int gu;
+  int gv;
+  int bu;
+};
+
+YuvToRgb YuvToRgbFor(const AVFrame* frame) {
+  bool fullRange = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+  bool bt709 = frame->colorspace == AVCOL_SPC_BT709;
+  if(fullRange) {
+    return bt709 ? YuvToRgb{0, 64, 101, -12, -30, 119} : YuvToRgb{0, 64, 90, -22, -46, 113};
+  }
+  return bt709 ? YuvToRgb{16, 75, 115, -14, -34, 135} : YuvToRgb{16, 75, 102, -25, -52, 129};
+}
+
+static inline uint8_t ClampColor(int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline void ConvertYuvPixel(const YuvToRgb& m, int y, int u, int v, uint8_t* r, uint8_t* g, uint8_t* b) {
+  int c = (y - m.yOffset) * m.yScale + 32;
+  int d = u - 128;
+  int e = v - 128;
+  *r = ClampColor((c + m.rv * e) >> 6);
+  *g = ClampColor((c + m.gu * d + m.gv * e) >> 6);
+  *b = ClampColor((c + m.bu * d) >> 6);
+}
+
+// One row to packed RGB24, 3 * width bytes. A row is converted whole so a
+// caller can fuse it with what it does to the row next (downscale, palette
+// lookup) while the row is still in cache.
+// yuv420: u and v hold one sample per two pixels (4:2:0 and 4:2:2 rows)
+typedef void (*YuvRowFunc)(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb);
+// nv12: the same with u and v interleaved in one plane
+typedef void (*Nv12RowFunc)(const YuvToRgb& m, const uint8_t* y, const uint8_t* uv, int width, uint8_t* rgb);
+// halve: the 2x2 means of two luma rows, width output pixels
+typedef void (*HalveRowsFunc)(const uint8_t* row0, const uint8_t* row1, int width, uint8_t* out);
+
+static void Yuv420RowScalar(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  for(int x = 0; x < width; ++x) {
+    ConvertYuvPixel(m, y[x], u[x / 2], v[x / 2], rgb + 3 * x, rgb + 3 * x + 1, rgb + 3 * x + 2);
+  }
+}
+
+static void Yuv444RowScalar(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  for(int x = 0; x < width; ++x) {
+    ConvertYuvPixel(m, y[x], u[x], v[x], rgb + 3 * x, rgb + 3 * x + 1, rgb + 3 * x + 2);
+  }
+}
+
+static void Nv12RowScalar(const YuvToRgb& m, const uint8_t* y, const uint8_t* uv, int width, uint8_t* rgb) {
+  for(int x = 0; x < width; ++x) {
+    ConvertYuvPixel(m, y[x], uv[x / 2 * 2], uv[x / 2 * 2 + 1], rgb + 3 * x, rgb + 3 * x + 1, rgb + 3 * x + 2);
+  }
+}
+
+static void HalveRowsScalar(const uint8_t* row0, const uint8_t* row1, int width, uint8_t* out) {
+  for(int x = 0; x < width; ++x) {
+    out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+  }
+}
+
+#ifdef YUV_X86
+// R, G and B of 16 pixels, one vector each, to 48 bytes of RGB24
+__attribute__((target("ssse3"), always_inline))
+static inline void StoreRgb24Ssse3(__m128i r, __m128i g, __m128i b, uint8_t* rgb) {
+  const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+  __m128i out0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0));
+  __m128i out1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1));
+  __m128i out2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2));
+  _mm_storeu_si128((__m128i*)rgb, out0);
+  _mm_storeu_si128((__m128i*)(rgb + 16), out1);
+  _mm_storeu_si128((__m128i*)(rgb + 32), out2);
+}
+
+// 16 pixels: the luma bytes and u - 128, v - 128 per pixel as 16 bit lanes,
+// pixels 0-7 in lo and 8-15 in hi. Only adds of the sums that can leave
+// int16 saturate, and a saturated sum is clamped to 255 either way.
+__attribute__((target("ssse3"), always_inline))
+static inline void ConvertYuv16Ssse3(const YuvToRgb& m, __m128i y, __m128i dLo, __m128i dHi, __m128i eLo, __m128i eHi, uint8_t* rgb) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i yOffset = _mm_set1_epi16(m.yOffset);
+  const __m128i yScale = _mm_set1_epi16(m.yScale);
+  const __m128i round = _mm_set1_epi16(32);
+  const __m128i rv = _mm_set1_epi16(m.rv);
+  const __m128i gu = _mm_set1_epi16(m.gu);
+  const __m128i gv = _mm_set1_epi16(m.gv);
+  const __m128i bu = _mm_set1_epi16(m.bu);
+  __m128i cLo = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y, zero), yOffset), yScale), round);
+  __m128i cHi = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y, zero), yOffset), yScale), round);
+  __m128i rLo = _mm_srai_epi16(_mm_adds_epi16(cLo, _mm_mullo_epi16(eLo, rv)), 6);
+  __m128i rHi = _mm_srai_epi16(_mm_adds_epi16(cHi, _mm_mullo_epi16(eHi, rv)), 6);
+  __m128i gLo = _mm_srai_epi16(_mm_adds_epi16(cLo, _mm_add_epi16(_mm_mullo_epi16(dLo, gu), _mm_mullo_epi16(eLo, gv))), 6);
+  __m128i gHi = _mm_srai_epi16(_mm_adds_epi16(cHi, _mm_add_epi16(_mm_mullo_epi16(dHi, gu), _mm_mullo_epi16(eHi, gv))), 6);
+  __m128i bLo = _mm_srai_epi16(_mm_adds_epi16(cLo, _mm_mullo_epi16(dLo, bu)), 6);
+  __m128i bHi = _mm_srai_epi16(_mm_adds_epi16(cHi, _mm_mullo_epi16(dHi, bu)), 6);
+  StoreRgb24Ssse3(_mm_packus_epi16(rLo, rHi), _mm_packus_epi16(gLo, gHi), _mm_packus_epi16(bLo, bHi), rgb);
+}
+
+// 8 chroma bytes to 16 bit lanes minus 128, each doubled for its two pixels
+__attribute__((target("ssse3"), always_inline))
+static inline void WidenChromaSsse3(__m128i chroma, __m128i* lo, __m128i* hi) {
+  __m128i centered = _mm_sub_epi16(_mm_unpacklo_epi8(chroma, _mm_setzero_si128()), _mm_set1_epi16(128));
+  *lo = _mm_unpacklo_epi16(centered, centered);
+  *hi = _mm_unpackhi_epi16(centered, centered);
+}
+
+__attribute__((target("ssse3")))
+static void Yuv420RowSsse3(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m128i dLo, dHi, eLo, eHi;
+    WidenChromaSsse3(_mm_loadl_epi64((const __m128i*)(u + x / 2)), &dLo, &dHi);
+    WidenChromaSsse3(_mm_loadl_epi64((const __m128i*)(v + x / 2)), &eLo, &eHi);
+    ConvertYuv16Ssse3(m, _mm_loadu_si128((const __m128i*)(y + x)), dLo, dHi, eLo, eHi, rgb + 3 * x);
+  }
+  Yuv420RowScalar(m, y + x, u + x / 2, v + x / 2, width - x, rgb + 3 * x);
+}
+
+__attribute__((target("ssse3")))
+static void Nv12RowSsse3(const YuvToRgb& m, const uint8_t* y, const uint8_t* uv, int width, uint8_t* rgb) {
+  const __m128i lowBytes = _mm_set1_epi16(0xff);
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m128i pairs = _mm_loadu_si128((const __m128i*)(uv + x));
+    __m128i u = _mm_packus_epi16(_mm_and_si128(pairs, lowBytes), _mm_setzero_si128());
+    __m128i v = _mm_packus_epi16(_mm_srli_epi16(pairs, 8), _mm_setzero_si128());
+    __m128i dLo, dHi, eLo, eHi;
+    WidenChromaSsse3(u, &dLo, &dHi);
+    WidenChromaSsse3(v, &eLo, &eHi);
+    ConvertYuv16Ssse3(m, _mm_loadu_si128((const __m128i*)(y + x)), dLo, dHi, eLo, eHi, rgb + 3 * x);
+  }
+  Nv12RowScalar(m, y + x, uv + x, width - x, rgb + 3 * x);
+}
+
+__attribute__((target("ssse3")))
+static void Yuv444RowSsse3(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_set1_epi16(128);
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m128i u8 = _mm_loadu_si128((const __m128i*)(u + x));
+    __m128i v8 = _mm_loadu_si128((const __m128i*)(v + x));
+    ConvertYuv16Ssse3(m, _mm_loadu_si128((const __m128i*)(y + x)),
+                      _mm_sub_epi16(_mm_unpacklo_epi8(u8, zero), bias), _mm_sub_epi16(_mm_unpackhi_epi8(u8, zero), bias),
+                      _mm_sub_epi16(_mm_unpacklo_epi8(v8, zero), bias), _mm_sub_epi16(_mm_unpackhi_epi8(v8, zero), bias), rgb + 3 * x);
+  }
+  Yuv444RowScalar(m, y + x, u + x, v + x, width - x, rgb + 3 * x);
+}
+
+// vertical sums in 16 bits, then madd with ones folds the column pairs:
+// 16 pixels of each row in, 8 means out
+static void HalveRowsSse2(const uint8_t* row0, const uint8_t* row1, int width, uint8_t* out) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i round = _mm_set1_epi32(2);
+  int x = 0;
+  for(; x + 8 <= width; x += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row0 + 2 * x));
+    __m128i b = _mm_loadu_si128((const __m128i*)(row1 + 2 * x));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    __m128i sumLo = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(lo, ones), round), 2);
+    __m128i sumHi = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(hi, ones), round), 2);
+    __m128i packed = _mm_packs_epi32(sumLo, sumHi);
+    _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(packed, packed));
+  }
+  HalveRowsScalar(row0 + 2 * x, row1 + 2 * x, width - x, out + x);
+}
+
+// the same formula on 16 pixels in one register; packus works per 128 bit
+// lane, so a 64 bit permute brings each channel's 16 bytes together
+__attribute__((target("avx2"), always_inline))
+static inline void ConvertYuv16Avx2(const YuvToRgb& m, __m128i y, __m256i d, __m256i e, uint8_t* rgb) {
+  __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(y), _mm256_set1_epi16(m.yOffset)),
+                                                  _mm256_set1_epi16(m.yScale)), _mm256_set1_epi16(32));
+  __m256i r = _mm256_srai_epi16(_mm256_adds_epi16(c, _mm256_mullo_epi16(e, _mm256_set1_epi16(m.rv))), 6);
+  __m256i g = _mm256_srai_epi16(_mm256_adds_epi16(c, _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_set1_epi16(m.gu)),
+                                                                      _mm256_mullo_epi16(e, _mm256_set1_epi16(m.gv)))), 6);
+  __m256i b = _mm256_srai_epi16(_mm256_adds_epi16(c, _mm256_mullo_epi16(d, _mm256_set1_epi16(m.bu))), 6);
+  __m256i rg = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, g), 0xd8);
+  __m256i bb = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0xd8);
+  StoreRgb24Ssse3(_mm256_castsi256_si128(rg), _mm256_extracti128_si256(rg, 1), _mm256_castsi256_si128(bb), rgb);
+}
+
+// 8 chroma bytes to 16 lanes minus 128, each doubled for its two pixels
+__attribute__((target("avx2"), always_inline))
+static inline __m256i WidenChromaAvx2(__m128i chroma) {
+  __m128i centered = _mm_sub_epi16(_mm_cvtepu8_epi16(chroma), _mm_set1_epi16(128));
+  return _mm256_set_m128i(_mm_unpackhi_epi16(centered, centered), _mm_unpacklo_epi16(centered, centered));
+}
+
+__attribute__((target("avx2")))
+static void Yuv420RowAvx2(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m256i d = WidenChromaAvx2(_mm_loadl_epi64((const __m128i*)(u + x / 2)));
+    __m256i e = WidenChromaAvx2(_mm_loadl_epi64((const __m128i*)(v + x / 2)));
+    ConvertYuv16Avx2(m, _mm_loadu_si128((const __m128i*)(y + x)), d, e, rgb + 3 * x);
+  }
+  Yuv420RowScalar(m, y + x, u + x / 2, v + x / 2, width - x, rgb + 3 * x);
+}
+
+__attribute__((target("avx2")))
+static void Nv12RowAvx2(const YuvToRgb& m, const uint8_t* y, const uint8_t* uv, int width, uint8_t* rgb) {
+  const __m128i lowBytes = _mm_set1_epi16(0xff);
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m128i pairs = _mm_loadu_si128((const __m128i*)(uv + x));
+    __m256i d = WidenChromaAvx2(_mm_packus_epi16(_mm_and_si128(pairs, lowBytes), _mm_setzero_si128()));
+    __m256i e = WidenChromaAvx2(_mm_packus_epi16(_mm_srli_epi16(pairs, 8), _mm_setzero_si128()));
+    ConvertYuv16Avx2(m, _mm_loadu_si128((const __m128i*)(y + x)), d, e, rgb + 3 * x);
+  }
+  Nv12RowScalar(m, y + x, uv + x, width - x, rgb + 3 * x);
+}
+
+__attribute__((target("avx2")))
+static void Yuv444RowAvx2(const YuvToRgb& m, const uint8_t* y, const uint8_t* u, const uint8_t* v, int width, uint8_t* rgb) {
+  const __m256i bias = _mm256_set1_epi16(128);
+  int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x))), bias);
+    __m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x))), bias);
+    ConvertYuv16Avx2(m, _mm_loadu_si128((const __m128i*)(y + x)), d, e, rgb + 3 * x);
+  }
+  Yuv444RowScalar(m, y + x, u + x, v + x, width - x, rgb + 3 * x);
+}
+#endif
+
+struct YuvKernels {
+  YuvRowFunc yuv420;
+  Nv12RowFunc nv12;
+  YuvRowFunc yuv444;
+  HalveRowsFunc halveRows;
+};
+
+static const YuvKernels YUV_SCALAR_KERNELS = {Yuv420RowScalar, Nv12RowScalar, Yuv444RowScalar, HalveRowsScalar};
+
+// picked once per process: AVX2 when the cpu has it, then SSSE3 (the byte
+// shuffle that interleaves RGB24), plain C elsewhere; all give the same bytes
+static const YuvKernels& GetYuvKernels() {
+  static const YuvKernels kernels = [] {
+    YuvKernels k = YUV_SCALAR_KERNELS;
+#ifdef YUV_X86
+    k.halveRows = HalveRowsSse2;
+    if(__builtin_cpu_supports("ssse3")) {
+      k.yuv420 = Yuv420RowSsse3;
+      k.nv12 = Nv12RowSsse3;
+      k.yuv444 = Yuv444RowSsse3;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+      k.yuv420 = Yuv420RowAvx2;
+      k.nv12 = Nv12RowAvx2;
+      k.yuv444 = Yuv444RowAvx2;
+    }
+#endif
+    return k;
+  }();
+  return kernels;
+}
+
+// pixels [left, left + width) of row y of a 4:2:0 frame as RGB24. rgb needs
+// room for width + 1 pixels: an odd left starts the conversion one pixel
+// early, at its chroma pair, and the returned pointer skips that pixel
+const uint8_t* ConvertFrameRow(const YuvKernels& kernels, const YuvToRgb& m, const AVFrame* frame, int y, int left, int width, uint8_t* rgb) {
+  int start = left & ~1;
+  int count = width + (left - start);
+  const uint8_t* luma = frame->data[0] + (size_t)y * frame->linesize[0] + start;
+  const uint8_t* chroma = frame->data[1] + (size_t)(y / 2) * frame->linesize[1];
+  if(frame->format == AV_PIX_FMT_NV12) {
+    kernels.nv12(m, luma, chroma + start, count, rgb);
+  }
+  else {
+    const uint8_t* v = frame->data[2] + (size_t)(y / 2) * frame->linesize[2];
+    kernels.yuv420(m, luma, chroma + start / 2, v + start / 2, count, rgb);
+  }
+  return rgb + 3 * (left - start);
+}
+
+#endif
@@ -3,238 +3,312 @@
 #include <sstream>
 #include <cstdlib>
 
-#include "include/utils.h"
+#include <thread>
 
-extern "C" {
-  #include <libavformat/avformat.h>
-  #include <libavcodec/avcodec.h>
-  #include <libavutil/imgutils.h>
-  #include <libswscale/swscale.h>
+#include "include/converter.h"
+#include "include/daemon.h"
+#include "include/cache.h"
+#include "include/sprites.h"
+#include "include/segments.h"
 
-  #include <gif_lib.h>
-  
+extern "C" {
   #include "include/stb_image_write.h"
 }
 
-#define FRAMES_DIFF_RATIO 80
-
-void CreateColorMap(ColorMapObject *cmap) {
-  for(int i = 0; i < 256; ++i) {
-    cmap->Colors[i].Red = i;
-    cmap->Colors[i].Green = i;
-    cmap->Colors[i].Blue = i;
+static void ReportStats(const ConvertStats& stats, bool json) {
+  if(json) {
+    PrintStatsJson(stderr, stats);
+    fprintf(stderr, "\n");
+  }
+  else {
+    PrintStatsSummary(stderr, stats);
   }
 }
 
-int WriteNetscapeLoopExtension(GifFileType *gifFile, int loopCount) {
-    unsigned char nsAppId[] = {'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0'};
-    if (EGifPutExtensionLeader(gifFile, APPLICATION_EXT_FUNC_CODE) == GIF_ERROR) {
-        return GIF_ERROR;
+int main(int argc, char** argv) {
+
+  const char* inputFile = nullptr;
+  bool printStats = false;
+  bool statsJson = false;
+  const char* traceFile = nullptr;
+  LzwOptions lzwOptions;
+  bool compactPalette = true;
+  SceneOptions sceneOptions;
+  bool timeRange = false;
+  double startSeconds = 0;
+  double durationSeconds = 0;
+  ResultCache cache;
+  uint64_t maxMemory = 0;
+  bool twoPass = false;
+  int colorLookupBits = PALETTE_LOOKUP_BITS;
+  int colorHysteresis = 0;
+  bool keyframesOnly = false;
+  OutputFormat format = OUTPUT_GIF;
+  const char* posterFile = nullptr;
+  const char* contactSheetFile = nullptr;
+  const char* spriteFile = nullptr;
+  int sheetColumns = 4;
+  int sheetRows = 4;
+  int segments = 1;
+  const char* daemonSocket = nullptr;
+  int daemonWorkers = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+  for(int i = 1; i < argc; ++i) {
+    if(strcmp(argv[i], "--stats") == 0) {
+      printStats = true;
     }
-    if (EGifPutExtensionBlock(gifFile, sizeof(nsAppId), nsAppId) == GIF_ERROR) {
-        return GIF_ERROR;
+    else if(strcmp(argv[i], "--stats=json") == 0) {
+      printStats = true;
+      statsJson = true;
     }
-
-    unsigned char nsLoopBlock[] = {0x01, (unsigned char)(loopCount & 0xFF), (unsigned char)((loopCount >> 8) & 0xFF)};
-    if (EGifPutExtensionBlock(gifFile, sizeof(nsLoopBlock), nsLoopBlock) == GIF_ERROR) {
-        return GIF_ERROR;
+    else if(strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8]) {
+      traceFile = argv[i] + 8;
     }
-
-    if (EGifPutExtensionTrailer(gifFile) == GIF_ERROR) {
-        return GIF_ERROR;
+    else if(strcmp(argv[i], "--adaptive-clear") == 0) {
+      lzwOptions.adaptiveClear = true;
     }
+    else if(strcmp(argv[i], "--interlace") == 0) {
+      lzwOptions.interlace = true;
+    }
+    else if(strcmp(argv[i], "--no-compact-palette") == 0) {
+      compactPalette = false;
+    }
+    else if(strncmp(argv[i], "--lossy=", 8) == 0 && atoi(argv[i] + 8) >= 0) {
+      lzwOptions.lossy = atoi(argv[i] + 8);
+    }
+    else if(strcmp(argv[i], "--ss") == 0 && i + 1 < argc) {
+      timeRange = true;
+      startSeconds = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--t") == 0 && i + 1 < argc) {
+      timeRange = true;
+      durationSeconds = atof(argv[++i]);
+    }
+    else if(strncmp(argv[i], "--daemon=", 9) == 0 && argv[i][9]) {
+      daemonSocket = argv[i] + 9;
+    }
+    else if(strncmp(argv[i], "--workers=", 10) == 0 && atoi(argv[i] + 10) > 0) {
+      daemonWorkers = atoi(argv[i] + 10);
+    }
+    else if(strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8]) {
+      cache.dir = argv[i] + 8;
+    }
+    else if(strncmp(argv[i], "--cache-size=", 13) == 0 && atoi(argv[i] + 13) > 0) {
+      cache.maxBytes = (uint64_t)atoi(argv[i] + 13) << 20;
+    }
+    else if(strncmp(argv[i], "--max-memory=", 13) == 0 && atoi(argv[i] + 13) > 0) {
+      maxMemory = (uint64_t)atoi(argv[i] + 13) << 20;
+    }
+    else if(strncmp(argv[i], "--format=", 9) == 0) {
+      if(!ParseOutputFormat(argv[i] + 9, &format)) {
+        inputFile = nullptr;
+        break;
+      }
+    }
+    else if(strncmp(argv[i], "--poster=", 9) == 0 && argv[i][9]) {
+      posterFile = argv[i] + 9;
+    }
+    else if(strncmp(argv[i], "--contact-sheet=", 16) == 0 && argv[i][16]) {
+      contactSheetFile = argv[i] + 16;
+    }
+    else if(strncmp(argv[i], "--sprite-sheet=", 15) == 0 && argv[i][15]) {
+      spriteFile = argv[i] + 15;
+    }
+    else if(strncmp(argv[i], "--grid=", 7) == 0) {
+      if(!ParsePosterGrid(argv[i] + 7, &sheetColumns, &sheetRows)) {
+        inputFile = nullptr;
+        break;
+      }
+    }
+    else if(strncmp(argv[i], "--segments=", 11) == 0 && atoi(argv[i] + 11) > 0) {
+      segments = atoi(argv[i] + 11);
+    }
+    else if(strcmp(argv[i], "--keyframes") == 0) {
+      keyframesOnly = true;
+    }
+    else if(strcmp(argv[i], "--two-pass") == 0) {
+      twoPass = true;
+    }
+    else if(strncmp(argv[i], "--color-hysteresis=", 19) == 0) {
+      if(!ParseColorHysteresis(argv[i] + 19, &colorHysteresis)) {
+        inputFile = nullptr;
+        break;
+      }
+    }
+    else if(strncmp(argv[i], "--color-lookup=", 15) == 0) {
+      if(!ParseColorLookup(argv[i] + 15, &colorLookupBits)) {
+        inputFile = nullptr;
+        break;
+      }
+    }
+    else if(strcmp(argv[i], "--motion-vectors") == 0) {
+      sceneOptions.motionVectors = true;
+    }
+    else if(strcmp(argv[i], "--tile=8") == 0 || strcmp(argv[i], "--tile=16") == 0) {
+      sceneOptions.tileSize = atoi(argv[i] + 7);
+    }
+    else if(argv[i][0] != '-' && !inputFile) {
+      inputFile = argv[i];
+    }
+    else {
+      inputFile = nullptr;
+      break;
+    }
+  }
 
-    return GIF_OK;
-}
-
-
-int main(int argc, char** argv) {
-
-  if(argc != 2) {
-    fprintf(stderr, "Usage: %s <video-name.mp4>\n", argv[1]);
+  // hysteresis works on the indices of the two pass palette
+  if(colorHysteresis > 0 && !twoPass) {
+    fprintf(stderr, "--color-hysteresis needs --two-pass\n");
     return 1;
   }
 
-  AVFormatContext* formatContext = nullptr;
-  if(avformat_open_input(&formatContext, argv[1], nullptr, nullptr) < 0) {
-    fprintf(stderr, "cannot open file %s\n", argv[1]);
-    return 1;
+  if(daemonSocket) {
+    return RunDaemon(daemonSocket, daemonWorkers, cache.dir.size() > 0 ? &cache : nullptr, maxMemory);
   }
 
-  if(avformat_find_stream_info(formatContext, nullptr) < 0) {
-    fprintf(stderr, "cannot extract info from media file\n");
-    avformat_close_input(&formatContext);
+  if(!inputFile) {
+    fprintf(stderr, "Usage: %s [--ss seconds] [--t seconds] [--stats[=json]] [--trace=trace.json] [--adaptive-clear] [--lossy=n] [--interlace] [--no-compact-palette] [--tile=8|16] [--motion-vectors] [--two-pass] [--color-lookup=32|64|exact] [--color-hysteresis=n] [--keyframes] [--segments=n] [--format=gif|apng|webp] [--poster=file.png|jpg] [--contact-sheet=file.png|jpg] [--grid=4x4] [--cache=dir] [--cache-size=mb] [--max-memory=mb] <video-name.mp4>\n", argv[0]);
+    fprintf(stderr, "       %s --sprite-sheet=file.png|jpg [--grid=4x4] [--ss seconds] [--t seconds] [--stats[=json]] <video-name.mp4>\n", argv[0]);
+    fprintf(stderr, "       %s --daemon=/path/to.sock [--workers=n] [--cache=dir] [--cache-size=mb] [--max-memory=mb]\n", argv[0]);
     return 1;
   }
 
-  printf("Found %u streams\n", formatContext->nb_streams);
-
-  bool isVideo = false;
-  int videoStreamIndex = -1;
-  for(int i = 0; i < formatContext->nb_streams; ++i) {
-    if(formatContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-      isVideo = true;
-      videoStreamIndex = i;
-      break;
+  // sprites only decode a keyframe per tile and write no gif
+  if(spriteFile) {
+    VideoInput input;
+    if(OpenVideoInput(inputFile, &input, true) != 0) {
+      return 1;
+    }
+    ConvertStats stats = {};
+    SpriteOptions spriteOptions;
+    spriteOptions.path = spriteFile;
+    spriteOptions.columns = sheetColumns;
+    spriteOptions.rows = sheetRows;
+    spriteOptions.timeRange = timeRange;
+    spriteOptions.startSeconds = startSeconds;
+    spriteOptions.durationSeconds = durationSeconds;
+    if(printStats) spriteOptions.stats = &stats;
+    uint64_t startNs = MonotonicNs();
+    int ret = WriteSpriteSheet(&input, spriteOptions);
+    stats.wallNs = MonotonicNs() - startNs;
+    CloseVideoInput(&input);
+    if(printStats && ret == 0) {
+      ReportStats(stats, statsJson);
     }
+    return ret;
   }
 
-  if(!isVideo) {
-    fprintf(stderr, "The given media container does not contain a video stream\n");
-    avformat_close_input(&formatContext);
-    return 1;
+  // keyframes cannot be counted against frame numbers, without --ss/--t
+  // the preview covers the whole input
+  if(keyframesOnly) {
+    timeRange = true;
   }
 
-  printf("Found a video stream\n");
-  printf("Found %ld frames\n", formatContext->streams[videoStreamIndex]->nb_frames);
-
-  if(formatContext->streams[videoStreamIndex]->codecpar->codec_id != AV_CODEC_ID_H264) {
-    fprintf(stderr, "Only H264 codec is supported\n");
-    avformat_close_input(&formatContext);
-    return 1;
+  // a time range needs nothing from the file, a frame range is asked for
+  // against the stream's frame count so the container is opened first
+  VideoInput input;
+  int startFrameIndex = 0;
+  int noFramesToExtract = 0;
+  if(timeRange) {
+    if(durationSeconds > 0) printf("Cutting %.3fs starting at %.3fs\n", durationSeconds, startSeconds);
+    else printf("Cutting from %.3fs to the end\n", startSeconds);
   }
-
-  printf("Found an H264 encoded stream\n");
-
-  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
-  if(!codec) {
-    fprintf(stderr, "did not find a proper decoder for H264 codec\n");
-    avformat_close_input(&formatContext);
-    return 1;
+  else {
+    if(OpenVideoContainer(inputFile, &input, true) != 0) {
+      return 1;
+    }
+    int noFrames = input.noFrames;
+    printf("Found %d frames in this video\n", noFrames);
+    printf("from where do you want to put in the gif start 0 and end %d ?\n", noFrames);
+    scanf("%d", &startFrameIndex);
+    printf("what is no of frames to include (max %d frame)?\n", noFrames);
+    scanf("%d", &noFramesToExtract);
+    printf("Cutting mp4 from %d and cutting %d frames\n", startFrameIndex, noFramesToExtract);
   }
 
-  printf("Found a decoder\n");
-
-  AVCodecContext* codecContext = avcodec_alloc_context3(codec);
-  if(!codecContext) {
-    fprintf(stderr, "Unable to allocate a codec context\n");
-    avformat_close_input(&formatContext);
-    return 1;
+  ConvertOptions options;
+  options.startFrameIndex = startFrameIndex;
+  options.noFramesToExtract = noFramesToExtract;
+  options.timeRange = timeRange;
+  options.startSeconds = startSeconds;
+  options.durationSeconds = durationSeconds;
+  options.lzw = lzwOptions;
+  options.compactPalette = compactPalette;
+  options.scene = sceneOptions;
+  options.maxMemory = maxMemory;
+  options.twoPass = twoPass;
+  options.colorLookupBits = colorLookupBits;
+  options.colorHysteresis = colorHysteresis;
+  options.keyframesOnly = keyframesOnly;
+  options.format = format;
+  options.posterFile = posterFile;
+  options.contactSheetFile = contactSheetFile;
+  options.sheetColumns = sheetColumns;
+  options.sheetRows = sheetRows;
+  options.segments = segments;
+  std::string defaultOutput = std::string("output/out.") + OUTPUT_FORMAT_EXTENSIONS[format];
+  options.outputFile = defaultOutput.c_str();
+  const char* outputFile = options.outputFile;
+
+  // on a hit the decoder is never opened
+  char cacheKey[CACHE_KEY_LENGTH + 1];
+  std::string cacheTempPath;
+  if(cache.dir.size() > 0 && WritesPosters(options)) {
+    printf("Not using the cache, the poster needs a decode\n");
+    cache.dir.clear();
   }
-
-  if(avcodec_parameters_to_context(codecContext, formatContext->streams[videoStreamIndex]->codecpar) < 0) {
-    fprintf(stderr, "Failed to fill codec with read codec paras\n");
-    avcodec_free_context(&codecContext);
-    avformat_close_input(&formatContext);
-    return 1;
+  if(cache.dir.size() > 0) {
+    if(CacheOpen(cache) != 0 || CacheKeyFor(inputFile, options, cacheKey) != 0) {
+      fprintf(stderr, "cache disabled for this run\n");
+      cache.dir.clear();
+    }
+    else if(CacheFetch(cache, cacheKey, format, outputFile)) {
+      printf("Done (cached): %s\n", outputFile);
+      CloseVideoInput(&input);
+      return 0;
+    }
+    else {
+      cacheTempPath = CacheTempPath(cache, format);
+      options.outputFile = cacheTempPath.c_str();
+    }
   }
 
-  int width = formatContext->streams[videoStreamIndex]->codecpar->width;
-  int height = formatContext->streams[videoStreamIndex]->codecpar->height;
-  printf("Video size: %dx%d\n", width, height);
-
-  int noFrames = formatContext->streams[videoStreamIndex]->nb_frames;
-  printf("Found %d frames in this video\n", noFrames);
-  printf("from where do you want to put in the gif start 0 and end %d ?\n", noFrames);
-  int startFrameIndex = 0;
-  scanf("%d", &startFrameIndex);
-  printf("what is no of frames to include (max %d frame)?\n", noFrames);
-  int noFramesToExtract = 0;
-  scanf("%d", &noFramesToExtract);
-  printf("Cutting mp4 from %d and cutting %d frames\n", startFrameIndex, noFramesToExtract);
-  noFramesToExtract += startFrameIndex;
-
-  if(startFrameIndex < 0 || startFrameIndex >= noFramesToExtract || noFramesToExtract < 0 || noFramesToExtract > noFrames) {
-    fprintf(stderr, "Invalid frames range given\n");
-    avcodec_free_context(&codecContext);
-    avformat_close_input(&formatContext);
+  if(timeRange && OpenVideoContainer(inputFile, &input, true) != 0) {
     return 1;
   }
-
-  if(avcodec_open2(codecContext, codec, nullptr) < 0) {
-    fprintf(stderr, "unable to open the decoder\n");
-    avcodec_free_context(&codecContext);
-    avformat_close_input(&formatContext);
+  if(OpenVideoDecoder(&input, true, sceneOptions.motionVectors) != 0) {
     return 1;
   }
 
-  AVPacket packet;
-  int i = 0;
-  const char* outputFile = "output/out.gif";
-  int errCode = 0;
-  
-  GifFileType* gifFile = EGifOpenFileName(outputFile, false, &errCode);
-
-  if(!gifFile) {
-    fprintf(stderr, "Cannot open gif file: %s\n", GifErrorString(errCode));
+  ConvertStats stats = {};
+  if(printStats) {
+    options.stats = &stats;
   }
-
-  int noColors = 256;
-  ColorMapObject* colorMapObj = GifMakeMapObject(noColors, nullptr);
-
-  if(!colorMapObj) {
-    fprintf(stderr, "Cannot create a color map object\n");
+  if(traceFile) {
+    options.trace = CreateTraceRecorder();
   }
 
-  CreateColorMap(colorMapObj);
-
-  EGifSetGifVersion(gifFile, true);
-
-  int ret = EGifPutScreenDesc(gifFile, width, height, 8, 0, colorMapObj);
-
-  if(ret == GIF_ERROR) {
-    fprintf(stderr, "Cannot set screen description: %s\n", GifErrorString(ret));
-  }
+  int ret = ConvertToGifSegments(inputFile, &input, options, nullptr);
 
-  int loopCount = 0;
-  int res = WriteNetscapeLoopExtension(gifFile, loopCount);
-  if(res == GIF_ERROR) {
-    fprintf(stderr, "Cannot write loop extension block\n");
+  if(cache.dir.size() > 0) {
+    if(ret == 0) {
+      ret = CachePublish(cache, cacheKey, format, cacheTempPath.c_str(), outputFile);
+    }
+    else {
+      unlink(cacheTempPath.c_str());
+    }
   }
 
-  int counter = 0;
-  u_int8_t* prevFrame = new u_int8_t[width * height];
-  bool hasCopiedPrevFrame = false;
-  printf("Converting mp4 to gif...\n");
-
-  while(av_read_frame(formatContext, &packet) == 0) {
-    if(packet.stream_index == videoStreamIndex) {
-      AVFrame * frame = av_frame_alloc();
-    
-      if(avcodec_send_packet(codecContext, &packet) < 0) {
-      	av_frame_free(&frame);
-	      continue;
-      }
-
-      if(avcodec_receive_frame(codecContext, frame) == 0) {
-        if(counter >= startFrameIndex && counter < noFramesToExtract && (counter % 2) == 0) {
-          if(!hasCopiedPrevFrame) {
-            hasCopiedPrevFrame = true;
-            memcpy(prevFrame, frame->data[0], width * height);
-
-            ret = EGifPutImageDesc(gifFile, 0, 0, width, height, false, nullptr);
-            for(int j = 0; j < height; ++j) {
-              ret = EGifPutLine(gifFile, frame->data[0] + width*j, width);
-            }
-          }
-          else {
-            hasCopiedPrevFrame = false;
-            int framesDiffRatio = GetFramesRepeatRatio(prevFrame, frame->data[0], width * height);
-
-            if(framesDiffRatio >= FRAMES_DIFF_RATIO) {
-              ret = EGifPutImageDesc(gifFile, 0, 0, width, height, false, nullptr);
-              for(int j = 0; j < height; ++j) {
-                ret = EGifPutLine(gifFile, frame->data[0] + width*j, width);
-              }
-            }
-          }
-        }
-        ++counter;
-      }
-
-      av_frame_free(&frame);
+  if(options.trace) {
+    if(ret == 0) {
+      WriteChromeTrace(options.trace, traceFile);
     }
-    av_packet_unref(&packet);
-    ++i;
+    FreeTraceRecorder(options.trace);
   }
 
-  EGifCloseFile(gifFile, NULL);
-  GifFreeMapObject(colorMapObj);
-  delete[] prevFrame;
-
-  printf("Done: output/out.gif\n");
+  if(printStats && ret == 0) {
+    ReportStats(stats, statsJson);
+  }
 
-  avcodec_free_context(&codecContext);
-  avformat_close_input(&formatContext);
-  return 0;
+  CloseVideoInput(&input);
+  return ret;
 }